@@ -45,18 +45,108 @@ SWITCH_MODULE_DEFINITION(mod_nats, mod_nats_load, mod_nats_shutdown, NULL);
 
 mod_nats_globals_t mod_nats_globals;
 
+#define NATS_API_SYNTAX "status [<profile>] [json] | reload | bench <profile>[,<profile>...] <bench_url> [<events>] [<threads>] [<headers>] [<value_size>]"
+
+SWITCH_STANDARD_API(mod_nats_api)
+{
+	char *mycmd = NULL;
+	char *argv[8] = {0};
+	int argc = 0, i;
+
+	if (!zstr(cmd))
+	{
+		mycmd = strdup(cmd);
+		argc = switch_separate_string(mycmd, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
+	}
+
+	if (argc >= 1 && !strcasecmp(argv[0], "status"))
+	{
+		const char *profile_name = NULL;
+		switch_bool_t json = SWITCH_FALSE;
+
+		for (i = 1; i < argc; i++)
+		{
+			if (!strcasecmp(argv[i], "json"))
+			{
+				json = SWITCH_TRUE;
+			}
+			else
+			{
+				profile_name = argv[i];
+			}
+		}
+		switch_thread_rwlock_rdlock(mod_nats_globals.profiles_rwlock);
+		mod_nats_stats_status(profile_name, json, stream);
+		switch_thread_rwlock_unlock(mod_nats_globals.profiles_rwlock);
+	}
+	else if (argc >= 1 && !strcasecmp(argv[0], "reload"))
+	{
+		if (mod_nats_do_config(SWITCH_TRUE) == SWITCH_STATUS_SUCCESS)
+		{
+			stream->write_function(stream, "+OK reloaded\n");
+		}
+		else
+		{
+			stream->write_function(stream, "-ERR cannot reload nats.conf, check the log\n");
+		}
+	}
+	else if (argc >= 3 && !strcasecmp(argv[0], "bench"))
+	{
+		/* The copies publish for real, on the bench servers only */
+		int events = argc > 3 ? atoi(argv[3]) : 100000;
+		int threads = argc > 4 ? atoi(argv[4]) : 4;
+		int headers = argc > 5 ? atoi(argv[5]) : 100;
+		int value_size = argc > 6 ? atoi(argv[6]) : 32;
+
+		if (events <= 0 || threads <= 0 || threads > 256 || headers < 0 || value_size < 0)
+		{
+			stream->write_function(stream, "-ERR invalid bench arguments\n");
+		}
+		else
+		{
+			mod_nats_bench(argv[1], argv[2], events, threads, headers, value_size, stream);
+		}
+	}
+	else
+	{
+		stream->write_function(stream, "-USAGE: nats %s\n", NATS_API_SYNTAX);
+	}
+
+	switch_safe_free(mycmd);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(mod_nats_request_function)
+{
+	return mod_nats_request_api(cmd, stream);
+}
+
+SWITCH_STANDARD_APP(mod_nats_request_function_app)
+{
+	mod_nats_request_app(session, data);
+}
+
 /* ------------------------------
    Startup
    ------------------------------
 */
 SWITCH_MODULE_LOAD_FUNCTION(mod_nats_load)
 {
+	switch_api_interface_t *api_interface;
+	switch_application_interface_t *app_interface;
 
 	memset(&mod_nats_globals, 0, sizeof(mod_nats_globals_t));
 	*module_interface = switch_loadable_module_create_module_interface(pool, modname);
 
 	mod_nats_globals.pool = pool;
 	switch_core_hash_init(&(mod_nats_globals.publisher_hash));
+	mod_nats_encode_init(pool);
+	switch_mutex_init(&mod_nats_globals.reload_mutex, SWITCH_MUTEX_NESTED, pool);
+	if (switch_thread_rwlock_create(&mod_nats_globals.profiles_rwlock, pool) != SWITCH_STATUS_SUCCESS ||
+		mod_nats_dispatch_init(pool) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_GENERR;
+	}
 
 	/* Create publisher profiles */
 	if (mod_nats_do_config(SWITCH_FALSE) != SWITCH_STATUS_SUCCESS)
@@ -64,6 +154,14 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_nats_load)
 		return SWITCH_STATUS_GENERR;
 	}
 
+	SWITCH_ADD_API(api_interface, "nats", "mod_nats commands", mod_nats_api, NATS_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "nats_request", "NATS request-reply", mod_nats_request_function, NATS_REQUEST_SYNTAX);
+	SWITCH_ADD_APP(app_interface, "nats_request", "NATS request-reply", "Send a request over NATS and set the fields of the reply as channel variables",
+				   mod_nats_request_function_app, NATS_REQUEST_SYNTAX, SAF_SUPPORT_NOMEDIA | SAF_ROUTING_EXEC);
+	switch_console_set_complete("add nats status");
+	switch_console_set_complete("add nats reload");
+	switch_console_set_complete("add nats bench");
+
 	return SWITCH_STATUS_SUCCESS;
 }
 
@@ -77,15 +175,22 @@ SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_nats_shutdown)
 	mod_nats_publisher_profile_t *publisher;
 
 	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Mod starting shutting down\n");
-	switch_event_unbind_callback(mod_nats_publisher_event_handler);
 
+	/* Each profile stops receiving events before it is destroyed */
+	switch_mutex_lock(mod_nats_globals.reload_mutex);
+	switch_thread_rwlock_wrlock(mod_nats_globals.profiles_rwlock);
 	while ((hi = switch_core_hash_first_iter(mod_nats_globals.publisher_hash, hi)))
 	{
 		switch_core_hash_this(hi, NULL, NULL, (void **)&publisher);
+		switch_core_hash_delete(mod_nats_globals.publisher_hash, publisher->name);
 		mod_nats_publisher_destroy(&publisher);
 	}
+	switch_thread_rwlock_unlock(mod_nats_globals.profiles_rwlock);
+	switch_mutex_unlock(mod_nats_globals.reload_mutex);
 
 	switch_core_hash_destroy(&(mod_nats_globals.publisher_hash));
+	mod_nats_dispatch_shutdown();
+	mod_nats_encode_shutdown();
 
 	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Mod finished shutting down\n");
 	return SWITCH_STATUS_SUCCESS;
@@ -45,51 +45,484 @@
 #include <strings.h>
 
 #define NATS_MAX_SERVERS 10
+#define NATS_MAX_WORKERS 64
+#define NATS_MAX_LINKS 16
+#define NATS_MAX_COMMAND_WORKERS 64
+#define NATS_COMMAND_DEFAULT_ALLOW "status,show,uptime,version,hostname,module_exists,uuid_exists"
+#define NATS_MAX_PROFILES 32
+/* A reload replacing a profile dispatches to both for a moment */
+#define NATS_MAX_DISPATCH (NATS_MAX_PROFILES + 1)
+#define NATS_CACHE_LINE 64
+#define NATS_RING_BATCH 64
+#define NATS_MAX_BATCH 4096
+#define NATS_DICTIONARY_VERSION "1"
+#define NATS_REQUEST_SYNTAX "<profile> <subject> [<timeout_ms>] [<payload>]"
+#define NATS_PROJECTED_SIZE 1024
+#define NATS_SLAB_CLASSES 7
+#define NATS_SLAB_MIN_SHIFT 8
+#define NATS_SLAB_CLASS_BYTES (2 * 1024 * 1024)
+#define NATS_CONFLATE_KEY_SIZE 64
+#define NATS_MAX_LANES 8
+#define NATS_BACKPRESSURE_INTERVAL_MS 20
+#define NATS_XML_SHARDS 16
+#define NATS_XML_KEY_SIZE 1024
+#define NATS_STAT_INC(var) __atomic_fetch_add(&(var), 1, __ATOMIC_RELAXED)
+#define NATS_STAT_ADD(var, n) __atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define NATS_STAT_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define NATS_HISTOGRAM_SUB_BITS 4
+#define NATS_HISTOGRAM_MAX_BITS 36
+#define NATS_HISTOGRAM_BUCKETS ((NATS_HISTOGRAM_MAX_BITS - NATS_HISTOGRAM_SUB_BITS + 1) << NATS_HISTOGRAM_SUB_BITS)
 
+typedef enum
+{
+  NATS_ENCODING_JSON = 0,
+  NATS_ENCODING_MSGPACK
+} mod_nats_encoding_t;
+
+typedef enum
+{
+  NATS_COMPRESSION_NONE = 0,
+  NATS_COMPRESSION_LZ4,
+  NATS_COMPRESSION_ZSTD
+} mod_nats_compression_t;
+
+typedef enum
+{
+  NATS_BACKPRESSURE_FULL = 0,
+  NATS_BACKPRESSURE_SAMPLING,
+  NATS_BACKPRESSURE_PRIORITY,
+  NATS_BACKPRESSURE_DROP
+} mod_nats_backpressure_level_t;
+
+typedef struct
+{
+  size_t sequence;
+  void *data;
+} __attribute__((aligned(NATS_CACHE_LINE))) mod_nats_ring_slot_t;
+
+/* Bounded lock-free queue, many event threads push while one publisher worker pops.
+ * The producer and consumer positions live on separate cache lines.
+ */
+typedef struct mod_nats_ring_s
+{
+  mod_nats_ring_slot_t *slots;
+  size_t mask;
+  unsigned int capacity;
+  /* Ring whose mutex, condition and sleeping flag wake up the consumer, itself unless linked */
+  struct mod_nats_ring_s *signal;
+  switch_mutex_t *mutex;
+  switch_thread_cond_t *cond;
+  size_t head __attribute__((aligned(NATS_CACHE_LINE)));
+  size_t tail __attribute__((aligned(NATS_CACHE_LINE)));
+  int sleeping __attribute__((aligned(NATS_CACHE_LINE)));
+} mod_nats_ring_t;
+
+/* Free lists of message blocks of a worker, one per payload size class */
+typedef struct
+{
+  mod_nats_ring_t *free[NATS_SLAB_CLASSES];
+} mod_nats_slab_t;
+
+/* A queued message and its payload come from a single allocation, the payload is always
+ * NUL terminated but payload_len is what gets published. A message shared by several profiles
+ * is immutable once queued and released with its last reference.
+ */
 typedef struct
 {
-  char *evname;
-  char *pjson;
+  unsigned int refs;
+  /* Slab and size class of the block, NULL and -1 for heap blocks */
+  mod_nats_slab_t *slab;
+  int size_class;
+  switch_event_types_t event_id;
+  mod_nats_encoding_t encoding;
+  /* The worker of the message is shard % publisher_workers. It is the hash of the Unique-ID of
+   * the event, so a call keeps its worker across a reload or a spill, and any value otherwise.
+   */
+  uint16_t shard;
+  /* Duplicate of the original event when serialization is offloaded to the publisher workers */
+  switch_event_t *event;
+  /* When the event was queued, 0 for replayed messages */
+  switch_time_t enqueued;
+  size_t payload_len;
+  size_t payload_size;
+  char payload[];
 } mod_nats_message_t;
 
+/* Failover state of an open connection, updated from the nats.c connection callbacks. It follows
+ * the natsConnection when a reload takes it over. One reference belongs to the connection and one
+ * to its closed callback, the last one released frees it.
+ */
+typedef struct
+{
+  int refs;
+  char name[128];
+  switch_time_t disconnected;
+  uint64_t reconnects;
+  uint64_t failover_us;
+  int discovered;
+} mod_nats_connection_health_t;
+
+/* A cluster: nats.c fails over between its servers (and the ones they advertise) by itself, the
+ * next connection of the list is only tried once it gives up.
+ */
 typedef struct mod_nats_connection_s
 {
   char *name;
   natsConnection *connection;
+  mod_nats_connection_health_t *health;
   char *nats_servers[NATS_MAX_SERVERS];
+  int server_count;
+  int connect_timeout_ms;
+  int reconnect_wait_ms;
+  int max_reconnect;
+  switch_bool_t ignore_discovered;
+  uint64_t connects;
+  uint64_t connect_failures;
   struct mod_nats_connection_s *next;
 } mod_nats_connection_t;
 
+/* Disk spill log of a profile, see mod_nats_spill.c */
 typedef struct
 {
+  switch_memory_pool_t *pool;
+  char *dir;
   char *name;
-  char *subject;
+  size_t segment_size;
+  size_t max_size;
+  size_t disk_used;
+  switch_mutex_t *mutex;
+  int spilling;
+  uint64_t write_seq;
+  int write_fd;
+  char *write_map;
+  size_t write_size;
+  size_t write_off;
+  uint64_t read_seq;
+  int read_fd;
+  char *read_map;
+  size_t read_size;
+  size_t read_off;
+  /* Where the replay resumes on the next start, see mod_nats_spill_release */
+  int offset_fd;
+  uint64_t *offset_map;
+  size_t resume_off;
+  switch_bool_t held;
+  uint64_t spilled;
+  uint64_t replayed;
+  uint64_t dropped;
+} mod_nats_spill_t;
+
+/* Compiled list of header names and name prefixes */
+typedef struct mod_nats_name_list_s
+{
+  /* The list as configured, to tell equivalent projections of different profiles apart */
+  char *spec;
+  switch_hash_t *names;
+  char **prefixes;
+  int prefix_count;
+  struct mod_nats_name_list_s *next;
+} mod_nats_name_list_t;
+
+/* Header projection of an event type, see mod_nats_projection.c. A header is published when it
+ * matches the allow list (if any) and none of the deny lists.
+ */
+typedef struct
+{
+  mod_nats_name_list_t *allow;
+  mod_nats_name_list_t *deny[2];
+} mod_nats_projection_t;
+
+/* Token bucket of an event type (or CUSTOM subclass), see mod_nats_ratelimit.c */
+typedef struct mod_nats_rate_limit_s
+{
+  char *name;
+  char *subclass;
+  switch_time_t interval;
+  switch_time_t tolerance;
+  switch_time_t tat;
+  uint64_t throttled;
+  struct mod_nats_rate_limit_s *next;
+} mod_nats_rate_limit_t;
+
+/* Log-linear latency histogram in microseconds (HdrHistogram style): every power of two range
+ * is split into 2^NATS_HISTOGRAM_SUB_BITS buckets, about 6% precision up to 2^36us.
+ */
+typedef struct
+{
+  uint64_t counts[NATS_HISTOGRAM_BUCKETS];
+  uint64_t sum;
+  uint64_t max;
+} mod_nats_histogram_t;
+
+/* Statistics of a publisher worker, see mod_nats_stats.c. The first counters are incremented
+ * atomically by the event threads, the others are only written by the worker thread.
+ */
+typedef struct
+{
+  uint64_t enqueued;
+  uint64_t spilled;
+  uint64_t conflated;
+  uint64_t published __attribute__((aligned(NATS_CACHE_LINE)));
+  uint64_t publish_errors;
+  uint64_t serialize_errors;
+  uint64_t bytes;
+  mod_nats_histogram_t latency;
+} mod_nats_worker_stats_t;
+
+/* Message held by a conflation window, see mod_nats_conflate.c */
+typedef struct mod_nats_conflate_entry_s
+{
+  char key[NATS_CONFLATE_KEY_SIZE];
+  mod_nats_message_t *msg;
+  switch_time_t deadline;
+  struct mod_nats_conflate_entry_s *next;
+} mod_nats_conflate_entry_t;
+
+/* Priority lane of a profile, see mod_nats_lane.c */
+typedef struct
+{
+  char *name;
+  int weight;
+  unsigned int queue_size;
+  uint64_t evicted;
+} mod_nats_lane_t;
+
+/* Reply of an XML lookup, see mod_nats_xml.c. While pending, the lookup is in flight and the
+ * identical ones wait for it.
+ */
+typedef struct
+{
+  char *key;
+  /* XML text of the reply, NULL when the backend had nothing or the lookup failed */
+  char *text;
+  switch_time_t expires;
+  switch_bool_t pending;
+  switch_bool_t failed;
+  int waiters;
+} mod_nats_xml_entry_t;
+
+typedef struct
+{
+  switch_mutex_t *mutex;
+  switch_thread_cond_t *cond;
+  switch_hash_t *entries;
+  unsigned int count;
+} mod_nats_xml_shard_t;
+
+struct mod_nats_publisher_profile_s;
+
+/* One of the connection_count NATS connections of a profile, each with its own copy of the
+ * configured connections to fail over through. The workers publish on conn_active while holding
+ * conn_rwlock for reading. Opening or closing the connection (and the JetStream context bound to
+ * it) requires the write lock.
+ */
+typedef struct
+{
+  int id;
+  mod_nats_connection_t *conn_root;
+  mod_nats_connection_t *conn_active;
+  switch_thread_rwlock_t *conn_rwlock;
+  switch_time_t reconnect_time;
+  jsCtx *js;
+  jsErrCode jerr;
   switch_bool_t jetstream_connected;
+  uint64_t disconnects;
+} mod_nats_link_t;
+
+typedef struct
+{
+  int id;
+  struct mod_nats_publisher_profile_s *profile;
+  /* Link this worker publishes on, shared with the workers of the same id modulo connection_count */
+  mod_nats_link_t *link;
+  switch_thread_t *thread;
+  /* One ring per priority lane, queued counts the messages of all lanes against queue_capacity */
+  mod_nats_ring_t *send_queues[NATS_MAX_LANES];
+  unsigned int queue_capacity;
+  unsigned int queued;
+  int lane_current;
+  int lane_credit;
+  mod_nats_message_t **batch;
+  /* Unsent messages left at the start of batch when the worker stopped for a reload */
+  unsigned int held;
+  /* Messages taken over from the profile this one replaced, published before the lanes */
+  mod_nats_ring_t *handover;
+  mod_nats_slab_t *slab;
+  /* Compression context and output buffer, see mod_nats_compress.c */
+  void *compress_ctx;
+  char *compress_buf;
+  size_t compress_size;
+  /* Open conflation windows of the calls of this worker, conflate_deadline is the earliest one
+   * (0 when none) so the worker can check it without taking the mutex.
+   */
+  switch_mutex_t *conflate_mutex;
+  switch_hash_t *conflate_hash;
+  mod_nats_conflate_entry_t *conflate_head;
+  mod_nats_conflate_entry_t *conflate_tail;
+  switch_time_t conflate_deadline;
+  mod_nats_worker_stats_t stats;
+} mod_nats_publisher_worker_t;
+
+/* Closure of the JetStream ack handler, in the pool of the profile. An ack being handled while
+ * the profile goes away finds it detached, and nothing is left pending once its contexts are
+ * destroyed, see mod_nats_publisher_jetstream_complete.
+ */
+typedef struct
+{
+  switch_mutex_t *mutex;
+  struct mod_nats_publisher_profile_s *profile;
+} mod_nats_jetstream_ack_t;
+
+typedef struct mod_nats_publisher_profile_s
+{
+  char *name;
+  /* The profile configuration as loaded, nats reload only replaces profiles whose XML changed */
+  char *config_xml;
+  char *subject;
   switch_bool_t jetstream_enabled;
   char *jetstream_name;
   char *jetstream_subject;
-  jsCtx *js;
-  jsErrCode jerr;
-  /* Array to store the possible event subscriptions */
+  /* Final JetStream subject of each event type, built once when the profile is created */
+  char *event_subjects[SWITCH_EVENT_ALL];
+  /* Asynchronous JetStream publishing: at most jetstream_max_pending messages wait for their
+   * PubAck. Failed publishes are queued in jetstream_retry_queue and published again by the
+   * workers, up to jetstream_max_retries times.
+   */
+  int jetstream_max_pending;
+  int jetstream_max_retries;
+  int jetstream_complete_timeout_ms;
+  mod_nats_ring_t *jetstream_retry_queue;
+  mod_nats_jetstream_ack_t *jetstream_ack;
+  uint64_t jetstream_published;
+  uint64_t jetstream_stored;
+  uint64_t jetstream_failed;
+  uint64_t jetstream_retried;
+  /* Subscribed event types and CUSTOM subclasses, the events are bound once for all the profiles
+   * by mod_nats_dispatch.c. A subscription to CUSTOM takes every subclass.
+   */
   int event_subscriptions;
-  switch_event_node_t *event_nodes[SWITCH_EVENT_ALL];
-  switch_event_types_t event_ids[SWITCH_EVENT_ALL];
+  switch_bool_t subscribed[SWITCH_EVENT_ALL];
+  switch_hash_t *subclasses;
+  switch_bool_t dispatched;
 
-  /* Because only the 'running' thread will be reading or writing to the two connection pointers
-   * this does not 'yet' need a read/write lock. Before these structures can be destroyed,
-   * the running thread must be joined first.
+  /* The connections of the profile, each reconnects on its own so a failed one only holds up
+   * the workers publishing on it. The command channel lives on the first one. Before the links
+   * can be destroyed, all worker threads must be joined first.
    */
-  mod_nats_connection_t *conn_root;
-  mod_nats_connection_t *conn_active;
-  switch_thread_t *publisher_thread;
-  switch_queue_t *send_queue;
+  mod_nats_link_t *links;
+  int link_count;
+
+  /* Each worker owns a bounded FIFO queue. Events are sharded by Unique-ID so the events of a
+   * call are always published by the same worker, in order.
+   */
+  mod_nats_publisher_worker_t *workers;
+  int worker_count;
+  unsigned int worker_next;
   unsigned int send_queue_size;
+  switch_bool_t serialize_in_worker;
+  mod_nats_encoding_t encoding;
+
+  /* Payloads of at least compression_threshold bytes are compressed by the workers */
+  mod_nats_compression_t compression;
+  size_t compression_threshold;
+  int compression_level;
+  void *compression_dict;
+  unsigned int compression_dict_id;
+
+  /* Headers published for each event type, NULL publishes them all */
+  mod_nats_projection_t *projections[SWITCH_EVENT_ALL];
+  mod_nats_name_list_t *projection_lists;
+
+  /* Priority lanes, from the highest priority to the lowest, and the lane of each event type */
+  mod_nats_lane_t lanes[NATS_MAX_LANES];
+  int lane_count;
+  switch_bool_t lane_strict;
+  int8_t event_lanes[SWITCH_EVENT_ALL];
+
+  /* Event types whose events of a call are conflated within conflate_window_ms */
+  switch_bool_t conflate[SWITCH_EVENT_ALL];
+  switch_bool_t conflate_enabled;
+  int conflate_window_ms;
+
+  /* Rate limits of each event type, subclass specific ones first, NULL when unlimited */
+  mod_nats_rate_limit_t *rate_limits[SWITCH_EVENT_ALL];
+
+  /* Batch mode: drain up to batch_size messages, waiting at most batch_linger_ms for the batch
+   * to fill up, publish them back to back and flush the connection once per batch.
+   */
+  unsigned int batch_size;
+  int batch_linger_ms;
+  int batch_flush_timeout_ms;
+
+  /* Optional spill log for the events that do not fit in the send queues, replayed in order
+   * at spill_replay_rate events per second once connected.
+   */
+  mod_nats_spill_t *spill;
+  switch_thread_t *spill_thread;
+  int spill_replay_rate;
+  /* The spill log of the spill_dir used before a reload, replayed ahead of the new one */
+  mod_nats_spill_t *spill_drain;
+
+  /* Adaptive backpressure, see mod_nats_backpressure.c. The level is read by every event thread,
+   * the other state is only written by the thread that wins backpressure_next.
+   */
+  mod_nats_backpressure_level_t backpressure_level;
+  switch_time_t backpressure_next;
+  switch_time_t backpressure_sampled;
+  switch_time_t backpressure_changed;
+  uint64_t backpressure_published;
+  int backpressure_high_watermark;
+  int backpressure_low_watermark;
+  int backpressure_max_drain_ms;
+  int backpressure_hold_ms;
+  unsigned int backpressure_sample_rate;
+  unsigned int backpressure_sample_seq;
+  switch_bool_t backpressure_priority[SWITCH_EVENT_ALL];
+  uint64_t backpressure_escalations;
+  uint64_t backpressure_shed;
+  switch_time_t drop_logged;
+
+  /* Inbound command channel, see mod_nats_command.c. command_sub is only changed while holding
+   * the conn_rwlock of the first link for writing, along with the connection it belongs to.
+   */
+  char *command_subject;
+  char *command_queue_group;
+  int command_workers;
+  unsigned int command_queue_size;
+  switch_hash_t *command_allow;
+  switch_queue_t *command_queue;
+  switch_thread_t **command_threads;
+  natsSubscription *command_sub;
+  uint64_t commands_executed;
+  uint64_t commands_rejected;
+
+  /* XML lookups served over NATS, see mod_nats_xml.c */
+  char *xml_subject;
+  switch_xml_section_t xml_sections;
+  int xml_timeout_ms;
+  int xml_cache_ttl_ms;
+  int xml_negative_ttl_ms;
+  unsigned int xml_cache_size;
+  char **xml_cache_key;
+  int xml_cache_key_count;
+  mod_nats_xml_shard_t *xml_shards;
+  switch_xml_binding_t *xml_binding;
+  uint64_t xml_hits;
+  uint64_t xml_misses;
+  uint64_t xml_coalesced;
+  uint64_t xml_errors;
 
   int reconnect_interval_ms;
-  int circuit_breaker_ms;
-  switch_time_t circuit_breaker_reset_time;
+  uint64_t dropped;
+  uint64_t disconnects;
 
   switch_bool_t running;
+  /* Set while a reload replaces the profile, its threads stop without dropping anything */
+  switch_bool_t retiring;
+  /* Held by mod_nats_publisher_create until the profile took over, its threads wait on it */
+  switch_mutex_t *start_mutex;
+  /* Read locked by the requests using the profile, mod_nats_publisher_destroy waits for them */
+  switch_thread_rwlock_t *rwlock;
   switch_memory_pool_t *pool;
 } mod_nats_publisher_profile_t;
 
@@ -97,24 +530,170 @@ typedef struct mod_nats_globals_s
 {
   switch_memory_pool_t *pool;
   switch_hash_t *publisher_hash;
+  /* Held for writing while profiles are added to or removed from publisher_hash, never while one
+   * starts or stops, so readers are not held up by a reload
+   */
+  switch_thread_rwlock_t *profiles_rwlock;
+  /* Serializes the loading of nats.conf */
+  switch_mutex_t *reload_mutex;
+  /* Profiles events are dispatched to and the event bindings they share, see mod_nats_dispatch.c */
+  switch_thread_rwlock_t *dispatch_rwlock;
+  mod_nats_publisher_profile_t *dispatch_profiles[NATS_MAX_DISPATCH];
+  int dispatch_count;
+  switch_mutex_t *dispatch_mutex;
+  switch_event_node_t *dispatch_nodes[SWITCH_EVENT_ALL];
+  int dispatch_refs[SWITCH_EVENT_ALL];
+  switch_hash_t *dispatch_subclasses;
+  /* Header names interned by the binary encodings */
+  switch_hash_t *dictionary;
+  /* Message allocations are only counted while nats bench runs */
+  int bench_running;
+  uint64_t msg_allocs;
+  uint64_t msg_reallocs;
 } mod_nats_globals_t;
 
 extern mod_nats_globals_t mod_nats_globals;
 
 /* utils */
 switch_status_t mod_nats_do_config(switch_bool_t reload);
+switch_status_t mod_nats_util_slab_create(mod_nats_slab_t **slab, unsigned int max_blocks, switch_memory_pool_t *pool);
+void mod_nats_util_slab_destroy(mod_nats_slab_t *slab);
+mod_nats_message_t *mod_nats_util_msg_create(mod_nats_slab_t *slab, size_t payload_size);
+switch_status_t mod_nats_util_msg_reserve(mod_nats_message_t **msg, size_t len);
 void mod_nats_util_msg_destroy(mod_nats_message_t **msg);
+switch_status_t mod_nats_util_msg_serialize(mod_nats_message_t **msg);
+switch_status_t mod_nats_util_event_dup(switch_event_t **event, switch_event_t *todup, const mod_nats_projection_t *projection);
+uint32_t mod_nats_util_hash(const char *str);
+uint16_t mod_nats_util_shard(const char *uuid);
+
+/* encode */
+void mod_nats_encode_init(switch_memory_pool_t *pool);
+void mod_nats_encode_shutdown(void);
+const char *mod_nats_encoding_name(mod_nats_encoding_t encoding);
+switch_status_t mod_nats_encoding_parse(const char *name, mod_nats_encoding_t *encoding);
+size_t mod_nats_encode_size(switch_event_t *evt, mod_nats_encoding_t encoding, const mod_nats_projection_t *projection);
+switch_status_t mod_nats_encode(mod_nats_message_t **msg, switch_event_t *evt, const mod_nats_projection_t *projection);
+size_t mod_nats_encode_json_size(switch_event_t *evt);
+switch_status_t mod_nats_encode_json(mod_nats_message_t **msg, switch_event_t *evt, const mod_nats_projection_t *projection);
+switch_status_t mod_nats_encode_msgpack(mod_nats_message_t **msg, switch_event_t *evt, const mod_nats_projection_t *projection);
+
+/* projection */
+switch_status_t mod_nats_projection_load(mod_nats_publisher_profile_t *profile, switch_xml_t cfg);
+void mod_nats_projection_destroy(mod_nats_publisher_profile_t *profile);
+switch_bool_t mod_nats_projection_match(const mod_nats_projection_t *projection, const char *name);
+switch_bool_t mod_nats_projection_equal(const mod_nats_projection_t *a, const mod_nats_projection_t *b);
+
+/* conflate */
+switch_status_t mod_nats_conflate_load(mod_nats_publisher_profile_t *profile, const char *events);
+switch_status_t mod_nats_conflate_worker_init(mod_nats_publisher_worker_t *worker, switch_memory_pool_t *pool);
+void mod_nats_conflate_worker_destroy(mod_nats_publisher_worker_t *worker);
+mod_nats_message_t *mod_nats_conflate_take(mod_nats_publisher_worker_t *worker, const char *uuid, switch_event_types_t event_id);
+void mod_nats_conflate_push(mod_nats_publisher_worker_t *worker, const char *uuid, mod_nats_message_t **msg, switch_time_t now);
+unsigned int mod_nats_conflate_expire(mod_nats_publisher_worker_t *worker, mod_nats_message_t **msgs, unsigned int max, switch_time_t now);
+
+/* backpressure */
+const char *mod_nats_backpressure_name(mod_nats_backpressure_level_t level);
+switch_status_t mod_nats_backpressure_init(mod_nats_publisher_profile_t *profile, const char *priority_events);
+void mod_nats_backpressure_update(mod_nats_publisher_profile_t *profile, switch_time_t now);
+switch_bool_t mod_nats_backpressure_admit(mod_nats_publisher_profile_t *profile, switch_event_t *evt, switch_time_t now);
+
+/* ratelimit */
+switch_status_t mod_nats_ratelimit_load(mod_nats_publisher_profile_t *profile, switch_xml_t cfg);
+switch_bool_t mod_nats_ratelimit_allow(mod_nats_publisher_profile_t *profile, switch_event_t *evt, switch_time_t now);
+uint64_t mod_nats_ratelimit_throttled(mod_nats_publisher_profile_t *profile);
+
+/* lane */
+switch_status_t mod_nats_lane_load(mod_nats_publisher_profile_t *profile, switch_xml_t cfg);
+switch_status_t mod_nats_lane_worker_init(mod_nats_publisher_worker_t *worker, unsigned int queue_size, switch_memory_pool_t *pool);
+void mod_nats_lane_worker_destroy(mod_nats_publisher_worker_t *worker);
+switch_status_t mod_nats_lane_push(mod_nats_publisher_worker_t *worker, mod_nats_message_t *msg, switch_bool_t evict);
+unsigned int mod_nats_lane_pop_batch(mod_nats_publisher_worker_t *worker, mod_nats_message_t **msgs, unsigned int max);
+unsigned int mod_nats_lane_size(mod_nats_publisher_worker_t *worker);
+void mod_nats_lane_wait(mod_nats_publisher_worker_t *worker, switch_interval_time_t timeout);
+void mod_nats_lane_wake(mod_nats_publisher_worker_t *worker);
+
+/* compress */
+const char *mod_nats_compression_name(mod_nats_compression_t compression);
+switch_status_t mod_nats_compression_parse(const char *name, mod_nats_compression_t *compression);
+switch_status_t mod_nats_compress_init(mod_nats_publisher_profile_t *profile, const char *dictionary);
+void mod_nats_compress_shutdown(mod_nats_publisher_profile_t *profile);
+void mod_nats_compress_worker_destroy(mod_nats_publisher_worker_t *worker);
+switch_status_t mod_nats_compress(mod_nats_publisher_worker_t *worker, const char *data, size_t len, const char **out, size_t *out_len);
+
+/* stats */
+void mod_nats_stats_published(mod_nats_publisher_worker_t *worker, mod_nats_message_t *msg, switch_time_t now);
+void mod_nats_histogram_record(mod_nats_histogram_t *histogram, uint64_t value);
+uint64_t mod_nats_histogram_percentile(const uint64_t *counts, uint64_t total, double percentile);
+switch_status_t mod_nats_stats_status(const char *profile_name, switch_bool_t json, switch_stream_handle_t *stream);
+uint64_t mod_nats_stats_latency(mod_nats_publisher_profile_t *profile, uint64_t *counts, uint64_t *max);
+
+/* bench */
+switch_status_t mod_nats_bench(const char *profile_names, const char *url, int events, int threads, int headers, int value_size, switch_stream_handle_t *stream);
+
+/* spill */
+switch_status_t mod_nats_spill_create(mod_nats_spill_t **spill, const char *dir, const char *name, size_t segment_size, size_t max_size);
+void mod_nats_spill_limit(mod_nats_spill_t *spill, size_t max_size);
+void mod_nats_spill_destroy(mod_nats_spill_t **spill);
+switch_status_t mod_nats_spill_append(mod_nats_spill_t *spill, mod_nats_message_t *msg);
+switch_status_t mod_nats_spill_read(mod_nats_spill_t *spill, mod_nats_message_t **msg);
+void mod_nats_spill_release(mod_nats_spill_t *spill);
+switch_bool_t mod_nats_spill_active(mod_nats_spill_t *spill);
+
+/* ring */
+switch_status_t mod_nats_ring_create(mod_nats_ring_t **ring, unsigned int capacity, switch_memory_pool_t *pool);
+switch_status_t mod_nats_ring_trypush(mod_nats_ring_t *ring, void *data);
+switch_status_t mod_nats_ring_trypop(mod_nats_ring_t *ring, void **data);
+unsigned int mod_nats_ring_pop_batch(mod_nats_ring_t *ring, void **data, unsigned int max);
+unsigned int mod_nats_ring_size(mod_nats_ring_t *ring);
+void mod_nats_ring_link(mod_nats_ring_t *ring, mod_nats_ring_t *leader);
+void mod_nats_ring_wait(mod_nats_ring_t *ring, switch_interval_time_t timeout);
+void mod_nats_ring_wait_any(mod_nats_ring_t **rings, int count, switch_interval_time_t timeout);
+void mod_nats_ring_wake(mod_nats_ring_t *ring);
 
 /* connection */
 switch_status_t mod_nats_connection_create(mod_nats_connection_t **conn, switch_xml_t cfg, switch_memory_pool_t *pool);
 void mod_nats_connection_destroy(mod_nats_connection_t **conn);
+switch_bool_t mod_nats_connection_equal(const mod_nats_connection_t *a, const mod_nats_connection_t *b);
 void mod_nats_connection_close(mod_nats_connection_t *connection);
 switch_status_t mod_nats_connection_open(mod_nats_connection_t *connections, mod_nats_connection_t **active, char *profile_name);
 
+/* command */
+switch_status_t mod_nats_command_init(mod_nats_publisher_profile_t *profile, const char *allow);
+switch_status_t mod_nats_command_start(mod_nats_publisher_profile_t *profile, switch_threadattr_t *thd_attr);
+void mod_nats_command_subscribe(mod_nats_publisher_profile_t *profile);
+void mod_nats_command_unsubscribe(mod_nats_publisher_profile_t *profile, switch_bool_t drain);
+void mod_nats_command_stop(mod_nats_publisher_profile_t *profile);
+void mod_nats_command_handover(mod_nats_publisher_profile_t *old, mod_nats_publisher_profile_t *profile);
+void mod_nats_command_destroy(mod_nats_publisher_profile_t *profile);
+
+/* request */
+natsStatus mod_nats_request_profile(mod_nats_publisher_profile_t *profile, const char *subject, const char *payload, int timeout_ms, natsMsg **reply);
+void mod_nats_request_app(switch_core_session_t *session, const char *data);
+switch_status_t mod_nats_request_api(const char *cmd, switch_stream_handle_t *stream);
+
+/* xml */
+switch_status_t mod_nats_xml_init(mod_nats_publisher_profile_t *profile, const char *sections, const char *cache_key);
+switch_status_t mod_nats_xml_bind(mod_nats_publisher_profile_t *profile);
+void mod_nats_xml_destroy(mod_nats_publisher_profile_t *profile);
+
+/* dispatch */
+switch_status_t mod_nats_dispatch_init(switch_memory_pool_t *pool);
+void mod_nats_dispatch_shutdown(void);
+void mod_nats_dispatch_deliver(mod_nats_publisher_profile_t **profiles, int profile_count, switch_event_t *evt, switch_time_t now);
+void mod_nats_dispatch_event_handler(switch_event_t *evt);
+switch_status_t mod_nats_dispatch_add(mod_nats_publisher_profile_t *profile);
+void mod_nats_dispatch_remove(mod_nats_publisher_profile_t *profile);
+switch_status_t mod_nats_dispatch_replace(mod_nats_publisher_profile_t *old, mod_nats_publisher_profile_t *profile);
+
 /* publisher */
+switch_bool_t mod_nats_publisher_admit(mod_nats_publisher_profile_t *profile, switch_event_t *evt, switch_time_t now);
+void mod_nats_publisher_enqueue(mod_nats_publisher_profile_t *profile, switch_event_t *evt, mod_nats_message_t *message, switch_time_t now);
 void mod_nats_publisher_event_handler(switch_event_t *evt);
 switch_status_t mod_nats_publisher_destroy(mod_nats_publisher_profile_t **profile);
-switch_status_t mod_nats_publisher_create(char *name, switch_xml_t cfg);
+switch_status_t mod_nats_publisher_create(char *name, switch_xml_t cfg, mod_nats_publisher_profile_t *replaces, mod_nats_publisher_profile_t **detached);
+switch_bool_t mod_nats_publisher_connected(mod_nats_publisher_profile_t *profile);
+void mod_nats_publisher_wait_start(mod_nats_publisher_profile_t *profile);
 void *SWITCH_THREAD_FUNC mod_nats_publisher_thread(switch_thread_t *thread, void *data);
+void *SWITCH_THREAD_FUNC mod_nats_publisher_spill_thread(switch_thread_t *thread, void *data);
 
 #endif /* MOD_NATS_H */
@@ -0,0 +1,210 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+
+/* Adaptive backpressure. The event handler re-evaluates the profile every
+ * NATS_BACKPRESSURE_INTERVAL_MS (whichever event thread gets there first does it) from the queue
+ * fill of all the workers and the publish rate since the last evaluation:
+ *
+ *   - at or above backpressure_high_watermark percent full, and when the backlog would take more
+ *     than backpressure_max_drain_ms to publish at the current rate, go up one level, at most once
+ *     per backpressure_max_drain_ms so that the previous level gets a chance to work
+ *   - at or below backpressure_low_watermark percent full, and after backpressure_hold_ms at the
+ *     current level, go back to full delivery
+ *   - in between, stay at the current level
+ *
+ * The levels are full delivery, sampling (only one in backpressure_sample_rate events that are
+ * not priority events is kept), priority only, and drop. Priority events are the ones listed in
+ * backpressure_priority_events, or those of the first lane when lanes are configured. A queue that
+ * is about to drain never escalates, and a full one degrades gradually instead of blacking out.
+ * With lanes the level stops at priority only: a full worker makes room for priority events by
+ * evicting lower lanes, so they are never shed.
+ *
+ * Profiles with a spill log never shed, the events that do not fit go to disk instead.
+ */
+
+static const char *mod_nats_backpressure_names[] = {"full", "sampling", "priority", "drop"};
+
+const char *mod_nats_backpressure_name(mod_nats_backpressure_level_t level)
+{
+	return mod_nats_backpressure_names[level];
+}
+
+switch_status_t mod_nats_backpressure_init(mod_nats_publisher_profile_t *profile, const char *priority_events)
+{
+	int i;
+
+	if (profile->backpressure_low_watermark >= profile->backpressure_high_watermark)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] backpressure low watermark %d%% must be below the high one %d%%\n",
+						  profile->name, profile->backpressure_low_watermark, profile->backpressure_high_watermark);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (!zstr(priority_events))
+	{
+		char *argv[SWITCH_EVENT_ALL];
+		char *tmp = switch_core_strdup(profile->pool, priority_events);
+		int argc = switch_separate_string(tmp, ',', argv, (sizeof(argv) / sizeof(argv[0])));
+
+		for (i = 0; i < argc; i++)
+		{
+			switch_event_types_t type;
+
+			if (switch_name_event(argv[i], &type) != SWITCH_STATUS_SUCCESS || type == SWITCH_EVENT_ALL)
+			{
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] priority event [%s] was not recognised\n", profile->name, argv[i]);
+				return SWITCH_STATUS_FALSE;
+			}
+			profile->backpressure_priority[type] = SWITCH_TRUE;
+		}
+	}
+	else if (profile->lane_count > 1)
+	{
+		for (i = 0; i < SWITCH_EVENT_ALL; i++)
+		{
+			profile->backpressure_priority[i] = profile->event_lanes[i] == 0;
+		}
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Only run by the event thread that won the evaluation slot */
+void mod_nats_backpressure_update(mod_nats_publisher_profile_t *profile, switch_time_t now)
+{
+	switch_time_t next = __atomic_load_n(&profile->backpressure_next, __ATOMIC_RELAXED);
+	mod_nats_backpressure_level_t level, old_level, max_level;
+	uint64_t published = 0, rate = 0;
+	unsigned int depth = 0, fill;
+	switch_time_t elapsed;
+	int i;
+
+	if (now < next || !__atomic_compare_exchange_n(&profile->backpressure_next, &next, now + NATS_BACKPRESSURE_INTERVAL_MS * 1000, 0,
+												   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+
+	for (i = 0; i < profile->worker_count; i++)
+	{
+		depth += mod_nats_lane_size(&profile->workers[i]);
+		published += NATS_STAT_GET(profile->workers[i].stats.published);
+	}
+	elapsed = now - profile->backpressure_sampled;
+	if (profile->backpressure_sampled && elapsed > 0 && published >= profile->backpressure_published)
+	{
+		rate = (published - profile->backpressure_published) * 1000000 / elapsed;
+	}
+	profile->backpressure_sampled = now;
+	profile->backpressure_published = published;
+	if (profile->spill)
+	{
+		return;
+	}
+
+	fill = (unsigned int)((uint64_t)depth * 100 / profile->send_queue_size);
+	max_level = profile->lane_count > 1 ? NATS_BACKPRESSURE_PRIORITY : NATS_BACKPRESSURE_DROP;
+	level = old_level = __atomic_load_n(&profile->backpressure_level, __ATOMIC_RELAXED);
+	if (fill >= (unsigned int)profile->backpressure_high_watermark && level < max_level &&
+		now - profile->backpressure_changed >= (switch_time_t)profile->backpressure_max_drain_ms * 1000)
+	{
+		/* Milliseconds the backlog takes to publish at the current rate */
+		if (!rate || (uint64_t)depth * 1000 / rate > (uint64_t)profile->backpressure_max_drain_ms)
+		{
+			level++;
+		}
+	}
+	else if (fill <= (unsigned int)profile->backpressure_low_watermark && level > NATS_BACKPRESSURE_FULL &&
+			 now - profile->backpressure_changed >= (switch_time_t)profile->backpressure_hold_ms * 1000)
+	{
+		level = NATS_BACKPRESSURE_FULL;
+	}
+
+	if (level != old_level)
+	{
+		profile->backpressure_changed = now;
+		__atomic_store_n(&profile->backpressure_level, level, __ATOMIC_RELAXED);
+		if (level > old_level)
+		{
+			NATS_STAT_INC(profile->backpressure_escalations);
+		}
+		switch_log_printf(SWITCH_CHANNEL_LOG, level > old_level ? SWITCH_LOG_WARNING : SWITCH_LOG_INFO,
+						  "Profile[%s] backpressure %s -> %s, queues %u%% full, publishing %lu events/s\n", profile->name,
+						  mod_nats_backpressure_name(old_level), mod_nats_backpressure_name(level), fill, (unsigned long)rate);
+	}
+}
+
+/* Called by the event threads, SWITCH_FALSE when the event has to be shed */
+switch_bool_t mod_nats_backpressure_admit(mod_nats_publisher_profile_t *profile, switch_event_t *evt, switch_time_t now)
+{
+	if (now >= __atomic_load_n(&profile->backpressure_next, __ATOMIC_RELAXED))
+	{
+		mod_nats_backpressure_update(profile, now);
+	}
+
+	switch (__atomic_load_n(&profile->backpressure_level, __ATOMIC_RELAXED))
+	{
+	case NATS_BACKPRESSURE_FULL:
+		return SWITCH_TRUE;
+	case NATS_BACKPRESSURE_SAMPLING:
+		if (profile->backpressure_priority[evt->event_id] ||
+			__atomic_fetch_add(&profile->backpressure_sample_seq, 1, __ATOMIC_RELAXED) % profile->backpressure_sample_rate == 0)
+		{
+			return SWITCH_TRUE;
+		}
+		break;
+	case NATS_BACKPRESSURE_PRIORITY:
+		if (profile->backpressure_priority[evt->event_id])
+		{
+			return SWITCH_TRUE;
+		}
+		break;
+	default:
+		break;
+	}
+	NATS_STAT_INC(profile->backpressure_shed);
+	return SWITCH_FALSE;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
@@ -0,0 +1,369 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+
+/* nats bench: push synthetic events through mod_nats_dispatch_deliver from several producer threads,
+ * then wait for the workers to publish them. Each named profile is measured through a detached copy
+ * created from its configuration and destroyed afterwards, so no real traffic reaches it or shows in
+ * its counters. Naming several profiles measures the serialization they share. The events really
+ * are published, so every connection of the copies is pointed at the bench server given on the
+ * command line, which must not be one of the servers the profiles are configured with.
+ * Producers replay a small set of prebuilt CHANNEL_STATE events so the dispatch is what is measured.
+ */
+
+#define NATS_BENCH_CALLS 64
+#define NATS_BENCH_TIMEOUT 60000000
+#define NATS_BENCH_CONNECT_TIMEOUT 5000000
+
+typedef struct
+{
+  mod_nats_publisher_profile_t **profiles;
+  int profile_count;
+  switch_event_t *events[NATS_BENCH_CALLS];
+  int count;
+  switch_time_t elapsed;
+} mod_nats_bench_producer_t;
+
+static void *SWITCH_THREAD_FUNC mod_nats_bench_thread(switch_thread_t *thread, void *data)
+{
+	mod_nats_bench_producer_t *producer = (mod_nats_bench_producer_t *)data;
+	switch_time_t start = switch_time_now();
+	int i;
+
+	for (i = 0; i < producer->count; i++)
+	{
+		mod_nats_dispatch_deliver(producer->profiles, producer->profile_count, producer->events[i % NATS_BENCH_CALLS], switch_time_now());
+	}
+	producer->elapsed = switch_time_now() - start;
+	return NULL;
+}
+
+static switch_event_t *mod_nats_bench_event(int headers, const char *value)
+{
+	switch_event_t *event = NULL;
+	char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+	int i;
+
+	switch_uuid_str(uuid, sizeof(uuid));
+	switch_event_create(&event, SWITCH_EVENT_CHANNEL_STATE);
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", uuid);
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Channel-State", "CS_EXECUTE");
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Channel-Call-State", "ACTIVE");
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Channel-Name", "sofia/internal/1000@127.0.0.1");
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Caller-Destination-Number", "5551234");
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Event-Date-Timestamp", "1700000000000000");
+	for (i = 0; i < headers; i++)
+	{
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "variable_bench_%d", "%s", i, value);
+	}
+	return event;
+}
+
+static uint64_t mod_nats_bench_done(mod_nats_publisher_profile_t *profile)
+{
+	uint64_t done = NATS_STAT_GET(profile->dropped) + NATS_STAT_GET(profile->backpressure_shed) + mod_nats_ratelimit_throttled(profile);
+	int i;
+
+	for (i = 0; i < profile->worker_count; i++)
+	{
+		mod_nats_worker_stats_t *stats = &profile->workers[i].stats;
+
+		done += NATS_STAT_GET(stats->published) + NATS_STAT_GET(stats->publish_errors) + NATS_STAT_GET(stats->serialize_errors) +
+				NATS_STAT_GET(stats->spilled) + NATS_STAT_GET(stats->conflated);
+	}
+	return done;
+}
+
+static switch_bool_t mod_nats_bench_connected(mod_nats_publisher_profile_t **profiles, int profile_count)
+{
+	int i;
+
+	for (i = 0; i < profile_count; i++)
+	{
+		if (!mod_nats_publisher_connected(profiles[i]))
+		{
+			return SWITCH_FALSE;
+		}
+	}
+	return SWITCH_TRUE;
+}
+
+/* Point every connection of a profile copy at the bench servers instead of its own */
+static switch_status_t mod_nats_bench_target(switch_xml_t cfg, const char *name, const char *url, switch_stream_handle_t *stream)
+{
+	switch_xml_t connections = switch_xml_child(cfg, "connections"), connection, param, next;
+	char *tmp = strdup(url);
+	char *servers[NATS_MAX_SERVERS];
+	int server_count, i;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+
+	server_count = switch_separate_string(tmp, ',', servers, NATS_MAX_SERVERS);
+	for (connection = connections ? switch_xml_child(connections, "connection") : NULL; connection; connection = connection->next)
+	{
+		switch_bool_t set = SWITCH_FALSE;
+
+		for (param = switch_xml_child(connection, "param"); param; param = next)
+		{
+			const char *var = switch_xml_attr_soft(param, "name");
+			const char *val = switch_xml_attr_soft(param, "value");
+
+			next = param->next;
+			if (strncmp(var, "url", 3))
+			{
+				continue;
+			}
+			for (i = 0; i < server_count; i++)
+			{
+				if (!zstr(servers[i]) && strstr(val, servers[i]))
+				{
+					stream->write_function(stream, "-ERR [%s] is a server of profile [%s], bench against another one\n", servers[i], name);
+					status = SWITCH_STATUS_FALSE;
+					goto done;
+				}
+			}
+			if (set)
+			{
+				switch_xml_remove(param);
+				continue;
+			}
+			switch_xml_set_attr_d(param, "value", url);
+			set = SWITCH_TRUE;
+		}
+		if (!set)
+		{
+			param = switch_xml_add_child_d(connection, "param", 0);
+			switch_xml_set_attr_d(param, "name", "url");
+			switch_xml_set_attr_d(param, "value", url);
+		}
+	}
+
+done:
+	free(tmp);
+	return status;
+}
+
+switch_status_t mod_nats_bench(const char *profile_names, const char *url, int events, int threads, int headers, int value_size, switch_stream_handle_t *stream)
+{
+	mod_nats_publisher_profile_t *profiles[NATS_MAX_PROFILES] = {0};
+	switch_xml_t configs[NATS_MAX_PROFILES] = {0};
+	char *names[NATS_MAX_PROFILES];
+	mod_nats_bench_producer_t *producers;
+	switch_memory_pool_t *pool = NULL;
+	switch_threadattr_t *thd_attr = NULL;
+	switch_thread_t **thread;
+	switch_status_t status = SWITCH_STATUS_FALSE;
+	uint64_t *counts, *latency;
+	uint64_t done, published = 0, max, allocs, reallocs, expected = 0, queued, latency_count = 0;
+	switch_time_t start, handler_time = 0, total_time;
+	char *value, *tmp;
+	int profile_count, started = 0, i, j;
+
+	if (__atomic_exchange_n(&mod_nats_globals.bench_running, 1, __ATOMIC_ACQ_REL))
+	{
+		stream->write_function(stream, "-ERR a benchmark is already running\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_core_new_memory_pool(&pool);
+	tmp = switch_core_strdup(pool, profile_names);
+	profile_count = switch_separate_string(tmp, ',', names, NATS_MAX_PROFILES);
+	producers = switch_core_alloc(pool, sizeof(mod_nats_bench_producer_t) * threads);
+	thread = switch_core_alloc(pool, sizeof(switch_thread_t *) * threads);
+
+	/* Only the configurations are read under the lock, a reload may replace the profiles meanwhile */
+	switch_thread_rwlock_rdlock(mod_nats_globals.profiles_rwlock);
+	for (i = 0; i < profile_count; i++)
+	{
+		mod_nats_publisher_profile_t *profile = switch_core_hash_find(mod_nats_globals.publisher_hash, names[i]);
+
+		if (!profile || !profile->config_xml || !(configs[i] = switch_xml_parse_str_dup(profile->config_xml)))
+		{
+			break;
+		}
+	}
+	switch_thread_rwlock_unlock(mod_nats_globals.profiles_rwlock);
+	if (i < profile_count)
+	{
+		stream->write_function(stream, "-ERR profile [%s] not found\n", names[i]);
+		goto done;
+	}
+	for (i = 0; i < profile_count; i++)
+	{
+		if (mod_nats_bench_target(configs[i], names[i], url, stream) != SWITCH_STATUS_SUCCESS)
+		{
+			goto done;
+		}
+	}
+
+	for (i = 0; i < profile_count; i++)
+	{
+		if (mod_nats_publisher_create(switch_core_sprintf(pool, "%s-bench", names[i]), configs[i], NULL, &profiles[i]) != SWITCH_STATUS_SUCCESS)
+		{
+			stream->write_function(stream, "-ERR cannot start a copy of profile [%s]\n", names[i]);
+			goto done;
+		}
+	}
+	start = switch_time_now();
+	while (!mod_nats_bench_connected(profiles, profile_count) && switch_time_now() - start < NATS_BENCH_CONNECT_TIMEOUT)
+	{
+		switch_yield(10000);
+	}
+	if (!mod_nats_bench_connected(profiles, profile_count))
+	{
+		stream->write_function(stream, "-ERR the copies of [%s] cannot connect\n", profile_names);
+		goto done;
+	}
+
+	value = switch_core_alloc(pool, value_size + 1);
+	memset(value, 'x', value_size);
+	for (i = 0; i < threads; i++)
+	{
+		producers[i].profiles = profiles;
+		producers[i].profile_count = profile_count;
+		producers[i].count = events / threads + (i < events % threads ? 1 : 0);
+		for (j = 0; j < NATS_BENCH_CALLS; j++)
+		{
+			producers[i].events[j] = mod_nats_bench_event(headers, value);
+		}
+	}
+
+	__atomic_store_n(&mod_nats_globals.msg_allocs, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&mod_nats_globals.msg_reallocs, 0, __ATOMIC_RELAXED);
+
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+	start = switch_time_now();
+	for (i = 0; i < threads; i++)
+	{
+		if (switch_thread_create(&thread[i], thd_attr, mod_nats_bench_thread, &producers[i], pool) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create 'nats bench' producer thread %d!\n", i);
+			thread[i] = NULL;
+			continue;
+		}
+		expected += producers[i].count;
+		started++;
+	}
+	for (i = 0; i < threads; i++)
+	{
+		if (thread[i])
+		{
+			switch_thread_join(&status, thread[i]);
+			handler_time += producers[i].elapsed;
+		}
+	}
+	if (!started)
+	{
+		stream->write_function(stream, "-ERR cannot create the producer threads\n");
+		status = SWITCH_STATUS_FALSE;
+		goto done;
+	}
+
+	/* Wait for every event to be published, spilled, conflated, throttled, shed or dropped by every copy */
+	queued = expected * profile_count;
+	do
+	{
+		for (done = 0, i = 0; i < profile_count; i++)
+		{
+			done += mod_nats_bench_done(profiles[i]);
+		}
+		if (done >= queued)
+		{
+			break;
+		}
+		switch_yield(1000);
+	} while (switch_time_now() - start < NATS_BENCH_TIMEOUT);
+	total_time = switch_time_now() - start;
+
+	counts = switch_core_alloc(pool, sizeof(uint64_t) * NATS_HISTOGRAM_BUCKETS);
+	latency = switch_core_alloc(pool, sizeof(uint64_t) * NATS_HISTOGRAM_BUCKETS);
+	for (i = 0; i < profile_count; i++)
+	{
+		published += mod_nats_stats_latency(profiles[i], counts, &max);
+		for (j = 0; j < NATS_HISTOGRAM_BUCKETS; j++)
+		{
+			latency[j] += counts[j];
+			latency_count += counts[j];
+		}
+	}
+	allocs = __atomic_load_n(&mod_nats_globals.msg_allocs, __ATOMIC_RELAXED);
+	reallocs = __atomic_load_n(&mod_nats_globals.msg_reallocs, __ATOMIC_RELAXED);
+
+	stream->write_function(stream, "bench profiles [%s] on [%s] events %lu threads %d headers %d value_size %d encoding %s\n", profile_names,
+						   url, (unsigned long)expected, started, headers + 6, value_size, mod_nats_encoding_name(profiles[0]->encoding));
+	stream->write_function(stream, "  dispatch  %.0f events/s, %.0f ns/event per producer\n", handler_time ? expected * 1000000.0 * started / handler_time : 0,
+						   expected ? handler_time * 1000.0 / expected : 0);
+	stream->write_function(stream, "  pipeline  %lu published in %.3fs, %.0f events/s, %lu not published\n", (unsigned long)published, total_time / 1000000.0,
+						   total_time ? published * 1000000.0 / total_time : 0, (unsigned long)(queued > published ? queued - published : 0));
+	stream->write_function(stream, "  allocs    %lu messages, %lu reallocations, %.2f per event\n", (unsigned long)allocs, (unsigned long)reallocs,
+						   queued ? (double)(allocs + reallocs) / queued : 0);
+	stream->write_function(stream, "  latency   p50 %luus p99 %luus p999 %luus\n", (unsigned long)mod_nats_histogram_percentile(latency, latency_count, 50),
+						   (unsigned long)mod_nats_histogram_percentile(latency, latency_count, 99), (unsigned long)mod_nats_histogram_percentile(latency, latency_count, 99.9));
+	status = SWITCH_STATUS_SUCCESS;
+
+done:
+	for (i = 0; i < threads; i++)
+	{
+		for (j = 0; j < NATS_BENCH_CALLS; j++)
+		{
+			if (producers[i].events[j])
+			{
+				switch_event_destroy(&producers[i].events[j]);
+			}
+		}
+	}
+	for (i = 0; i < profile_count; i++)
+	{
+		mod_nats_publisher_destroy(&profiles[i]);
+		if (configs[i])
+		{
+			switch_xml_free(configs[i]);
+		}
+	}
+	switch_core_destroy_memory_pool(&pool);
+	__atomic_store_n(&mod_nats_globals.bench_running, 0, __ATOMIC_RELEASE);
+	return status;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
@@ -0,0 +1,335 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+
+#include "mod_nats.h"
+
+/* Inbound command channel. A profile with a command_subject subscribes to it on its connection,
+ * in the command_queue_group queue group so that a request reaches a single FreeSWITCH node. The
+ * payload is an API command line, as given to fs_cli: "<command> [<args>]", optionally prefixed
+ * by "api " or "bgapi ". Requests are queued to a pool of command_workers threads which run them
+ * through switch_api_execute and publish the output to the reply subject of the request. A
+ * bgapi request is answered with its Job-UUID right away and its result is fired as a
+ * BACKGROUND_JOB event, which a profile subscribed to it publishes.
+ *
+ * The queue holds at most command_queue_size requests, the ones that do not fit are answered
+ * with an error straight from the subscription callback. Only the commands listed in
+ * command_allow are run, a read-only set by default: anyone able to publish on the subject could
+ * otherwise run system, fsctl or load.
+ */
+
+switch_status_t mod_nats_command_init(mod_nats_publisher_profile_t *profile, const char *allow)
+{
+	char *argv[256];
+	char *tmp;
+	int argc, i;
+
+	if (switch_queue_create(&profile->command_queue, profile->command_queue_size, profile->pool) != SWITCH_STATUS_SUCCESS)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] cannot create command queue of size %u\n", profile->name, profile->command_queue_size);
+		return SWITCH_STATUS_GENERR;
+	}
+	profile->command_threads = switch_core_alloc(profile->pool, sizeof(switch_thread_t *) * profile->command_workers);
+	if (zstr(allow))
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] no command_allow, only accepting [%s]\n", profile->name,
+						  NATS_COMMAND_DEFAULT_ALLOW);
+		allow = NATS_COMMAND_DEFAULT_ALLOW;
+	}
+	tmp = switch_core_strdup(profile->pool, allow);
+	argc = switch_separate_string(tmp, ',', argv, (sizeof(argv) / sizeof(argv[0])));
+	switch_core_hash_init(&profile->command_allow);
+	for (i = 0; i < argc; i++)
+	{
+		switch_core_hash_insert(profile->command_allow, argv[i], profile);
+	}
+	if (zstr(profile->command_queue_group))
+	{
+		profile->command_queue_group = profile->name;
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Publish the output of a request, this must be called from a command worker thread */
+static void mod_nats_command_reply(mod_nats_publisher_profile_t *profile, natsMsg *msg, const char *data)
+{
+	const char *reply = natsMsg_GetReply(msg);
+	natsStatus s = NATS_CONNECTION_CLOSED;
+
+	if (zstr(reply))
+	{
+		return;
+	}
+	switch_thread_rwlock_rdlock(profile->links[0].conn_rwlock);
+	if (profile->links[0].conn_active && profile->links[0].conn_active->connection)
+	{
+		s = natsConnection_PublishString(profile->links[0].conn_active->connection, reply, data);
+	}
+	switch_thread_rwlock_unlock(profile->links[0].conn_rwlock);
+	if (s != NATS_OK)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] cannot reply to command on [%s] %s\n", profile->name, reply, natsStatus_GetText(s));
+	}
+}
+
+static void mod_nats_command_execute(mod_nats_publisher_profile_t *profile, natsMsg *msg)
+{
+	switch_stream_handle_t stream = {0};
+	switch_bool_t background = SWITCH_FALSE;
+	int len = natsMsg_GetDataLength(msg);
+	char *line, *cmd;
+	char name[256];
+	size_t name_len;
+	switch_status_t status;
+
+	switch_zmalloc(line, len + 1);
+	memcpy(line, natsMsg_GetData(msg), len);
+	while (len && strchr(" \r\n", line[len - 1]))
+	{
+		line[--len] = '\0';
+	}
+	cmd = line;
+	while (*cmd == ' ')
+	{
+		cmd++;
+	}
+	if (!strncasecmp(cmd, "bgapi ", 6))
+	{
+		background = SWITCH_TRUE;
+		cmd += 6;
+	}
+	else if (!strncasecmp(cmd, "api ", 4))
+	{
+		cmd += 4;
+	}
+	while (*cmd == ' ')
+	{
+		cmd++;
+	}
+
+	name_len = strcspn(cmd, " ");
+	if (!name_len || name_len >= sizeof(name))
+	{
+		NATS_STAT_INC(profile->commands_rejected);
+		mod_nats_command_reply(profile, msg, "-ERR invalid command\n");
+		goto done;
+	}
+	memcpy(name, cmd, name_len);
+	name[name_len] = '\0';
+	if (!switch_core_hash_find(profile->command_allow, name))
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] command [%s] is not allowed\n", profile->name, name);
+		NATS_STAT_INC(profile->commands_rejected);
+		mod_nats_command_reply(profile, msg, "-ERR command not allowed\n");
+		goto done;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Profile[%s] executing %s [%s]\n", profile->name, background ? "bgapi" : "api", cmd);
+	SWITCH_STANDARD_STREAM(stream);
+	if (background)
+	{
+		status = switch_api_execute("bgapi", cmd, NULL, &stream);
+	}
+	else
+	{
+		status = switch_api_execute(name, cmd[name_len] ? cmd + name_len + 1 : NULL, NULL, &stream);
+	}
+	if (status != SWITCH_STATUS_SUCCESS && zstr((char *)stream.data))
+	{
+		stream.write_function(&stream, "-ERR %s Command not found!\n", name);
+	}
+	NATS_STAT_INC(profile->commands_executed);
+	mod_nats_command_reply(profile, msg, stream.data ? (char *)stream.data : "");
+	switch_safe_free(stream.data);
+
+done:
+	free(line);
+	natsMsg_Destroy(msg);
+}
+
+static void *SWITCH_THREAD_FUNC mod_nats_command_thread(switch_thread_t *thread, void *data)
+{
+	mod_nats_publisher_profile_t *profile = (mod_nats_publisher_profile_t *)data;
+	void *pop = NULL;
+
+	mod_nats_publisher_wait_start(profile);
+	while (profile->running && !profile->retiring)
+	{
+		if (switch_queue_pop_timeout(profile->command_queue, &pop, 500000) == SWITCH_STATUS_SUCCESS && pop)
+		{
+			mod_nats_command_execute(profile, (natsMsg *)pop);
+		}
+	}
+	switch_thread_exit(thread, SWITCH_STATUS_SUCCESS);
+	return NULL;
+}
+
+switch_status_t mod_nats_command_start(mod_nats_publisher_profile_t *profile, switch_threadattr_t *thd_attr)
+{
+	int i;
+
+	for (i = 0; i < profile->command_workers; i++)
+	{
+		if (switch_thread_create(&profile->command_threads[i], thd_attr, mod_nats_command_thread, profile, profile->pool) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create 'nats command' thread %d!\n", i);
+			return SWITCH_STATUS_GENERR;
+		}
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Called by nats.c on its delivery thread, requests are only queued here */
+static void mod_nats_command_on_msg(natsConnection *nc, natsSubscription *sub, natsMsg *msg, void *closure)
+{
+	mod_nats_publisher_profile_t *profile = (mod_nats_publisher_profile_t *)closure;
+	const char *reply;
+
+	if (switch_queue_trypush(profile->command_queue, msg) == SWITCH_STATUS_SUCCESS)
+	{
+		return;
+	}
+	NATS_STAT_INC(profile->commands_rejected);
+	if (!zstr((reply = natsMsg_GetReply(msg))))
+	{
+		natsConnection_PublishString(nc, reply, "-ERR busy\n");
+	}
+	natsMsg_Destroy(msg);
+}
+
+/* Called with the write lock of the first link held, right after its connection has been (re)opened */
+void mod_nats_command_subscribe(mod_nats_publisher_profile_t *profile)
+{
+	natsStatus s;
+
+	if (!profile->command_queue || profile->command_sub || !profile->links[0].conn_active)
+	{
+		return;
+	}
+	s = natsConnection_QueueSubscribe(&profile->command_sub, profile->links[0].conn_active->connection, profile->command_subject, profile->command_queue_group,
+									  mod_nats_command_on_msg, profile);
+	if (s != NATS_OK)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] cannot subscribe to commands on [%s] %s\n", profile->name, profile->command_subject,
+						  natsStatus_GetText(s));
+		profile->command_sub = NULL;
+		return;
+	}
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Profile[%s] accepting commands on [%s] queue group [%s]\n", profile->name, profile->command_subject,
+					  profile->command_queue_group);
+}
+
+/* Called with the write lock of the first link held. A draining subscription lets the requests already
+ * delivered reach the queue, one on a failed connection is simply dropped.
+ */
+void mod_nats_command_unsubscribe(mod_nats_publisher_profile_t *profile, switch_bool_t drain)
+{
+	if (!profile->command_sub)
+	{
+		return;
+	}
+	if (drain && natsSubscription_Drain(profile->command_sub) == NATS_OK)
+	{
+		natsSubscription_WaitForDrainCompletion(profile->command_sub, 2000);
+	}
+	natsSubscription_Destroy(profile->command_sub);
+	profile->command_sub = NULL;
+}
+
+/* Stop taking requests and join the command workers, queued requests stay in the queue */
+void mod_nats_command_stop(mod_nats_publisher_profile_t *profile)
+{
+	switch_status_t status;
+	int i;
+
+	if (!profile->command_queue)
+	{
+		return;
+	}
+	if (profile->links && profile->links[0].conn_rwlock)
+	{
+		switch_thread_rwlock_wrlock(profile->links[0].conn_rwlock);
+		mod_nats_command_unsubscribe(profile, SWITCH_TRUE);
+		switch_thread_rwlock_unlock(profile->links[0].conn_rwlock);
+	}
+	for (i = 0; profile->command_threads && i < profile->command_workers; i++)
+	{
+		if (profile->command_threads[i])
+		{
+			switch_thread_join(&status, profile->command_threads[i]);
+			profile->command_threads[i] = NULL;
+		}
+	}
+}
+
+/* Once stopped, the requests still queued by old are run by profile instead */
+void mod_nats_command_handover(mod_nats_publisher_profile_t *old, mod_nats_publisher_profile_t *profile)
+{
+	void *pop = NULL;
+
+	while (old->command_queue && switch_queue_trypop(old->command_queue, &pop) == SWITCH_STATUS_SUCCESS)
+	{
+		if (!profile->command_queue || switch_queue_trypush(profile->command_queue, pop) != SWITCH_STATUS_SUCCESS)
+		{
+			NATS_STAT_INC(old->commands_rejected);
+			natsMsg_Destroy((natsMsg *)pop);
+		}
+	}
+}
+
+/* Only once stopped, requests still queued are discarded */
+void mod_nats_command_destroy(mod_nats_publisher_profile_t *profile)
+{
+	void *pop = NULL;
+
+	while (profile->command_queue && switch_queue_trypop(profile->command_queue, &pop) == SWITCH_STATUS_SUCCESS)
+	{
+		natsMsg_Destroy((natsMsg *)pop);
+	}
+	if (profile->command_allow)
+	{
+		switch_core_hash_destroy(&profile->command_allow);
+	}
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
@@ -0,0 +1,258 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+#ifdef MOD_NATS_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef MOD_NATS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Payload compression, done by the publisher workers right before publishing. Every worker keeps
+ * its own output buffer (and zstd context), the zstd dictionary is digested once per profile
+ * and shared. The codec is announced in the FS-Compression message header, and the id of the zstd
+ * dictionary in FS-Compression-Dictionary. A payload that does not shrink is published as is.
+ *
+ * A dictionary can be trained offline from captured events with scripts/train_zstd_dictionary.sh.
+ */
+
+const char *mod_nats_compression_name(mod_nats_compression_t compression)
+{
+	switch (compression)
+	{
+	case NATS_COMPRESSION_LZ4:
+		return "lz4";
+	case NATS_COMPRESSION_ZSTD:
+		return "zstd";
+	default:
+		return "none";
+	}
+}
+
+switch_status_t mod_nats_compression_parse(const char *name, mod_nats_compression_t *compression)
+{
+	if (!strcasecmp(name, "none"))
+	{
+		*compression = NATS_COMPRESSION_NONE;
+	}
+#ifdef MOD_NATS_HAVE_LZ4
+	else if (!strcasecmp(name, "lz4"))
+	{
+		*compression = NATS_COMPRESSION_LZ4;
+	}
+#endif
+#ifdef MOD_NATS_HAVE_ZSTD
+	else if (!strcasecmp(name, "zstd"))
+	{
+		*compression = NATS_COMPRESSION_ZSTD;
+	}
+#endif
+	else
+	{
+		return SWITCH_STATUS_FALSE;
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t mod_nats_compress_init(mod_nats_publisher_profile_t *profile, const char *dictionary)
+{
+#ifdef MOD_NATS_HAVE_ZSTD
+	FILE *fp;
+	char *buf;
+	long size;
+
+	if (profile->compression != NATS_COMPRESSION_ZSTD || zstr(dictionary))
+	{
+		return SWITCH_STATUS_SUCCESS;
+	}
+	if (!(fp = fopen(dictionary, "rb")))
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] cannot open compression dictionary [%s]: %s\n", profile->name, dictionary, strerror(errno));
+		return SWITCH_STATUS_FALSE;
+	}
+	if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET))
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] cannot read compression dictionary [%s]\n", profile->name, dictionary);
+		fclose(fp);
+		return SWITCH_STATUS_FALSE;
+	}
+	buf = malloc(size);
+	switch_assert(buf);
+	if (fread(buf, 1, size, fp) != (size_t)size)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] cannot read compression dictionary [%s]\n", profile->name, dictionary);
+		fclose(fp);
+		free(buf);
+		return SWITCH_STATUS_FALSE;
+	}
+	fclose(fp);
+
+	/* The digested dictionary is read only, so every worker can use it */
+	profile->compression_dict = ZSTD_createCDict(buf, size, profile->compression_level);
+	profile->compression_dict_id = ZSTD_getDictID_fromDict(buf, size);
+	free(buf);
+	if (!profile->compression_dict)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] invalid compression dictionary [%s]\n", profile->name, dictionary);
+		return SWITCH_STATUS_FALSE;
+	}
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Profile[%s] loaded zstd dictionary [%s] id %u\n", profile->name, dictionary, profile->compression_dict_id);
+#else
+	if (!zstr(dictionary))
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] built without zstd, ignoring compression dictionary [%s]\n", profile->name, dictionary);
+	}
+#endif
+	return SWITCH_STATUS_SUCCESS;
+}
+
+void mod_nats_compress_shutdown(mod_nats_publisher_profile_t *profile)
+{
+#ifdef MOD_NATS_HAVE_ZSTD
+	if (profile->compression_dict)
+	{
+		ZSTD_freeCDict((ZSTD_CDict *)profile->compression_dict);
+		profile->compression_dict = NULL;
+	}
+#endif
+}
+
+void mod_nats_compress_worker_destroy(mod_nats_publisher_worker_t *worker)
+{
+#ifdef MOD_NATS_HAVE_ZSTD
+	if (worker->compress_ctx)
+	{
+		ZSTD_freeCCtx((ZSTD_CCtx *)worker->compress_ctx);
+		worker->compress_ctx = NULL;
+	}
+#endif
+	switch_safe_free(worker->compress_buf);
+	worker->compress_size = 0;
+}
+
+static switch_status_t mod_nats_compress_reserve(mod_nats_publisher_worker_t *worker, size_t size)
+{
+	char *buf;
+
+	if (size <= worker->compress_size)
+	{
+		return SWITCH_STATUS_SUCCESS;
+	}
+	if (!(buf = realloc(worker->compress_buf, size)))
+	{
+		return SWITCH_STATUS_MEMERR;
+	}
+	worker->compress_buf = buf;
+	worker->compress_size = size;
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Compress len bytes of data into the buffer of the worker. Only called by the worker thread. */
+switch_status_t mod_nats_compress(mod_nats_publisher_worker_t *worker, const char *data, size_t len, const char **out, size_t *out_len)
+{
+	mod_nats_publisher_profile_t *profile = worker->profile;
+	size_t size = 0;
+
+	switch (profile->compression)
+	{
+#ifdef MOD_NATS_HAVE_LZ4
+	case NATS_COMPRESSION_LZ4:
+	{
+		LZ4F_preferences_t prefs;
+
+		memset(&prefs, 0, sizeof(prefs));
+		prefs.compressionLevel = profile->compression_level;
+		prefs.frameInfo.contentSize = len;
+		if (mod_nats_compress_reserve(worker, LZ4F_compressFrameBound(len, &prefs)) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+		/* Fast levels keep the frame state on the stack, there is no context to keep around */
+		size = LZ4F_compressFrame(worker->compress_buf, worker->compress_size, data, len, &prefs);
+		if (LZ4F_isError(size))
+		{
+			return SWITCH_STATUS_FALSE;
+		}
+		break;
+	}
+#endif
+#ifdef MOD_NATS_HAVE_ZSTD
+	case NATS_COMPRESSION_ZSTD:
+		if (!worker->compress_ctx && !(worker->compress_ctx = ZSTD_createCCtx()))
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+		if (mod_nats_compress_reserve(worker, ZSTD_compressBound(len)) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+		if (profile->compression_dict)
+		{
+			size = ZSTD_compress_usingCDict((ZSTD_CCtx *)worker->compress_ctx, worker->compress_buf, worker->compress_size, data, len,
+											(const ZSTD_CDict *)profile->compression_dict);
+		}
+		else
+		{
+			size = ZSTD_compressCCtx((ZSTD_CCtx *)worker->compress_ctx, worker->compress_buf, worker->compress_size, data, len, profile->compression_level);
+		}
+		if (ZSTD_isError(size))
+		{
+			return SWITCH_STATUS_FALSE;
+		}
+		break;
+#endif
+	default:
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (size >= len)
+	{
+		return SWITCH_STATUS_FALSE;
+	}
+	*out = worker->compress_buf;
+	*out_len = size;
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
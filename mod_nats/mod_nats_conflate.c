@@ -0,0 +1,250 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+
+/* Conflation of bursty per-call events. For the event types listed in conflate_events, the first
+ * event of a call opens a window of conflate_window_ms. Events of the same type and call arriving
+ * within the window replace the held message in place, and only the latest one is published once
+ * the window closes. Every call is sharded to a single worker, so each worker keeps its own table
+ * of held messages in a hash by Unique-ID and in a FIFO list, which is in deadline order as all
+ * the windows of a profile have the same length.
+ *
+ * A call has at most one open window. Any other event of the call closes it early and the held
+ * message is queued first, and a window that closes goes to the tail of its lane behind the older
+ * events of the call, so conflation never reorders the events of a call.
+ */
+
+switch_status_t mod_nats_conflate_load(mod_nats_publisher_profile_t *profile, const char *events)
+{
+	char *argv[SWITCH_EVENT_ALL];
+	char *tmp = switch_core_strdup(profile->pool, events);
+	int argc, i;
+
+	argc = switch_separate_string(tmp, ',', argv, (sizeof(argv) / sizeof(argv[0])));
+	for (i = 0; i < argc; i++)
+	{
+		switch_event_types_t type;
+
+		if (switch_name_event(argv[i], &type) != SWITCH_STATUS_SUCCESS || type == SWITCH_EVENT_ALL)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] conflated event [%s] was not recognised\n", profile->name, argv[i]);
+			return SWITCH_STATUS_FALSE;
+		}
+		profile->conflate[type] = SWITCH_TRUE;
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t mod_nats_conflate_worker_init(mod_nats_publisher_worker_t *worker, switch_memory_pool_t *pool)
+{
+	if (switch_mutex_init(&worker->conflate_mutex, SWITCH_MUTEX_NESTED, pool) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_GENERR;
+	}
+	switch_core_hash_init(&worker->conflate_hash);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Only once the worker thread is joined, what its final drain did not publish is discarded */
+void mod_nats_conflate_worker_destroy(mod_nats_publisher_worker_t *worker)
+{
+	mod_nats_conflate_entry_t *entry;
+
+	while ((entry = worker->conflate_head))
+	{
+		worker->conflate_head = entry->next;
+		if (entry->msg)
+		{
+			mod_nats_util_msg_destroy(&entry->msg);
+		}
+		free(entry);
+	}
+	worker->conflate_tail = NULL;
+	if (worker->conflate_hash)
+	{
+		switch_core_hash_destroy(&worker->conflate_hash);
+	}
+}
+
+/* Close the window of entry ahead of its deadline. The entry stays in the FIFO list without a
+ * message until it expires, so the list keeps its deadline order.
+ */
+static mod_nats_message_t *mod_nats_conflate_close(mod_nats_publisher_worker_t *worker, mod_nats_conflate_entry_t *entry)
+{
+	mod_nats_message_t *msg = entry->msg;
+
+	switch_core_hash_delete(worker->conflate_hash, entry->key);
+	entry->msg = NULL;
+	return msg;
+}
+
+/* Called by the event threads before queueing an event of the call that is not conflated with the
+ * held one, returns the held message which has to be queued first.
+ */
+mod_nats_message_t *mod_nats_conflate_take(mod_nats_publisher_worker_t *worker, const char *uuid, switch_event_types_t event_id)
+{
+	mod_nats_conflate_entry_t *entry;
+	mod_nats_message_t *msg = NULL;
+
+	if (!__atomic_load_n(&worker->conflate_deadline, __ATOMIC_ACQUIRE))
+	{
+		/* No window open */
+		return NULL;
+	}
+
+	switch_mutex_lock(worker->conflate_mutex);
+	if ((entry = switch_core_hash_find(worker->conflate_hash, uuid)) && entry->msg->event_id != event_id)
+	{
+		msg = mod_nats_conflate_close(worker, entry);
+	}
+	switch_mutex_unlock(worker->conflate_mutex);
+	return msg;
+}
+
+/* Called by the event threads, the message is taken over by the conflation table either replacing
+ * the message of the open window of its call or opening a new one. The caller queues a message of
+ * another type held for the call before, see mod_nats_conflate_take.
+ */
+void mod_nats_conflate_push(mod_nats_publisher_worker_t *worker, const char *uuid, mod_nats_message_t **msg, switch_time_t now)
+{
+	mod_nats_publisher_profile_t *profile = worker->profile;
+	mod_nats_conflate_entry_t *entry;
+	mod_nats_message_t *replaced = NULL, *closed = NULL;
+	switch_bool_t wake = SWITCH_FALSE;
+
+	switch_mutex_lock(worker->conflate_mutex);
+	if ((entry = switch_core_hash_find(worker->conflate_hash, uuid)) && entry->msg->event_id == (*msg)->event_id)
+	{
+		/* Messages may be shared with other profiles, the replacement is left untouched */
+		replaced = entry->msg;
+		entry->msg = *msg;
+	}
+	else
+	{
+		if (entry)
+		{
+			/* Another thread of the call opened a window of another type since, it goes out first */
+			closed = mod_nats_conflate_close(worker, entry);
+			if (mod_nats_lane_push(worker, closed, SWITCH_FALSE) == SWITCH_STATUS_SUCCESS)
+			{
+				closed = NULL;
+			}
+		}
+		switch_zmalloc(entry, sizeof(mod_nats_conflate_entry_t));
+		switch_copy_string(entry->key, uuid, sizeof(entry->key));
+		entry->msg = *msg;
+		entry->deadline = now + profile->conflate_window_ms * 1000;
+		switch_core_hash_insert(worker->conflate_hash, entry->key, entry);
+		if (worker->conflate_tail)
+		{
+			worker->conflate_tail->next = entry;
+		}
+		else
+		{
+			worker->conflate_head = entry;
+			__atomic_store_n(&worker->conflate_deadline, entry->deadline, __ATOMIC_RELEASE);
+			wake = SWITCH_TRUE;
+		}
+		worker->conflate_tail = entry;
+	}
+	switch_mutex_unlock(worker->conflate_mutex);
+
+	if (closed)
+	{
+		/* The lane is full */
+		NATS_STAT_INC(profile->dropped);
+		mod_nats_util_msg_destroy(&closed);
+	}
+	if (replaced)
+	{
+		NATS_STAT_INC(worker->stats.conflated);
+		mod_nats_util_msg_destroy(&replaced);
+	}
+	else if (wake)
+	{
+		/* The worker may be sleeping without a deadline, let it pick up the new window */
+		mod_nats_lane_wake(worker);
+	}
+	*msg = NULL;
+}
+
+/* Called by the worker, the messages whose window closed go to the tail of their lane. This is
+ * done under the lock so that an event of the call queued right after cannot overtake them. Up to
+ * max messages the lane has no room for are moved into msgs instead, the count is returned.
+ */
+unsigned int mod_nats_conflate_expire(mod_nats_publisher_worker_t *worker, mod_nats_message_t **msgs, unsigned int max, switch_time_t now)
+{
+	mod_nats_conflate_entry_t *entry;
+	unsigned int count = 0;
+	switch_time_t deadline = __atomic_load_n(&worker->conflate_deadline, __ATOMIC_ACQUIRE);
+
+	if (!deadline || deadline > now)
+	{
+		return 0;
+	}
+
+	switch_mutex_lock(worker->conflate_mutex);
+	while (count < max && (entry = worker->conflate_head) && entry->deadline <= now)
+	{
+		worker->conflate_head = entry->next;
+		if (entry->msg)
+		{
+			switch_core_hash_delete(worker->conflate_hash, entry->key);
+			if (mod_nats_lane_push(worker, entry->msg, SWITCH_FALSE) != SWITCH_STATUS_SUCCESS)
+			{
+				msgs[count++] = entry->msg;
+			}
+		}
+		free(entry);
+	}
+	if (!worker->conflate_head)
+	{
+		worker->conflate_tail = NULL;
+	}
+	__atomic_store_n(&worker->conflate_deadline, worker->conflate_head ? worker->conflate_head->deadline : 0, __ATOMIC_RELEASE);
+	switch_mutex_unlock(worker->conflate_mutex);
+	return count;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
@@ -32,110 +32,200 @@
 * William King <william.king@quentustech.com>
 * Mike Jerris <mike@jerris.com>
 * Emmanuel Schmidbauer <eschmidbauer@gmail.com>
-*
-* mod_nats -- Sends FreeSWITCH events to NATS queues
-*
-*/
 
 #include "mod_nats.h"
 
+static void mod_nats_connection_health_release(mod_nats_connection_health_t *health)
+{
+	if (health && __atomic_sub_fetch(&health->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		free(health);
+	}
+}
+
+/* The nats.c callbacks below run on its own threads, while it walks the servers of the cluster */
+static void mod_nats_connection_on_disconnected(natsConnection *nc, void *closure)
+{
+	mod_nats_connection_health_t *health = (mod_nats_connection_health_t *)closure;
+
+	__atomic_store_n(&health->disconnected, switch_time_now(), __ATOMIC_RELAXED);
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "NATS connection [%s] lost, failing over\n", health->name);
+}
+
+static void mod_nats_connection_on_reconnected(natsConnection *nc, void *closure)
+{
+	mod_nats_connection_health_t *health = (mod_nats_connection_health_t *)closure;
+	switch_time_t disconnected = __atomic_exchange_n(&health->disconnected, 0, __ATOMIC_RELAXED);
+	uint64_t failover_us = disconnected ? (uint64_t)(switch_time_now() - disconnected) : 0;
+	char url[256] = "";
+
+	NATS_STAT_INC(health->reconnects);
+	__atomic_store_n(&health->failover_us, failover_us, __ATOMIC_RELAXED);
+	natsConnection_GetConnectedUrl(nc, url, sizeof(url));
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "NATS connection [%s] failed over to [%s] in %lums\n", health->name, url,
+					  (unsigned long)(failover_us / 1000));
+}
+
+static void mod_nats_connection_on_discovered(natsConnection *nc, void *closure)
+{
+	mod_nats_connection_health_t *health = (mod_nats_connection_health_t *)closure;
+	char **servers = NULL;
+	int count = 0, i;
+
+	if (natsConnection_GetDiscoveredServers(nc, &servers, &count) != NATS_OK)
+	{
+		return;
+	}
+	__atomic_store_n(&health->discovered, count, __ATOMIC_RELAXED);
+	for (i = 0; i < count; i++)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "NATS connection [%s] discovered server [%s]\n", health->name, servers[i]);
+		free(servers[i]);
+	}
+	free(servers);
+}
+
+/* The last callback nats.c invokes for a connection, whether it gave up reconnecting or was destroyed */
+static void mod_nats_connection_on_closed(natsConnection *nc, void *closure)
+{
+	mod_nats_connection_health_t *health = (mod_nats_connection_health_t *)closure;
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "NATS connection [%s] closed\n", health->name);
+	mod_nats_connection_health_release(health);
+}
+
 void mod_nats_connection_close(mod_nats_connection_t *connection)
 {
 	natsConnection *old_state = connection->connection;
+	mod_nats_connection_health_t *health = connection->health;
+
 	connection->connection = NULL;
+	connection->health = NULL;
 	if (old_state != NULL)
 	{
 		natsConnection_Destroy(old_state);
 	}
+	mod_nats_connection_health_release(health);
 }
 
-switch_status_t mod_nats_connection_open(mod_nats_connection_t *connections, mod_nats_connection_t **active, char *profile_name)
+static natsStatus mod_nats_connection_options(natsOptions **opts, mod_nats_connection_t *connection, mod_nats_connection_health_t *health, char *profile_name)
 {
-	natsConnection *newConnection = NULL;
-	natsConnection *oldConnection = NULL;
-	natsOptions *opts;
-	mod_nats_connection_t *connection_attempt = NULL;
-	natsStatus nats_status;
-	natsConnStatus nats_connection_status;
+	natsStatus s;
 
-	// set NATS options
-	nats_status = natsOptions_Create(&opts);
-	if (nats_status != NATS_OK)
+	s = natsOptions_Create(opts);
+	if (s == NATS_OK)
 	{
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "could not create NATS Options\n");
-		return SWITCH_STATUS_GENERR;
-	}
-	natsOptions_SetName(opts, profile_name);
-	// use these defaults
-	natsOptions_SetAllowReconnect(opts, true);
-	natsOptions_SetSecure(opts, false);
-	natsOptions_SetMaxReconnect(opts, 10000);
-	natsOptions_SetReconnectWait(opts, 2 * 1000);	  // 2s
-	natsOptions_SetPingInterval(opts, 2 * 60 * 1000); // 2m
-	natsOptions_SetMaxPingsOut(opts, 2);
-	natsOptions_SetIOBufSize(opts, 32 * 1024); // 32 KB
-	natsOptions_SetMaxPendingMsgs(opts, 65536);
-	natsOptions_SetTimeout(opts, 2 * 1000);					// 2s
-	natsOptions_SetReconnectBufSize(opts, 8 * 1024 * 1024); // 8 MB;
-	natsOptions_SetReconnectJitter(opts, 100, 1000);		// 100ms, 1s;
-
-	if (active && *active)
-	{
-		oldConnection = (*active)->connection;
+		natsOptions_SetName(*opts, profile_name);
+		// use these defaults
+		natsOptions_SetAllowReconnect(*opts, true);
+		natsOptions_SetSecure(*opts, false);
+		natsOptions_SetPingInterval(*opts, 2 * 60 * 1000); // 2m
+		natsOptions_SetMaxPingsOut(*opts, 2);
+		natsOptions_SetIOBufSize(*opts, 32 * 1024); // 32 KB
+		natsOptions_SetMaxPendingMsgs(*opts, 65536);
+		natsOptions_SetReconnectBufSize(*opts, 8 * 1024 * 1024); // 8 MB;
+		natsOptions_SetReconnectJitter(*opts, 50, 250);		 // 50ms, 250ms;
+		natsOptions_SetMaxReconnect(*opts, connection->max_reconnect);
+		natsOptions_SetReconnectWait(*opts, connection->reconnect_wait_ms);
+		natsOptions_SetTimeout(*opts, connection->connect_timeout_ms);
+		natsOptions_SetIgnoreDiscoveredServers(*opts, connection->ignore_discovered ? true : false);
+		/* Failover happens within nats.c, these only keep track of it */
+		natsOptions_SetDisconnectedCB(*opts, mod_nats_connection_on_disconnected, health);
+		natsOptions_SetReconnectedCB(*opts, mod_nats_connection_on_reconnected, health);
+		natsOptions_SetDiscoveredServersCB(*opts, mod_nats_connection_on_discovered, health);
+		natsOptions_SetClosedCB(*opts, mod_nats_connection_on_closed, health);
+		s = natsOptions_SetServers(*opts, (const char **)connection->nats_servers, connection->server_count);
 	}
+	return s;
+}
 
-	connection_attempt = connections;
+/* Open the first connection of the list whose cluster can be reached. Only used when the profile
+ * has no connection, or nats.c gave up on the cluster of the previous one.
+ */
+switch_status_t mod_nats_connection_open(mod_nats_connection_t *connections, mod_nats_connection_t **active, char *profile_name)
+{
+	mod_nats_connection_t *old = active ? *active : NULL;
+	mod_nats_connection_t *connection_attempt = NULL;
+	mod_nats_connection_health_t *health = NULL;
+	natsOptions *opts = NULL;
+	natsStatus nats_status = NATS_ERR;
 
-	while (connection_attempt && nats_connection_status != NATS_CONN_STATUS_CONNECTED)
+	for (connection_attempt = connections; connection_attempt; connection_attempt = connection_attempt->next)
 	{
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "trying to connect to profile[%s]\n",
-						  profile_name);
-		nats_status = natsOptions_SetServers(opts, (const char **)connection_attempt->nats_servers, 1);
-		if (nats_status != NATS_OK)
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "trying to connect to profile[%s] connection[%s] with %d servers\n",
+						  profile_name, connection_attempt->name, connection_attempt->server_count);
+		if (connection_attempt->connection)
 		{
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "could not set NATS Servers\n");
-			continue;
+			mod_nats_connection_close(connection_attempt);
 		}
-		nats_status = natsConnection_Connect(&connection_attempt->connection, opts);
+		switch_zmalloc(health, sizeof(mod_nats_connection_health_t));
+		health->refs = 2;
+		switch_snprintf(health->name, sizeof(health->name), "%s/%s", profile_name, connection_attempt->name);
+
+		nats_status = mod_nats_connection_options(&opts, connection_attempt, health, profile_name);
 		if (nats_status != NATS_OK)
 		{
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "could not connect to profile[%s] %s\n",
-							  profile_name, natsStatus_GetText(nats_status));
-			connection_attempt = connection_attempt->next;
-			continue;
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "could not set NATS options of connection[%s] %s\n", connection_attempt->name,
+							  natsStatus_GetText(nats_status));
 		}
-		nats_connection_status = natsConnection_Status(connection_attempt->connection);
+		else
+		{
+			nats_status = natsConnection_Connect(&connection_attempt->connection, opts);
+		}
+		if (opts)
+		{
+			natsOptions_Destroy(opts);
+			opts = NULL;
+		}
+		if (nats_status == NATS_OK)
+		{
+			connection_attempt->health = health;
+			break;
+		}
+		/* Without a connection nats.c never calls back */
+		free(health);
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "could not connect to profile[%s] connection[%s] %s\n",
+						  profile_name, connection_attempt->name, natsStatus_GetText(nats_status));
+		NATS_STAT_INC(connection_attempt->connect_failures);
+		connection_attempt->connection = NULL;
 	}
 
 	*active = connection_attempt;
-	if (!connection_attempt || nats_status != NATS_OK)
+	if (!connection_attempt)
 	{
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Profile[%s] could not connect to any NATS URLS\n", profile_name);
-		goto err;
-	}
-	newConnection = connection_attempt->connection;
-	(*active)->connection = newConnection;
-	if (oldConnection)
-	{
-		natsConnection_Destroy(oldConnection);
+		return SWITCH_STATUS_GENERR;
 	}
-	if (opts)
+	NATS_STAT_INC(connection_attempt->connects);
+	if (old && old != connection_attempt)
 	{
-		natsOptions_Destroy(opts);
+		mod_nats_connection_close(old);
 	}
-
 	return SWITCH_STATUS_SUCCESS;
+}
 
-err:
-	if (newConnection)
-	{
-		natsConnection_Destroy(newConnection);
-	}
-	if (opts)
+/* Append the comma separated URLs of a url param to the server list of the connection */
+static void mod_nats_connection_add_servers(mod_nats_connection_t *conn, const char *urls, switch_memory_pool_t *pool)
+{
+	char *list = switch_core_strdup(pool, urls);
+	char *argv[NATS_MAX_SERVERS];
+	int argc, i;
+
+	argc = switch_separate_string(list, ',', argv, NATS_MAX_SERVERS);
+	for (i = 0; i < argc; i++)
 	{
-		natsOptions_Destroy(opts);
+		if (zstr(argv[i]))
+		{
+			continue;
+		}
+		if (conn->server_count == NATS_MAX_SERVERS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "NATS connection[%s] has more than %d servers, ignoring [%s]\n", conn->name,
+							  NATS_MAX_SERVERS, argv[i]);
+			continue;
+		}
+		conn->nats_servers[conn->server_count++] = argv[i];
 	}
-	return SWITCH_STATUS_GENERR;
 }
 
 switch_status_t mod_nats_connection_create(mod_nats_connection_t **conn, switch_xml_t cfg, switch_memory_pool_t *pool)
@@ -143,7 +233,6 @@ switch_status_t mod_nats_connection_create(mod_nats_connection_t **conn, switch_
 	mod_nats_connection_t *new_con = switch_core_alloc(pool, sizeof(mod_nats_connection_t));
 	switch_xml_t param;
 	char *name = (char *)switch_xml_attr_soft(cfg, "name");
-	char *nats_url = NULL;
 
 	if (zstr(name))
 	{
@@ -154,6 +243,9 @@ switch_status_t mod_nats_connection_create(mod_nats_connection_t **conn, switch_
 	new_con->name = switch_core_strdup(pool, name);
 	new_con->connection = NULL;
 	new_con->next = NULL;
+	new_con->connect_timeout_ms = 500;
+	new_con->reconnect_wait_ms = 250;
+	new_con->max_reconnect = 10000;
 
 	for (param = switch_xml_child(cfg, "param"); param; param = param->next)
 	{
@@ -174,10 +266,39 @@ switch_status_t mod_nats_connection_create(mod_nats_connection_t **conn, switch_
 
 		if (!strncmp(var, "url", 3))
 		{
-			nats_url = switch_core_strdup(pool, val);
+			/* Every server of the cluster, in one or several url params */
+			mod_nats_connection_add_servers(new_con, val, pool);
 		}
+		else if (!strncmp(var, "connect_timeout_ms", 18))
+		{
+			int timeout = atoi(val);
+			if (timeout > 0)
+			{
+				new_con->connect_timeout_ms = timeout;
+			}
+		}
+		else if (!strncmp(var, "reconnect_wait_ms", 17))
+		{
+			int wait = atoi(val);
+			if (wait >= 0)
+			{
+				new_con->reconnect_wait_ms = wait;
+			}
+		}
+		else if (!strncmp(var, "max_reconnect", 13))
+		{
+			/* Negative values retry forever */
+			new_con->max_reconnect = atoi(val);
+		}
+		else if (!strncmp(var, "discovered_servers", 18))
+		{
+			new_con->ignore_discovered = switch_true(val) ? SWITCH_FALSE : SWITCH_TRUE;
+		}
+	}
+	if (!new_con->server_count)
+	{
+		new_con->nats_servers[new_con->server_count++] = NATS_DEFAULT_URL;
 	}
-	new_con->nats_servers[0] = nats_url ? nats_url : NATS_DEFAULT_URL;
 	*conn = new_con;
 	return SWITCH_STATUS_SUCCESS;
 }
@@ -191,6 +312,26 @@ void mod_nats_connection_destroy(mod_nats_connection_t **conn)
 	}
 }
 
+/* Whether two connections reach the same servers the same way, so a reload can hand an open one over */
+switch_bool_t mod_nats_connection_equal(const mod_nats_connection_t *a, const mod_nats_connection_t *b)
+{
+	int i;
+
+	if (strcmp(a->name, b->name) || a->server_count != b->server_count || a->connect_timeout_ms != b->connect_timeout_ms ||
+		a->reconnect_wait_ms != b->reconnect_wait_ms || a->max_reconnect != b->max_reconnect || a->ignore_discovered != b->ignore_discovered)
+	{
+		return SWITCH_FALSE;
+	}
+	for (i = 0; i < a->server_count; i++)
+	{
+		if (strcmp(a->nats_servers[i], b->nats_servers[i]))
+		{
+			return SWITCH_FALSE;
+		}
+	}
+	return SWITCH_TRUE;
+}
+
 /* For Emacs:
  * Local Variables:
  * mode:c
@@ -0,0 +1,400 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+
+/* Module level event dispatch. Every event type (and CUSTOM subclass) that any profile subscribes
+ * to is bound once, however many profiles want it. For each event the profiles that subscribed
+ * to it and admit it are grouped by encoding and header projection, the event is serialized once
+ * per group and the resulting message is shared by reference between the queues of the group.
+ * Profiles serializing in their workers, and groups of a single profile, serialize on their own
+ * as before.
+ *
+ * The dispatch holds the read side of dispatch_rwlock while it walks the profiles, adding or
+ * removing a profile takes the write side. Events are bound and unbound outside of it since the
+ * core holds its own event lock while it calls the handler.
+ */
+
+typedef struct
+{
+  switch_event_node_t *node;
+  int refs;
+} mod_nats_dispatch_binding_t;
+
+switch_status_t mod_nats_dispatch_init(switch_memory_pool_t *pool)
+{
+	if (switch_thread_rwlock_create(&mod_nats_globals.dispatch_rwlock, pool) != SWITCH_STATUS_SUCCESS ||
+		switch_mutex_init(&mod_nats_globals.dispatch_mutex, SWITCH_MUTEX_NESTED, pool) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_GENERR;
+	}
+	switch_core_hash_init(&mod_nats_globals.dispatch_subclasses);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Once every profile has been removed, anything still bound is released */
+void mod_nats_dispatch_shutdown(void)
+{
+	switch_hash_index_t *hi = NULL;
+	mod_nats_dispatch_binding_t *binding;
+	const void *key;
+
+	switch_event_unbind_callback(mod_nats_dispatch_event_handler);
+	while ((hi = switch_core_hash_first_iter(mod_nats_globals.dispatch_subclasses, hi)))
+	{
+		switch_core_hash_this(hi, &key, NULL, (void **)&binding);
+		switch_core_hash_delete(mod_nats_globals.dispatch_subclasses, (const char *)key);
+		free(binding);
+	}
+	switch_core_hash_destroy(&mod_nats_globals.dispatch_subclasses);
+}
+
+static switch_bool_t mod_nats_dispatch_subscribed(mod_nats_publisher_profile_t *profile, switch_event_t *evt)
+{
+	if (profile->subscribed[evt->event_id])
+	{
+		return SWITCH_TRUE;
+	}
+	return evt->event_id == SWITCH_EVENT_CUSTOM && evt->subclass_name && profile->subclasses &&
+		   switch_core_hash_find(profile->subclasses, evt->subclass_name);
+}
+
+/* Queue an event to those of the given profiles that admit it, serializing it once per group */
+void mod_nats_dispatch_deliver(mod_nats_publisher_profile_t **profiles, int profile_count, switch_event_t *evt, switch_time_t now)
+{
+	mod_nats_publisher_profile_t *targets[NATS_MAX_DISPATCH];
+	mod_nats_message_t *messages[NATS_MAX_DISPATCH] = {0};
+	int leader[NATS_MAX_DISPATCH];
+	int count = 0, i, j;
+
+	for (i = 0; i < profile_count; i++)
+	{
+		if (mod_nats_publisher_admit(profiles[i], evt, now))
+		{
+			leader[count] = -1;
+			targets[count++] = profiles[i];
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		mod_nats_projection_t *projection = targets[i]->projections[evt->event_id];
+		mod_nats_encoding_t encoding = targets[i]->encoding;
+		mod_nats_message_t *message;
+		unsigned int refs = 1;
+
+		if (leader[i] >= 0 || targets[i]->serialize_in_worker)
+		{
+			continue;
+		}
+		for (j = i + 1; j < count; j++)
+		{
+			if (leader[j] < 0 && !targets[j]->serialize_in_worker && targets[j]->encoding == encoding &&
+				mod_nats_projection_equal(targets[j]->projections[evt->event_id], projection))
+			{
+				leader[j] = i;
+				refs++;
+			}
+		}
+		if (refs == 1)
+		{
+			continue;
+		}
+
+		/* Shared messages outlive any single profile, they come from the heap and not a worker slab */
+		message = mod_nats_util_msg_create(NULL, mod_nats_encode_size(evt, encoding, projection));
+		message->encoding = encoding;
+		message->event_id = evt->event_id;
+		message->shard = mod_nats_util_shard(switch_event_get_header(evt, "Unique-ID"));
+		message->enqueued = now;
+		if (mod_nats_encode(&message, evt, projection) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "failed to serialize event [%s] for %u profiles\n", switch_event_name(evt->event_id), refs);
+			mod_nats_util_msg_destroy(&message);
+			for (j = i; j < count; j++)
+			{
+				if (j == i || leader[j] == i)
+				{
+					targets[j] = NULL;
+				}
+			}
+			continue;
+		}
+		/* Every reference is taken before the first queue can publish and release the message */
+		message->refs = refs;
+		messages[i] = message;
+		for (j = i + 1; j < count; j++)
+		{
+			if (leader[j] == i)
+			{
+				messages[j] = message;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (targets[i])
+		{
+			mod_nats_publisher_enqueue(targets[i], evt, messages[i], now);
+		}
+	}
+}
+
+void mod_nats_dispatch_event_handler(switch_event_t *evt)
+{
+	mod_nats_publisher_profile_t *profiles[NATS_MAX_DISPATCH];
+	int count = 0, i;
+
+	/* A subclass node only delivers what the CUSTOM node does not already */
+	if (evt->bind_user_data && __atomic_load_n(&mod_nats_globals.dispatch_refs[SWITCH_EVENT_CUSTOM], __ATOMIC_RELAXED))
+	{
+		return;
+	}
+
+	switch_thread_rwlock_rdlock(mod_nats_globals.dispatch_rwlock);
+	for (i = 0; i < mod_nats_globals.dispatch_count; i++)
+	{
+		if (mod_nats_dispatch_subscribed(mod_nats_globals.dispatch_profiles[i], evt))
+		{
+			profiles[count++] = mod_nats_globals.dispatch_profiles[i];
+		}
+	}
+	if (count)
+	{
+		mod_nats_dispatch_deliver(profiles, count, evt, switch_time_now());
+	}
+	switch_thread_rwlock_unlock(mod_nats_globals.dispatch_rwlock);
+}
+
+static switch_status_t mod_nats_dispatch_bind(switch_event_types_t type, const char *subclass)
+{
+	mod_nats_dispatch_binding_t *binding;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+
+	switch_mutex_lock(mod_nats_globals.dispatch_mutex);
+	if (!subclass)
+	{
+		if (!mod_nats_globals.dispatch_refs[type] &&
+			(status = switch_event_bind_removable("NATS", type, SWITCH_EVENT_SUBCLASS_ANY, mod_nats_dispatch_event_handler, NULL,
+												  &mod_nats_globals.dispatch_nodes[type])) != SWITCH_STATUS_SUCCESS)
+		{
+			goto done;
+		}
+		__atomic_add_fetch(&mod_nats_globals.dispatch_refs[type], 1, __ATOMIC_RELAXED);
+		goto done;
+	}
+
+	if (!(binding = switch_core_hash_find(mod_nats_globals.dispatch_subclasses, subclass)))
+	{
+		switch_zmalloc(binding, sizeof(mod_nats_dispatch_binding_t));
+		if ((status = switch_event_bind_removable("NATS", SWITCH_EVENT_CUSTOM, subclass, mod_nats_dispatch_event_handler, binding,
+												  &binding->node)) != SWITCH_STATUS_SUCCESS)
+		{
+			free(binding);
+			goto done;
+		}
+		switch_core_hash_insert(mod_nats_globals.dispatch_subclasses, subclass, binding);
+	}
+	binding->refs++;
+
+done:
+	switch_mutex_unlock(mod_nats_globals.dispatch_mutex);
+	return status;
+}
+
+static void mod_nats_dispatch_unbind(switch_event_types_t type, const char *subclass)
+{
+	mod_nats_dispatch_binding_t *binding;
+
+	switch_mutex_lock(mod_nats_globals.dispatch_mutex);
+	if (!subclass)
+	{
+		if (mod_nats_globals.dispatch_refs[type] && !__atomic_sub_fetch(&mod_nats_globals.dispatch_refs[type], 1, __ATOMIC_RELAXED) &&
+			mod_nats_globals.dispatch_nodes[type])
+		{
+			switch_event_unbind(&mod_nats_globals.dispatch_nodes[type]);
+		}
+	}
+	else if ((binding = switch_core_hash_find(mod_nats_globals.dispatch_subclasses, subclass)) && !--binding->refs)
+	{
+		switch_core_hash_delete(mod_nats_globals.dispatch_subclasses, subclass);
+		switch_event_unbind(&binding->node);
+		free(binding);
+	}
+	switch_mutex_unlock(mod_nats_globals.dispatch_mutex);
+}
+
+/* Bind (or unbind) at most limit of the subscriptions of a profile, limit < 0 walks them all.
+ * Returns how many were walked, they are all bound unless it is less than the limit.
+ */
+static int mod_nats_dispatch_walk(mod_nats_publisher_profile_t *profile, switch_bool_t bind, int limit)
+{
+	switch_hash_index_t *hi;
+	const void *key;
+	int i, done = 0;
+
+	for (i = 0; i < SWITCH_EVENT_ALL && done != limit; i++)
+	{
+		if (!profile->subscribed[i])
+		{
+			continue;
+		}
+		if (!bind)
+		{
+			mod_nats_dispatch_unbind(i, NULL);
+		}
+		else if (mod_nats_dispatch_bind(i, NULL) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot bind to event %s!\n", switch_event_name(i));
+			return done;
+		}
+		done++;
+	}
+	for (hi = profile->subclasses ? switch_core_hash_first(profile->subclasses) : NULL; hi && done != limit; hi = switch_core_hash_next(&hi))
+	{
+		switch_core_hash_this(hi, &key, NULL, NULL);
+		if (!bind)
+		{
+			mod_nats_dispatch_unbind(SWITCH_EVENT_CUSTOM, (const char *)key);
+		}
+		else if (mod_nats_dispatch_bind(SWITCH_EVENT_CUSTOM, (const char *)key) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot bind to event CUSTOM %s!\n", (const char *)key);
+			break;
+		}
+		done++;
+	}
+	switch_safe_free(hi);
+	return done;
+}
+
+/* Start dispatching the subscribed events to a profile */
+switch_status_t mod_nats_dispatch_add(mod_nats_publisher_profile_t *profile)
+{
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	int bound = mod_nats_dispatch_walk(profile, SWITCH_TRUE, -1);
+
+	if (bound < profile->event_subscriptions)
+	{
+		mod_nats_dispatch_walk(profile, SWITCH_FALSE, bound);
+		return SWITCH_STATUS_GENERR;
+	}
+
+	switch_thread_rwlock_wrlock(mod_nats_globals.dispatch_rwlock);
+	if (mod_nats_globals.dispatch_count < NATS_MAX_DISPATCH)
+	{
+		mod_nats_globals.dispatch_profiles[mod_nats_globals.dispatch_count++] = profile;
+		profile->dispatched = SWITCH_TRUE;
+	}
+	else
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] cannot be added, at most %d profiles\n", profile->name, NATS_MAX_DISPATCH);
+		status = SWITCH_STATUS_GENERR;
+	}
+	switch_thread_rwlock_unlock(mod_nats_globals.dispatch_rwlock);
+
+	if (status != SWITCH_STATUS_SUCCESS)
+	{
+		mod_nats_dispatch_walk(profile, SWITCH_FALSE, -1);
+	}
+	return status;
+}
+
+/* Stop dispatching events to a profile, no event is being queued to it once this returns */
+void mod_nats_dispatch_remove(mod_nats_publisher_profile_t *profile)
+{
+	int i;
+
+	if (!profile->dispatched)
+	{
+		return;
+	}
+	switch_thread_rwlock_wrlock(mod_nats_globals.dispatch_rwlock);
+	for (i = 0; i < mod_nats_globals.dispatch_count; i++)
+	{
+		if (mod_nats_globals.dispatch_profiles[i] == profile)
+		{
+			mod_nats_globals.dispatch_profiles[i] = mod_nats_globals.dispatch_profiles[--mod_nats_globals.dispatch_count];
+			break;
+		}
+	}
+	profile->dispatched = SWITCH_FALSE;
+	switch_thread_rwlock_unlock(mod_nats_globals.dispatch_rwlock);
+	mod_nats_dispatch_walk(profile, SWITCH_FALSE, -1);
+}
+
+/* Dispatch to profile the events that went to old so far, in a single step: every event is queued
+ * to exactly one of them. The events both subscribe to stay bound throughout.
+ */
+switch_status_t mod_nats_dispatch_replace(mod_nats_publisher_profile_t *old, mod_nats_publisher_profile_t *profile)
+{
+	int bound, i;
+
+	if (!old->dispatched)
+	{
+		return mod_nats_dispatch_add(profile);
+	}
+	if ((bound = mod_nats_dispatch_walk(profile, SWITCH_TRUE, -1)) < profile->event_subscriptions)
+	{
+		mod_nats_dispatch_walk(profile, SWITCH_FALSE, bound);
+		return SWITCH_STATUS_GENERR;
+	}
+
+	switch_thread_rwlock_wrlock(mod_nats_globals.dispatch_rwlock);
+	for (i = 0; i < mod_nats_globals.dispatch_count; i++)
+	{
+		if (mod_nats_globals.dispatch_profiles[i] == old)
+		{
+			mod_nats_globals.dispatch_profiles[i] = profile;
+			break;
+		}
+	}
+	profile->dispatched = SWITCH_TRUE;
+	old->dispatched = SWITCH_FALSE;
+	switch_thread_rwlock_unlock(mod_nats_globals.dispatch_rwlock);
+	mod_nats_dispatch_walk(old, SWITCH_FALSE, -1);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
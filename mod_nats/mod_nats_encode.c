@@ -0,0 +1,476 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+
+/* The encoders write straight from the event headers into the payload of the message, growing
+ * the message allocation when needed. The JSON output is the same as switch_event_serialize_json
+ * but without building a cJSON tree first. Headers rejected by the projection of the event type
+ * are skipped, the body (and its Content-Length) is projected as "_body".
+ */
+
+static inline switch_status_t mod_nats_encode_put(mod_nats_message_t **msg, const char *data, size_t len)
+{
+	if (mod_nats_util_msg_reserve(msg, len) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_MEMERR;
+	}
+	memcpy((*msg)->payload + (*msg)->payload_len, data, len);
+	(*msg)->payload_len += len;
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t mod_nats_encode_json_string(mod_nats_message_t **msg, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *)(str ? str : "");
+	const unsigned char *run = p;
+	char esc[6] = {'\\', 'u', '0', '0', 0, 0};
+
+	if (mod_nats_encode_put(msg, "\"", 1) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_MEMERR;
+	}
+	for (; *p; p++)
+	{
+		const char *rep = NULL;
+		size_t rep_len = 2;
+
+		if (*p >= 32 && *p != '"' && *p != '\\')
+		{
+			continue;
+		}
+		switch (*p)
+		{
+		case '"':
+			rep = "\\\"";
+			break;
+		case '\\':
+			rep = "\\\\";
+			break;
+		case '\b':
+			rep = "\\b";
+			break;
+		case '\f':
+			rep = "\\f";
+			break;
+		case '\n':
+			rep = "\\n";
+			break;
+		case '\r':
+			rep = "\\r";
+			break;
+		case '\t':
+			rep = "\\t";
+			break;
+		default:
+			esc[4] = hex[*p >> 4];
+			esc[5] = hex[*p & 0xf];
+			rep = esc;
+			rep_len = sizeof(esc);
+			break;
+		}
+		if (mod_nats_encode_put(msg, (const char *)run, p - run) != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_put(msg, rep, rep_len) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+		run = p + 1;
+	}
+	if (mod_nats_encode_put(msg, (const char *)run, p - run) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_MEMERR;
+	}
+	return mod_nats_encode_put(msg, "\"", 1);
+}
+
+/* Size of the JSON document when no character needs escaping */
+size_t mod_nats_encode_json_size(switch_event_t *evt)
+{
+	switch_event_header_t *hp;
+	size_t size = 2;
+	int i;
+
+	for (hp = evt->headers; hp; hp = hp->next)
+	{
+		size += strlen(hp->name) + 4;
+		if (hp->idx)
+		{
+			for (i = 0; i < hp->idx; i++)
+			{
+				size += strlen(hp->array[i]) + 3;
+			}
+			size += 2;
+		}
+		else
+		{
+			size += strlen(hp->value) + 2;
+		}
+	}
+	if (evt->body)
+	{
+		size += strlen(evt->body) + 48;
+	}
+	return size;
+}
+
+switch_status_t mod_nats_encode_json(mod_nats_message_t **msg, switch_event_t *evt, const mod_nats_projection_t *projection)
+{
+	switch_event_header_t *hp;
+	const char *sep = "{";
+	int i;
+
+	for (hp = evt->headers; hp; hp = hp->next)
+	{
+		if (projection && !mod_nats_projection_match(projection, hp->name))
+		{
+			continue;
+		}
+		if (mod_nats_encode_put(msg, sep, 1) != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_json_string(msg, hp->name) != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_put(msg, ":", 1) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+		if (hp->idx)
+		{
+			for (i = 0; i < hp->idx; i++)
+			{
+				if (mod_nats_encode_put(msg, i ? "," : "[", 1) != SWITCH_STATUS_SUCCESS ||
+					mod_nats_encode_json_string(msg, hp->array[i]) != SWITCH_STATUS_SUCCESS)
+				{
+					return SWITCH_STATUS_MEMERR;
+				}
+			}
+			if (mod_nats_encode_put(msg, "]", 1) != SWITCH_STATUS_SUCCESS)
+			{
+				return SWITCH_STATUS_MEMERR;
+			}
+		}
+		else if (mod_nats_encode_json_string(msg, hp->value) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+		sep = ",";
+	}
+
+	if (evt->body && mod_nats_projection_match(projection, "_body"))
+	{
+		char tmp[25];
+
+		switch_snprintf(tmp, sizeof(tmp), "%d", (int)strlen(evt->body));
+		if (mod_nats_encode_put(msg, sep, 1) != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_json_string(msg, "Content-Length") != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_put(msg, ":", 1) != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_json_string(msg, tmp) != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_put(msg, ",", 1) != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_json_string(msg, "_body") != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_put(msg, ":", 1) != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_json_string(msg, evt->body) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+		sep = ",";
+	}
+
+	if (*sep == '{' && mod_nats_encode_put(msg, "{", 1) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_MEMERR;
+	}
+	if (mod_nats_encode_put(msg, "}", 1) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_MEMERR;
+	}
+	(*msg)->payload[(*msg)->payload_len] = '\0';
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Header names interned as small integer map keys by the msgpack encoding. Consumers decode the
+ * keys with the dictionary announced in the FS-Dictionary header, so entries must only ever be
+ * appended and NATS_DICTIONARY_VERSION bumped when they are.
+ */
+static const char *mod_nats_dictionary_v1[] = {
+	"Event-Name", "Core-UUID", "FreeSWITCH-Hostname", "FreeSWITCH-Switchname", "FreeSWITCH-IPv4",
+	"FreeSWITCH-IPv6", "Event-Date-Local", "Event-Date-GMT", "Event-Date-Timestamp", "Event-Calling-File",
+	"Event-Calling-Function", "Event-Calling-Line-Number", "Event-Sequence", "Event-Subclass", "Unique-ID",
+	"Channel-State", "Channel-Call-State", "Channel-State-Number", "Channel-Name", "Answer-State",
+	"Call-Direction", "Presence-Call-Direction", "Channel-HIT-Dialplan", "Channel-Presence-ID", "Channel-Call-UUID",
+	"Channel-Read-Codec-Name", "Channel-Read-Codec-Rate", "Channel-Read-Codec-Bit-Rate", "Channel-Write-Codec-Name", "Channel-Write-Codec-Rate",
+	"Channel-Write-Codec-Bit-Rate", "Original-Channel-Call-State", "Hangup-Cause", "Caller-Direction", "Caller-Logical-Direction",
+	"Caller-Username", "Caller-Dialplan", "Caller-Caller-ID-Name", "Caller-Caller-ID-Number", "Caller-Orig-Caller-ID-Name",
+	"Caller-Orig-Caller-ID-Number", "Caller-Callee-ID-Name", "Caller-Callee-ID-Number", "Caller-Network-Addr", "Caller-ANI",
+	"Caller-Destination-Number", "Caller-Unique-ID", "Caller-Source", "Caller-Context", "Caller-Channel-Name",
+	"Caller-Profile-Index", "Caller-Profile-Created-Time", "Caller-Channel-Created-Time", "Caller-Channel-Answered-Time", "Caller-Channel-Progress-Time",
+	"Caller-Channel-Progress-Media-Time", "Caller-Channel-Hangup-Time", "Caller-Channel-Transfer-Time", "Caller-Channel-Resurrect-Time", "Caller-Channel-Bridged-Time",
+	"Caller-Channel-Last-Hold", "Caller-Channel-Hold-Accum", "Caller-Screen-Bit", "Caller-Privacy-Hide-Name", "Caller-Privacy-Hide-Number",
+	"Other-Type", "Other-Leg-Direction", "Other-Leg-Unique-ID", "Other-Leg-Caller-ID-Name", "Other-Leg-Caller-ID-Number",
+	"Other-Leg-Destination-Number", "Other-Leg-Channel-Name", "Bridge-A-Unique-ID", "Bridge-B-Unique-ID", "DTMF-Digit",
+	"DTMF-Duration", "DTMF-Source", "Job-UUID", "Job-Command", "Job-Command-Arg",
+	"Content-Length", "_body", "Event-Info", "Up-Time", "FreeSWITCH-Version",
+	"Uptime-msec", "Session-Count", "Max-Sessions", "Session-Per-Sec", "Session-Per-Sec-Last",
+	"Session-Per-Sec-Max", "Session-Per-Sec-FiveMin", "Session-Since-Startup", "Session-Peak-Max", "Session-Peak-FiveMin",
+	"Idle-CPU", "Heartbeat-Interval", "Application", "Application-Data", "Application-Response",
+	"Application-UUID", "variable_uuid", "variable_direction", "variable_call_uuid", "variable_channel_name",
+	"variable_sip_from_user", "variable_sip_from_host", "variable_sip_from_uri", "variable_sip_to_user", "variable_sip_to_host",
+	"variable_sip_to_uri", "variable_sip_call_id", "variable_sip_req_uri", "variable_sip_contact_user", "variable_sip_user_agent",
+	"variable_sip_network_ip", "variable_sip_network_port", "variable_sip_received_ip", "variable_sip_received_port", "variable_sip_via_protocol",
+	"variable_sip_profile_name", "variable_sofia_profile_name", "variable_hangup_cause", "variable_hangup_cause_q850", "variable_duration",
+	"variable_billsec", "variable_progresssec", "variable_answersec", "variable_waitsec", "variable_start_epoch",
+	"variable_answer_epoch", "variable_end_epoch", "variable_start_uepoch", "variable_answer_uepoch", "variable_end_uepoch",
+	"variable_caller_id_name", "variable_caller_id_number", "variable_domain_name", "variable_user_name", "variable_read_codec",
+	"variable_write_codec", "variable_endpoint_disposition", "variable_current_application", "variable_current_application_data", "variable_originator",
+	"variable_originatee", "variable_bridge_uuid", "variable_last_bridge_to", "variable_signal_bond", "variable_sip_hangup_disposition",
+	NULL
+};
+
+void mod_nats_encode_init(switch_memory_pool_t *pool)
+{
+	int i;
+
+	switch_core_hash_init(&mod_nats_globals.dictionary);
+	for (i = 0; mod_nats_dictionary_v1[i]; i++)
+	{
+		switch_core_hash_insert(mod_nats_globals.dictionary, mod_nats_dictionary_v1[i], (void *)(intptr_t)(i + 1));
+	}
+}
+
+void mod_nats_encode_shutdown(void)
+{
+	if (mod_nats_globals.dictionary)
+	{
+		switch_core_hash_destroy(&mod_nats_globals.dictionary);
+	}
+}
+
+const char *mod_nats_encoding_name(mod_nats_encoding_t encoding)
+{
+	switch (encoding)
+	{
+	case NATS_ENCODING_MSGPACK:
+		return "msgpack";
+	default:
+		return "json";
+	}
+}
+
+switch_status_t mod_nats_encoding_parse(const char *name, mod_nats_encoding_t *encoding)
+{
+	if (!strcasecmp(name, "json"))
+	{
+		*encoding = NATS_ENCODING_JSON;
+	}
+	else if (!strcasecmp(name, "msgpack"))
+	{
+		*encoding = NATS_ENCODING_MSGPACK;
+	}
+	else
+	{
+		return SWITCH_STATUS_FALSE;
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t mod_nats_encode_msgpack_len(mod_nats_message_t **msg, uint8_t fix, uint8_t fix_max, uint8_t op8, uint8_t op16, uint8_t op32, size_t len)
+{
+	uint8_t buf[5];
+	size_t n;
+
+	if (len < fix_max)
+	{
+		buf[0] = fix | (uint8_t)len;
+		n = 1;
+	}
+	else if (op8 && len < 0x100)
+	{
+		buf[0] = op8;
+		buf[1] = (uint8_t)len;
+		n = 2;
+	}
+	else if (len < 0x10000)
+	{
+		buf[0] = op16;
+		buf[1] = (uint8_t)(len >> 8);
+		buf[2] = (uint8_t)len;
+		n = 3;
+	}
+	else
+	{
+		buf[0] = op32;
+		buf[1] = (uint8_t)(len >> 24);
+		buf[2] = (uint8_t)(len >> 16);
+		buf[3] = (uint8_t)(len >> 8);
+		buf[4] = (uint8_t)len;
+		n = 5;
+	}
+	return mod_nats_encode_put(msg, (const char *)buf, n);
+}
+
+static switch_status_t mod_nats_encode_msgpack_str(mod_nats_message_t **msg, const char *str)
+{
+	size_t len;
+
+	str = str ? str : "";
+	len = strlen(str);
+	if (mod_nats_encode_msgpack_len(msg, 0xa0, 32, 0xd9, 0xda, 0xdb, len) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_MEMERR;
+	}
+	return mod_nats_encode_put(msg, str, len);
+}
+
+/* Interned names are written as positive integers, anything else as a string */
+static switch_status_t mod_nats_encode_msgpack_key(mod_nats_message_t **msg, const char *name)
+{
+	intptr_t id = (intptr_t)switch_core_hash_find(mod_nats_globals.dictionary, name);
+	uint8_t buf[3];
+
+	if (!id)
+	{
+		return mod_nats_encode_msgpack_str(msg, name);
+	}
+	id--;
+	if (id < 0x80)
+	{
+		buf[0] = (uint8_t)id;
+		return mod_nats_encode_put(msg, (const char *)buf, 1);
+	}
+	buf[0] = 0xcd;
+	buf[1] = (uint8_t)(id >> 8);
+	buf[2] = (uint8_t)id;
+	return mod_nats_encode_put(msg, (const char *)buf, 3);
+}
+
+/* The same document as the JSON encoding, as a msgpack map */
+switch_status_t mod_nats_encode_msgpack(mod_nats_message_t **msg, switch_event_t *evt, const mod_nats_projection_t *projection)
+{
+	switch_event_header_t *hp;
+	switch_bool_t body = evt->body && mod_nats_projection_match(projection, "_body");
+	size_t count = body ? 2 : 0;
+	int i;
+
+	/* The map length comes first, so the projection is evaluated twice */
+	for (hp = evt->headers; hp; hp = hp->next)
+	{
+		if (!projection || mod_nats_projection_match(projection, hp->name))
+		{
+			count++;
+		}
+	}
+	if (mod_nats_encode_msgpack_len(msg, 0x80, 16, 0, 0xde, 0xdf, count) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_MEMERR;
+	}
+
+	for (hp = evt->headers; hp; hp = hp->next)
+	{
+		if (projection && !mod_nats_projection_match(projection, hp->name))
+		{
+			continue;
+		}
+		if (mod_nats_encode_msgpack_key(msg, hp->name) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+		if (hp->idx)
+		{
+			if (mod_nats_encode_msgpack_len(msg, 0x90, 16, 0, 0xdc, 0xdd, hp->idx) != SWITCH_STATUS_SUCCESS)
+			{
+				return SWITCH_STATUS_MEMERR;
+			}
+			for (i = 0; i < hp->idx; i++)
+			{
+				if (mod_nats_encode_msgpack_str(msg, hp->array[i]) != SWITCH_STATUS_SUCCESS)
+				{
+					return SWITCH_STATUS_MEMERR;
+				}
+			}
+		}
+		else if (mod_nats_encode_msgpack_str(msg, hp->value) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+	}
+
+	if (body)
+	{
+		char tmp[25];
+
+		switch_snprintf(tmp, sizeof(tmp), "%d", (int)strlen(evt->body));
+		if (mod_nats_encode_msgpack_key(msg, "Content-Length") != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_msgpack_str(msg, tmp) != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_msgpack_key(msg, "_body") != SWITCH_STATUS_SUCCESS ||
+			mod_nats_encode_msgpack_str(msg, evt->body) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+	}
+
+	(*msg)->payload[(*msg)->payload_len] = '\0';
+	return SWITCH_STATUS_SUCCESS;
+}
+
+size_t mod_nats_encode_size(switch_event_t *evt, mod_nats_encoding_t encoding, const mod_nats_projection_t *projection)
+{
+	/* A projected event is a fraction of the full one, start small and let the encoder grow
+	 * the message instead of walking the headers one more time.
+	 */
+	if (projection)
+	{
+		return NATS_PROJECTED_SIZE;
+	}
+	/* The JSON size is a good upper bound of the msgpack one */
+	return mod_nats_encode_json_size(evt);
+}
+
+switch_status_t mod_nats_encode(mod_nats_message_t **msg, switch_event_t *evt, const mod_nats_projection_t *projection)
+{
+	switch ((*msg)->encoding)
+	{
+	case NATS_ENCODING_MSGPACK:
+		return mod_nats_encode_msgpack(msg, evt, projection);
+	default:
+		return mod_nats_encode_json(msg, evt, projection);
+	}
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
@@ -0,0 +1,296 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+
+/* Priority lanes. Each worker has one bounded ring per lane and all of them share the queue
+ * capacity of the worker:
+ *
+ *   <lanes scheduling="weighted">
+ *     <lane name="critical" weight="8" events="CHANNEL_CREATE,CHANNEL_ANSWER,CHANNEL_HANGUP,CHANNEL_HANGUP_COMPLETE,BACKGROUND_JOB" />
+ *     <lane name="default" weight="4" events="*" />
+ *     <lane name="noisy" weight="1" queue_size="2000" events="CHANNEL_CALLSTATE,CHANNEL_STATE,DTMF" />
+ *   </lanes>
+ *
+ * Lanes are listed from the highest priority to the lowest. Event types without a lane go to the
+ * lane of "*", or to the last one. With strict scheduling a worker always drains the higher lanes
+ * first, with weighted scheduling (deficit round robin) it takes up to 'weight' messages of a lane
+ * before moving to the next. queue_size optionally bounds a lane below the profile capacity.
+ *
+ * When the worker is at capacity, a new message evicts the oldest message of the lowest priority
+ * non empty lane below its own. Events of one call in different lanes may be published out of order.
+ * Without a <lanes> section every event goes to a single lane, as a plain FIFO.
+ */
+
+switch_status_t mod_nats_lane_load(mod_nats_publisher_profile_t *profile, switch_xml_t cfg)
+{
+	const char *scheduling = switch_xml_attr_soft(cfg, "scheduling");
+	int catch_all = -1, lane_count = 0, i;
+	switch_xml_t xlane;
+
+	if (!zstr(scheduling) && strcasecmp(scheduling, "weighted"))
+	{
+		if (strcasecmp(scheduling, "strict"))
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] unknown lane scheduling [%s]\n", profile->name, scheduling);
+			return SWITCH_STATUS_FALSE;
+		}
+		profile->lane_strict = SWITCH_TRUE;
+	}
+	for (i = 0; i < SWITCH_EVENT_ALL; i++)
+	{
+		profile->event_lanes[i] = -1;
+	}
+
+	for (xlane = switch_xml_child(cfg, "lane"); xlane; xlane = xlane->next)
+	{
+		mod_nats_lane_t *lane = &profile->lanes[lane_count];
+		char *events = switch_core_strdup(profile->pool, switch_xml_attr_soft(xlane, "events"));
+		const char *name = switch_xml_attr_soft(xlane, "name");
+		const char *weight = switch_xml_attr(xlane, "weight");
+		const char *queue_size = switch_xml_attr(xlane, "queue_size");
+		char *argv[SWITCH_EVENT_ALL];
+		int argc;
+
+		if (lane_count == NATS_MAX_LANES)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] has more than %d lanes\n", profile->name, NATS_MAX_LANES);
+			return SWITCH_STATUS_FALSE;
+		}
+		lane->name = zstr(name) ? switch_core_sprintf(profile->pool, "lane%d", lane_count) : switch_core_strdup(profile->pool, name);
+		lane->weight = weight ? atoi(weight) : 1;
+		lane->queue_size = queue_size ? atoi(queue_size) : 0;
+		if (lane->weight < 1)
+		{
+			lane->weight = 1;
+		}
+
+		argc = switch_separate_string(events, ',', argv, (sizeof(argv) / sizeof(argv[0])));
+		for (i = 0; i < argc; i++)
+		{
+			switch_event_types_t type;
+
+			if (!strcmp(argv[i], "*"))
+			{
+				catch_all = lane_count;
+			}
+			else if (switch_name_event(argv[i], &type) != SWITCH_STATUS_SUCCESS || type == SWITCH_EVENT_ALL)
+			{
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] lane event [%s] was not recognised\n", profile->name, argv[i]);
+				return SWITCH_STATUS_FALSE;
+			}
+			else
+			{
+				profile->event_lanes[type] = (int8_t)lane_count;
+			}
+		}
+		lane_count++;
+	}
+
+	if (!lane_count)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] lanes section without any lane\n", profile->name);
+		return SWITCH_STATUS_FALSE;
+	}
+	if (catch_all < 0)
+	{
+		catch_all = lane_count - 1;
+	}
+	for (i = 0; i < SWITCH_EVENT_ALL; i++)
+	{
+		if (profile->event_lanes[i] < 0)
+		{
+			profile->event_lanes[i] = (int8_t)catch_all;
+		}
+	}
+	profile->lane_count = lane_count;
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Create the rings of a worker, queue_size is its share of the profile capacity */
+switch_status_t mod_nats_lane_worker_init(mod_nats_publisher_worker_t *worker, unsigned int queue_size, switch_memory_pool_t *pool)
+{
+	mod_nats_publisher_profile_t *profile = worker->profile;
+	int i;
+
+	worker->queue_capacity = queue_size;
+	for (i = 0; i < profile->lane_count; i++)
+	{
+		unsigned int lane_size = queue_size;
+
+		if (profile->lanes[i].queue_size)
+		{
+			lane_size = (profile->lanes[i].queue_size + profile->worker_count - 1) / profile->worker_count;
+			lane_size = lane_size < queue_size ? lane_size : queue_size;
+		}
+		if (mod_nats_ring_create(&worker->send_queues[i], lane_size, pool) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create lane [%s] of size %u!\n", profile->lanes[i].name, lane_size);
+			return SWITCH_STATUS_GENERR;
+		}
+		if (i)
+		{
+			mod_nats_ring_link(worker->send_queues[i], worker->send_queues[0]);
+		}
+	}
+	worker->lane_credit = profile->lanes[0].weight;
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Called by the event threads and the spill replay thread. On success the message belongs to the
+ * worker, otherwise it is left to the caller.
+ */
+switch_status_t mod_nats_lane_push(mod_nats_publisher_worker_t *worker, mod_nats_message_t *msg, switch_bool_t evict)
+{
+	mod_nats_publisher_profile_t *profile = worker->profile;
+	int lane = profile->event_lanes[msg->event_id];
+	int victim_lane;
+
+	if (__atomic_fetch_add(&worker->queued, 1, __ATOMIC_RELAXED) >= worker->queue_capacity)
+	{
+		mod_nats_message_t *victim = NULL;
+
+		/* Make room by dropping the oldest message of the lowest priority lane */
+		for (victim_lane = profile->lane_count - 1; evict && victim_lane > lane; victim_lane--)
+		{
+			if (mod_nats_ring_trypop(worker->send_queues[victim_lane], (void **)&victim) == SWITCH_STATUS_SUCCESS)
+			{
+				break;
+			}
+		}
+		if (!victim)
+		{
+			__atomic_fetch_sub(&worker->queued, 1, __ATOMIC_RELAXED);
+			return SWITCH_STATUS_FALSE;
+		}
+		NATS_STAT_INC(profile->lanes[victim_lane].evicted);
+		NATS_STAT_INC(profile->dropped);
+		mod_nats_util_msg_destroy(&victim);
+		__atomic_fetch_sub(&worker->queued, 1, __ATOMIC_RELAXED);
+	}
+
+	if (mod_nats_ring_trypush(worker->send_queues[lane], msg) != SWITCH_STATUS_SUCCESS)
+	{
+		__atomic_fetch_sub(&worker->queued, 1, __ATOMIC_RELAXED);
+		return SWITCH_STATUS_FALSE;
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Called by the worker, takes up to max messages from its lanes */
+unsigned int mod_nats_lane_pop_batch(mod_nats_publisher_worker_t *worker, mod_nats_message_t **msgs, unsigned int max)
+{
+	mod_nats_publisher_profile_t *profile = worker->profile;
+	unsigned int count = 0, popped;
+	int lane, idle = 0;
+
+	if (profile->lane_strict || profile->lane_count == 1)
+	{
+		for (lane = 0; lane < profile->lane_count && count < max; lane++)
+		{
+			count += mod_nats_ring_pop_batch(worker->send_queues[lane], (void **)(msgs + count), max - count);
+		}
+	}
+	else
+	{
+		/* Deficit round robin, a lane keeps its turn until it is empty or out of credit */
+		while (count < max && idle < profile->lane_count)
+		{
+			unsigned int want = max - count;
+
+			lane = worker->lane_current;
+			want = want < (unsigned int)worker->lane_credit ? want : (unsigned int)worker->lane_credit;
+			popped = mod_nats_ring_pop_batch(worker->send_queues[lane], (void **)(msgs + count), want);
+			count += popped;
+			worker->lane_credit -= popped;
+			idle = popped ? 0 : idle + 1;
+			if (!popped || !worker->lane_credit)
+			{
+				worker->lane_current = (lane + 1) % profile->lane_count;
+				worker->lane_credit = profile->lanes[worker->lane_current].weight;
+			}
+		}
+	}
+
+	if (count)
+	{
+		__atomic_fetch_sub(&worker->queued, count, __ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+unsigned int mod_nats_lane_size(mod_nats_publisher_worker_t *worker)
+{
+	return __atomic_load_n(&worker->queued, __ATOMIC_RELAXED);
+}
+
+void mod_nats_lane_wait(mod_nats_publisher_worker_t *worker, switch_interval_time_t timeout)
+{
+	mod_nats_ring_wait_any(worker->send_queues, worker->profile->lane_count, timeout);
+}
+
+void mod_nats_lane_wake(mod_nats_publisher_worker_t *worker)
+{
+	if (worker->send_queues[0])
+	{
+		mod_nats_ring_wake(worker->send_queues[0]);
+	}
+}
+
+/* Only once the worker thread is joined, queued messages are discarded */
+void mod_nats_lane_worker_destroy(mod_nats_publisher_worker_t *worker)
+{
+	mod_nats_message_t *msg = NULL;
+	int i;
+
+	for (i = 0; i < NATS_MAX_LANES; i++)
+	{
+		while (worker->send_queues[i] && mod_nats_ring_trypop(worker->send_queues[i], (void **)&msg) == SWITCH_STATUS_SUCCESS)
+		{
+			mod_nats_util_msg_destroy(&msg);
+		}
+	}
+	worker->queued = 0;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
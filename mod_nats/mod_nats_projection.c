@@ -0,0 +1,233 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+
+/* Header projections limit the headers a profile publishes for an event type:
+ *
+ *   <projections>
+ *     <projection event="CHANNEL_STATE,CHANNEL_CALLSTATE" allow="Unique-ID,Channel-State,variable_sip_*" />
+ *     <projection event="*" deny="variable_*" />
+ *   </projections>
+ *
+ * A name ending with '*' is a prefix. The allow list of an event type replaces the wildcard one,
+ * deny lists of both apply. The event body is matched as "_body". Each event type gets its
+ * compiled matcher when the profile is created, the encoders consult it for every header.
+ */
+
+static mod_nats_name_list_t *mod_nats_projection_list_create(mod_nats_publisher_profile_t *profile, const char *val)
+{
+	mod_nats_name_list_t *list;
+	char *argv[256];
+	char *tmp;
+	int argc, i;
+
+	if (zstr(val))
+	{
+		return NULL;
+	}
+
+	list = switch_core_alloc(profile->pool, sizeof(mod_nats_name_list_t));
+	list->spec = switch_core_strdup(profile->pool, val);
+	switch_core_hash_init(&list->names);
+	list->next = profile->projection_lists;
+	profile->projection_lists = list;
+
+	tmp = switch_core_strdup(profile->pool, val);
+	argc = switch_separate_string(tmp, ',', argv, (sizeof(argv) / sizeof(argv[0])));
+	list->prefixes = switch_core_alloc(profile->pool, sizeof(char *) * (argc + 1));
+	for (i = 0; i < argc; i++)
+	{
+		size_t len = strlen(argv[i]);
+
+		if (!len)
+		{
+			continue;
+		}
+		if (argv[i][len - 1] == '*')
+		{
+			argv[i][len - 1] = '\0';
+			list->prefixes[list->prefix_count++] = argv[i];
+		}
+		else
+		{
+			switch_core_hash_insert(list->names, argv[i], (void *)list);
+		}
+	}
+	return list;
+}
+
+static switch_bool_t mod_nats_projection_list_match(const mod_nats_name_list_t *list, const char *name)
+{
+	int i;
+
+	if (switch_core_hash_find(list->names, name))
+	{
+		return SWITCH_TRUE;
+	}
+	for (i = 0; i < list->prefix_count; i++)
+	{
+		if (!strncmp(name, list->prefixes[i], strlen(list->prefixes[i])))
+		{
+			return SWITCH_TRUE;
+		}
+	}
+	return SWITCH_FALSE;
+}
+
+switch_bool_t mod_nats_projection_match(const mod_nats_projection_t *projection, const char *name)
+{
+	if (!projection)
+	{
+		return SWITCH_TRUE;
+	}
+	if (projection->allow && !mod_nats_projection_list_match(projection->allow, name))
+	{
+		return SWITCH_FALSE;
+	}
+	if (projection->deny[0] && mod_nats_projection_list_match(projection->deny[0], name))
+	{
+		return SWITCH_FALSE;
+	}
+	if (projection->deny[1] && mod_nats_projection_list_match(projection->deny[1], name))
+	{
+		return SWITCH_FALSE;
+	}
+	return SWITCH_TRUE;
+}
+
+static switch_bool_t mod_nats_projection_list_equal(const mod_nats_name_list_t *a, const mod_nats_name_list_t *b)
+{
+	if (!a || !b)
+	{
+		return a == b;
+	}
+	return !strcmp(a->spec, b->spec);
+}
+
+/* Whether two projections, possibly of different profiles, let the same headers through */
+switch_bool_t mod_nats_projection_equal(const mod_nats_projection_t *a, const mod_nats_projection_t *b)
+{
+	if (!a || !b)
+	{
+		return a == b;
+	}
+	return mod_nats_projection_list_equal(a->allow, b->allow) && mod_nats_projection_list_equal(a->deny[0], b->deny[0]) &&
+		   mod_nats_projection_list_equal(a->deny[1], b->deny[1]);
+}
+
+switch_status_t mod_nats_projection_load(mod_nats_publisher_profile_t *profile, switch_xml_t cfg)
+{
+	mod_nats_name_list_t *allow[SWITCH_EVENT_ALL + 1] = {0};
+	mod_nats_name_list_t *deny[SWITCH_EVENT_ALL + 1] = {0};
+	switch_xml_t xprojection;
+	int i;
+
+	for (xprojection = switch_xml_child(cfg, "projection"); xprojection; xprojection = xprojection->next)
+	{
+		char *events = switch_core_strdup(profile->pool, switch_xml_attr_soft(xprojection, "event"));
+		mod_nats_name_list_t *xallow = mod_nats_projection_list_create(profile, switch_xml_attr_soft(xprojection, "allow"));
+		mod_nats_name_list_t *xdeny = mod_nats_projection_list_create(profile, switch_xml_attr_soft(xprojection, "deny"));
+		char *argv[SWITCH_EVENT_ALL];
+		int argc;
+
+		if (zstr(events))
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] projection missing 'event' attribute\n", profile->name);
+			return SWITCH_STATUS_FALSE;
+		}
+		argc = switch_separate_string(events, ',', argv, (sizeof(argv) / sizeof(argv[0])));
+		for (i = 0; i < argc; i++)
+		{
+			switch_event_types_t type;
+
+			/* SWITCH_EVENT_ALL is used as the wildcard slot */
+			if (!strcmp(argv[i], "*"))
+			{
+				type = SWITCH_EVENT_ALL;
+			}
+			else if (switch_name_event(argv[i], &type) != SWITCH_STATUS_SUCCESS)
+			{
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] projection event [%s] was not recognised\n", profile->name, argv[i]);
+				return SWITCH_STATUS_FALSE;
+			}
+			if (xallow)
+			{
+				allow[type] = xallow;
+			}
+			if (xdeny)
+			{
+				deny[type] = xdeny;
+			}
+		}
+	}
+
+	for (i = 0; i < SWITCH_EVENT_ALL; i++)
+	{
+		mod_nats_projection_t *projection;
+
+		if (!allow[i] && !deny[i] && !allow[SWITCH_EVENT_ALL] && !deny[SWITCH_EVENT_ALL])
+		{
+			continue;
+		}
+		projection = switch_core_alloc(profile->pool, sizeof(mod_nats_projection_t));
+		projection->allow = allow[i] ? allow[i] : allow[SWITCH_EVENT_ALL];
+		projection->deny[0] = deny[i];
+		projection->deny[1] = deny[SWITCH_EVENT_ALL];
+		profile->projections[i] = projection;
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+void mod_nats_projection_destroy(mod_nats_publisher_profile_t *profile)
+{
+	mod_nats_name_list_t *list;
+
+	for (list = profile->projection_lists; list; list = list->next)
+	{
+		switch_core_hash_destroy(&list->names);
+	}
+	profile->projection_lists = NULL;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
@@ -38,57 +38,198 @@
 
 #include "mod_nats.h"
 
-void mod_nats_publisher_event_handler(switch_event_t *evt)
+static void mod_nats_publisher_jetstream_init(mod_nats_publisher_profile_t *profile, mod_nats_link_t *link);
+static void mod_nats_publisher_jetstream_complete(mod_nats_publisher_profile_t *profile, mod_nats_link_t *link, mod_nats_publisher_profile_t *next);
+static void mod_nats_publisher_jetstream_detach(mod_nats_publisher_profile_t *profile);
+
+/* Write a message to the spill log, it is released whether it could be written or not */
+static switch_status_t mod_nats_publisher_spill(mod_nats_publisher_profile_t *profile, mod_nats_message_t **message)
 {
-	mod_nats_message_t *message;
-	mod_nats_publisher_profile_t *profile = (mod_nats_publisher_profile_t *)evt->bind_user_data;
-	switch_time_t now = switch_time_now();
-	switch_time_t reset_time;
+	switch_status_t status;
 
-	if (!profile)
+	if (mod_nats_util_msg_serialize(message) != SWITCH_STATUS_SUCCESS)
 	{
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Event without a profile %p %p\n", (void *)evt, (void *)evt->event_user_data);
-		return;
+		mod_nats_util_msg_destroy(message);
+		return SWITCH_STATUS_FALSE;
 	}
+	status = mod_nats_spill_append(profile->spill, *message);
+	mod_nats_util_msg_destroy(message);
+	return status;
+}
 
+/* Dropped events are reported at most once per second, by whichever event thread gets there first */
+static switch_bool_t mod_nats_publisher_drop_report(mod_nats_publisher_profile_t *profile, switch_time_t now)
+{
+	switch_time_t logged = __atomic_load_n(&profile->drop_logged, __ATOMIC_RELAXED);
+
+	return now - logged >= 1000000 && __atomic_compare_exchange_n(&profile->drop_logged, &logged, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Whether the profile takes the event at all, checked before anything is serialized */
+switch_bool_t mod_nats_publisher_admit(mod_nats_publisher_profile_t *profile, switch_event_t *evt, switch_time_t now)
+{
 	/* If the mod is disabled ignore the event */
 	if (!profile->running)
 	{
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "profile [%s] not running\n", profile->name);
-		return;
+		return SWITCH_FALSE;
+	}
+
+	/* Shed floods of an event type before paying for its serialization */
+	if (profile->rate_limits[evt->event_id] && !mod_nats_ratelimit_allow(profile, evt, now))
+	{
+		return SWITCH_FALSE;
+	}
+
+	/* Degrade gradually while the queues are backing up */
+	return mod_nats_backpressure_admit(profile, evt, now);
+}
+
+/* Queue an admitted event. message is the payload already serialized for this profile and shared
+ * with others (see mod_nats_dispatch.c), its reference now belongs to the profile. Without one the
+ * profile serializes the event itself.
+ */
+void mod_nats_publisher_enqueue(mod_nats_publisher_profile_t *profile, switch_event_t *evt, mod_nats_message_t *message, switch_time_t now)
+{
+	mod_nats_publisher_worker_t *worker;
+	mod_nats_projection_t *projection;
+	const char *uuid;
+	uint16_t shard;
+
+	/* Events of the same call always go to the same worker so they are published in order,
+	 * events without a channel are spread round robin across the workers.
+	 */
+	if ((uuid = switch_event_get_header(evt, "Unique-ID")))
+	{
+		shard = mod_nats_util_shard(uuid);
+	}
+	else
+	{
+		shard = (uint16_t)__atomic_fetch_add(&profile->worker_next, 1, __ATOMIC_RELAXED);
+	}
+	worker = &profile->workers[shard % profile->worker_count];
+
+	/* A shared message is already serialized for all the profiles with its encoding and projection */
+	projection = profile->projections[evt->event_id];
+	if (!message && profile->serialize_in_worker)
+	{
+		/* Keep the dispatch thread short, the worker builds the JSON from a projected duplicate */
+		message = mod_nats_util_msg_create(worker->slab, 0);
+		message->encoding = profile->encoding;
+		message->event_id = evt->event_id;
+		message->shard = shard;
+		message->enqueued = now;
+		if (mod_nats_util_event_dup(&message->event, evt, projection) != SWITCH_STATUS_SUCCESS)
+		{
+			/* Without its event the worker would publish an empty payload */
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] failed to duplicate event [%s]\n", profile->name, switch_event_name(evt->event_id));
+			NATS_STAT_INC(worker->stats.serialize_errors);
+			mod_nats_util_msg_destroy(&message);
+			return;
+		}
+	}
+	else if (!message)
+	{
+		message = mod_nats_util_msg_create(worker->slab, mod_nats_encode_size(evt, profile->encoding, projection));
+		message->encoding = profile->encoding;
+		if (mod_nats_encode(&message, evt, projection) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] failed to serialize event [%s]\n", profile->name, switch_event_name(evt->event_id));
+			NATS_STAT_INC(worker->stats.serialize_errors);
+			mod_nats_util_msg_destroy(&message);
+			return;
+		}
+		message->event_id = evt->event_id;
+		message->shard = shard;
+		message->enqueued = now;
 	}
 
-	/* If the circuit breaker is active, ignore the event */
-	reset_time = profile->circuit_breaker_reset_time;
-	if (now < reset_time)
+	/* While older events wait in the spill log new ones go there too, so they stay in order */
+	if (profile->spill && (mod_nats_spill_active(profile->spill) || __atomic_load_n(&profile->spill_drain, __ATOMIC_ACQUIRE)) &&
+		mod_nats_publisher_spill(profile, &message) == SWITCH_STATUS_SUCCESS)
 	{
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "profile [%s] circuit breaker hit [%d] (%d)\n", profile->name, (int)now, (int)reset_time);
+		NATS_STAT_INC(worker->stats.spilled);
 		return;
 	}
 
-	switch_malloc(message, sizeof(mod_nats_message_t));
-	message->evname = strdup(switch_event_name(evt->event_id));
-	switch_event_serialize_json(evt, &message->pjson);
+	/* The message held by an open conflation window of the call goes out before the new one */
+	if (message && uuid && profile->conflate_enabled)
+	{
+		mod_nats_message_t *held = mod_nats_conflate_take(worker, uuid, profile->conflate[evt->event_id] ? evt->event_id : SWITCH_EVENT_ALL);
+
+		if (held && mod_nats_lane_push(worker, held, SWITCH_TRUE) != SWITCH_STATUS_SUCCESS)
+		{
+			NATS_STAT_INC(profile->dropped);
+			mod_nats_util_msg_destroy(&held);
+		}
+	}
+
+	/* Bursty per-call events are held and replaced by the later ones of their window */
+	if (message && uuid && profile->conflate[evt->event_id])
+	{
+		mod_nats_conflate_push(worker, uuid, &message, now);
+		NATS_STAT_INC(worker->stats.enqueued);
+		return;
+	}
 
-	/* Queue the message to be sent by the worker thread, errors are reported only once per circuit breaker interval */
-	if (switch_queue_trypush(profile->send_queue, message) != SWITCH_STATUS_SUCCESS)
+	/* Queue the message to be sent by the worker thread, errors are reported at most once per second */
+	if (message && mod_nats_lane_push(worker, message, SWITCH_TRUE) != SWITCH_STATUS_SUCCESS)
 	{
-		unsigned int queue_size = switch_queue_size(profile->send_queue);
-		/* Trip the circuit breaker for a short period to stop recurring error messages (time is measured in uS) */
-		profile->circuit_breaker_reset_time = now + profile->circuit_breaker_ms * 1000;
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "NATS message queue full. Messages will be dropped for %.1fs! (Queue capacity %d)",
-						  profile->circuit_breaker_ms / 1000.0, queue_size);
+		unsigned int queue_size = mod_nats_lane_size(worker);
+
+		if (profile->spill && mod_nats_publisher_spill(profile, &message) == SWITCH_STATUS_SUCCESS)
+		{
+			NATS_STAT_INC(worker->stats.spilled);
+			return;
+		}
+		NATS_STAT_INC(profile->dropped);
+		if (mod_nats_publisher_drop_report(profile, now))
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] NATS message queue full, %lu messages dropped so far (Queue size %u)\n",
+							  profile->name, (unsigned long)NATS_STAT_GET(profile->dropped), queue_size);
+		}
 		mod_nats_util_msg_destroy(&message);
 	}
+	else if (!message)
+	{
+		/* The spill log is out of disk budget */
+		NATS_STAT_INC(profile->dropped);
+		if (mod_nats_publisher_drop_report(profile, now))
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] NATS spill log full, %lu messages dropped so far\n",
+							  profile->name, (unsigned long)NATS_STAT_GET(profile->dropped));
+		}
+	}
+	else
+	{
+		NATS_STAT_INC(worker->stats.enqueued);
+	}
+}
+
+/* Handler for the events of a single profile, taken from bind_user_data */
+void mod_nats_publisher_event_handler(switch_event_t *evt)
+{
+	mod_nats_publisher_profile_t *profile = (mod_nats_publisher_profile_t *)evt->bind_user_data;
+	switch_time_t now = switch_time_now();
+
+	if (!profile)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Event without a profile %p %p\n", (void *)evt, (void *)evt->event_user_data);
+		return;
+	}
+	if (mod_nats_publisher_admit(profile, evt, now))
+	{
+		mod_nats_publisher_enqueue(profile, evt, NULL, now);
+	}
 }
 
 switch_status_t mod_nats_publisher_destroy(mod_nats_publisher_profile_t **prof)
 {
-	mod_nats_message_t *msg = NULL;
 	switch_status_t status = SWITCH_STATUS_SUCCESS;
 	mod_nats_connection_t *conn = NULL, *conn_next = NULL;
 	switch_memory_pool_t *pool;
 	mod_nats_publisher_profile_t *profile;
+	int i = 0;
 
 	if (!prof || !*prof)
 	{
@@ -96,33 +237,105 @@ switch_status_t mod_nats_publisher_destroy(mod_nats_publisher_profile_t **prof)
 	}
 	profile = *prof;
 	pool = profile->pool;
+	if (profile->rwlock)
+	{
+		/* The caller took the profile out of publisher_hash, wait for the requests still using it */
+		switch_thread_rwlock_wrlock(profile->rwlock);
+		switch_thread_rwlock_unlock(profile->rwlock);
+	}
+	mod_nats_dispatch_remove(profile);
+	mod_nats_xml_destroy(profile);
+	/* The caller took the profile out of publisher_hash already */
 	if (profile->name)
 	{
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "shutting down profile [%s]\n", profile->name);
-		switch_core_hash_delete(mod_nats_globals.publisher_hash, profile->name);
 	}
 	profile->running = 0;
-	if (profile->publisher_thread)
+	for (i = 0; profile->workers && i < profile->worker_count; i++)
+	{
+		mod_nats_lane_wake(&profile->workers[i]);
+		if (profile->workers[i].thread)
+		{
+			switch_thread_join(&status, profile->workers[i].thread);
+		}
+	}
+	if (profile->spill_thread)
+	{
+		switch_thread_join(&status, profile->spill_thread);
+	}
+	mod_nats_command_stop(profile);
+	for (i = 0; profile->workers && i < profile->worker_count; i++)
+	{
+		mod_nats_compress_worker_destroy(&profile->workers[i]);
+		mod_nats_conflate_worker_destroy(&profile->workers[i]);
+	}
+	mod_nats_compress_shutdown(profile);
+	for (i = 0; profile->links && i < profile->link_count; i++)
 	{
-		switch_thread_join(&status, profile->publisher_thread);
+		if (profile->links[i].js)
+		{
+			/* Give the outstanding publishes a bounded amount of time to be acknowledged */
+			mod_nats_publisher_jetstream_complete(profile, &profile->links[i], NULL);
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "destroyed NATS stream in profile [%s]\n", profile->name);
+		}
 	}
-	if (profile->js)
+	mod_nats_publisher_jetstream_detach(profile);
+	if (profile->jetstream_enabled)
 	{
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "destroyed NATS stream in profile [%s]\n", profile->name);
-		jsCtx_Destroy(profile->js);
+		natsMsg *retry = NULL;
+
+		while (profile->jetstream_retry_queue && mod_nats_ring_trypop(profile->jetstream_retry_queue, (void **)&retry) == SWITCH_STATUS_SUCCESS)
+		{
+			natsMsg_Destroy(retry);
+			profile->jetstream_failed++;
+		}
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "profile [%s] JetStream published %lu stored %lu failed %lu retried %lu\n",
+						  profile->name, (unsigned long)profile->jetstream_published, (unsigned long)profile->jetstream_stored,
+						  (unsigned long)profile->jetstream_failed, (unsigned long)profile->jetstream_retried);
 	}
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "closing NATS connection in profile [%s]\n", profile->name);
-	for (conn = profile->conn_root; conn; conn = conn_next)
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "closing NATS connections in profile [%s]\n", profile->name);
+	for (i = 0; profile->links && i < profile->link_count; i++)
 	{
-		conn_next = conn->next;
-		mod_nats_connection_destroy(&conn);
+		for (conn = profile->links[i].conn_root; conn; conn = conn_next)
+		{
+			conn_next = conn->next;
+			mod_nats_connection_destroy(&conn);
+		}
+		profile->links[i].conn_active = NULL;
+		profile->links[i].conn_root = NULL;
 	}
-	profile->conn_active = NULL;
-	profile->conn_root = NULL;
-	while (profile->send_queue && switch_queue_trypop(profile->send_queue, (void **)&msg) == SWITCH_STATUS_SUCCESS)
+	for (i = 0; profile->workers && i < profile->worker_count; i++)
 	{
-		mod_nats_util_msg_destroy(&msg);
+		mod_nats_message_t *msg = NULL;
+
+		while (profile->workers[i].handover && mod_nats_ring_trypop(profile->workers[i].handover, (void **)&msg) == SWITCH_STATUS_SUCCESS)
+		{
+			mod_nats_util_msg_destroy(&msg);
+		}
+		mod_nats_lane_worker_destroy(&profile->workers[i]);
+	}
+	for (i = 0; profile->workers && i < profile->worker_count; i++)
+	{
+		mod_nats_util_slab_destroy(profile->workers[i].slab);
+	}
+	if (profile->spill)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "profile [%s] spilled %lu replayed %lu dropped %lu\n", profile->name,
+						  (unsigned long)profile->spill->spilled, (unsigned long)profile->spill->replayed, (unsigned long)profile->spill->dropped);
+		mod_nats_spill_destroy(&profile->spill);
+	}
+	if (profile->spill_drain)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile [%s] did not finish replaying the spill log in [%s], it is replayed once spill_dir points there again\n",
+						  profile->name, profile->spill_drain->dir);
+		mod_nats_spill_destroy(&profile->spill_drain);
+	}
+	mod_nats_projection_destroy(profile);
+	mod_nats_command_destroy(profile);
+	if (profile->subclasses)
+	{
+		switch_core_hash_destroy(&profile->subclasses);
 	}
 	if (pool)
 	{
@@ -132,18 +345,243 @@ switch_status_t mod_nats_publisher_destroy(mod_nats_publisher_profile_t **prof)
 	return SWITCH_STATUS_SUCCESS;
 }
 
-switch_status_t mod_nats_publisher_create(char *name, switch_xml_t cfg)
+/* Threads of a profile being created run once mod_nats_publisher_create is done with it */
+void mod_nats_publisher_wait_start(mod_nats_publisher_profile_t *profile)
+{
+	switch_mutex_lock(profile->start_mutex);
+	switch_mutex_unlock(profile->start_mutex);
+}
+
+/* Move the messages the stopped workers of a replaced profile still hold, oldest first, to the
+ * handover rings of the workers taking over. Each message goes to the worker its shard maps to
+ * now, where the new events of its call go too, so a call keeps its order whatever the number of
+ * workers. They no longer belong to the slab of the old worker. Returns how many were moved.
+ */
+static unsigned int mod_nats_publisher_handover_workers(mod_nats_publisher_profile_t *old, mod_nats_publisher_profile_t *profile)
+{
+	mod_nats_message_t **msgs;
+	unsigned int *counts;
+	unsigned int count = 0, size = NATS_RING_BATCH, moved = 0, i, got;
+	int w;
+
+	for (w = 0; w < old->worker_count; w++)
+	{
+		size += old->workers[w].held + mod_nats_lane_size(&old->workers[w]) + (old->workers[w].handover ? mod_nats_ring_size(old->workers[w].handover) : 0);
+	}
+	switch_malloc(msgs, sizeof(mod_nats_message_t *) * size);
+	for (w = 0; w < old->worker_count; w++)
+	{
+		mod_nats_publisher_worker_t *old_worker = &old->workers[w];
+
+		if (count + old_worker->held > size)
+		{
+			size = count + old_worker->held + NATS_RING_BATCH;
+			msgs = realloc(msgs, sizeof(mod_nats_message_t *) * size);
+			switch_assert(msgs);
+		}
+		memcpy(msgs + count, old_worker->batch, sizeof(mod_nats_message_t *) * old_worker->held);
+		count += old_worker->held;
+		old_worker->held = 0;
+		/* What an earlier reload handed over to this worker is older than its own queue */
+		do
+		{
+			if (count + NATS_RING_BATCH > size)
+			{
+				size *= 2;
+				msgs = realloc(msgs, sizeof(mod_nats_message_t *) * size);
+				switch_assert(msgs);
+			}
+			if (old_worker->handover && (got = mod_nats_ring_pop_batch(old_worker->handover, (void **)(msgs + count), NATS_RING_BATCH)))
+			{
+				count += got;
+				continue;
+			}
+			got = old_worker->conflate_hash ? mod_nats_conflate_expire(old_worker, msgs + count, NATS_RING_BATCH, INT64_MAX) : 0;
+			got += mod_nats_lane_pop_batch(old_worker, msgs + count + got, NATS_RING_BATCH - got);
+			count += got;
+		} while (got);
+		old_worker->handover = NULL;
+	}
+
+	switch_zmalloc(counts, sizeof(unsigned int) * profile->worker_count);
+	for (i = 0; i < count; i++)
+	{
+		counts[msgs[i]->shard % profile->worker_count]++;
+	}
+	for (w = 0; w < profile->worker_count; w++)
+	{
+		if (counts[w] && mod_nats_ring_create(&profile->workers[w].handover, counts[w], profile->pool) != SWITCH_STATUS_SUCCESS)
+		{
+			profile->workers[w].handover = NULL;
+		}
+	}
+	for (i = 0; i < count; i++)
+	{
+		mod_nats_publisher_worker_t *worker = &profile->workers[msgs[i]->shard % profile->worker_count];
+
+		msgs[i]->slab = NULL;
+		msgs[i]->size_class = -1;
+		if (worker->handover && mod_nats_ring_trypush(worker->handover, msgs[i]) == SWITCH_STATUS_SUCCESS)
+		{
+			moved++;
+			continue;
+		}
+		mod_nats_util_msg_destroy(&msgs[i]);
+	}
+	free(counts);
+	free(msgs);
+	return moved;
+}
+
+/* Replace old by a profile that is built but not started yet. Events go to the new profile from
+ * here on, the old one stops its threads, and whatever it still holds is published first by the
+ * new workers. Open connections that did not change are taken over instead of reconnecting.
+ */
+static switch_status_t mod_nats_publisher_handover(mod_nats_publisher_profile_t *old, mod_nats_publisher_profile_t *profile)
+{
+	mod_nats_connection_t *conn, *old_conn;
+	natsMsg *retry = NULL;
+	switch_status_t status;
+	unsigned int moved = 0;
+	int i, kept = 0;
+
+	if (mod_nats_dispatch_replace(old, profile) != SWITCH_STATUS_SUCCESS)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] cannot subscribe to its events, keeping the running profile\n", profile->name);
+		return SWITCH_STATUS_GENERR;
+	}
+
+	old->retiring = SWITCH_TRUE;
+	for (i = 0; i < old->worker_count; i++)
+	{
+		mod_nats_lane_wake(&old->workers[i]);
+		if (old->workers[i].thread)
+		{
+			switch_thread_join(&status, old->workers[i].thread);
+			old->workers[i].thread = NULL;
+		}
+	}
+	if (old->spill_thread)
+	{
+		switch_thread_join(&status, old->spill_thread);
+		old->spill_thread = NULL;
+	}
+	/* The spill log of an unchanged spill_dir was shared from the start, it is the new profile's now */
+	if (old->spill == profile->spill)
+	{
+		old->spill = NULL;
+	}
+	/* The one of a spill_dir that changed is replayed ahead of it */
+	if (old->spill_drain)
+	{
+		profile->spill_drain = old->spill_drain;
+		old->spill_drain = NULL;
+	}
+	if (old->spill && !profile->spill_drain)
+	{
+		profile->spill_drain = old->spill;
+		old->spill = NULL;
+	}
+	else if (old->spill && mod_nats_spill_active(old->spill))
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] spill log in [%s] is left on disk, it is replayed once spill_dir points there again\n",
+						  profile->name, old->spill->dir);
+	}
+	/* In-flight commands still reply on the old connection, the queued ones move over */
+	mod_nats_command_stop(old);
+	mod_nats_command_handover(old, profile);
+
+	moved = mod_nats_publisher_handover_workers(old, profile);
+
+	/* Links are matched by position, a link beyond the old connection_count opens its own */
+	for (i = 0; i < profile->link_count && i < old->link_count; i++)
+	{
+		mod_nats_link_t *link = &profile->links[i], *old_link = &old->links[i];
+
+		for (conn = link->conn_root; conn; conn = conn->next)
+		{
+			for (old_conn = old_link->conn_root; old_conn; old_conn = old_conn->next)
+			{
+				if (old_conn->connection && mod_nats_connection_equal(conn, old_conn))
+				{
+					conn->connection = old_conn->connection;
+					conn->health = old_conn->health;
+					conn->connects = old_conn->connects;
+					conn->connect_failures = old_conn->connect_failures;
+					old_conn->connection = NULL;
+					old_conn->health = NULL;
+					if (old_link->conn_active == old_conn)
+					{
+						link->conn_active = conn;
+					}
+					break;
+				}
+			}
+		}
+		if (link->conn_active)
+		{
+			switch_thread_rwlock_wrlock(link->conn_rwlock);
+			if (profile->jetstream_enabled)
+			{
+				mod_nats_publisher_jetstream_init(profile, link);
+			}
+			if (!link->id)
+			{
+				mod_nats_command_subscribe(profile);
+			}
+			switch_thread_rwlock_unlock(link->conn_rwlock);
+			kept++;
+		}
+	}
+	/* The old contexts settle first, the publishes failing meanwhile land in the old retry queue */
+	for (i = 0; i < old->link_count; i++)
+	{
+		if (old->links[i].js)
+		{
+			mod_nats_publisher_jetstream_complete(old, &old->links[i], profile);
+		}
+	}
+	mod_nats_publisher_jetstream_detach(old);
+	while (profile->jetstream_retry_queue && old->jetstream_retry_queue &&
+		   mod_nats_ring_trypop(old->jetstream_retry_queue, (void **)&retry) == SWITCH_STATUS_SUCCESS)
+	{
+		if (mod_nats_ring_trypush(profile->jetstream_retry_queue, retry) != SWITCH_STATUS_SUCCESS)
+		{
+			natsMsg_Destroy(retry);
+			old->jetstream_failed++;
+		}
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Profile[%s] reloaded, %u queued messages and %d of %d connections kept\n", profile->name, moved,
+					  kept, profile->link_count);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Create a profile and start it, replacing the running profile of the same name if given. A
+ * detached profile (nats bench) is returned there instead: it is neither in publisher_hash nor
+ * dispatched events, and leaves the command channel, XML lookups and spill log to the real one.
+ */
+switch_status_t mod_nats_publisher_create(char *name, switch_xml_t cfg, mod_nats_publisher_profile_t *replaces, mod_nats_publisher_profile_t **detached)
 {
 	mod_nats_publisher_profile_t *profile = NULL;
 	int arg = 0, i = 0;
 	char *argv[SWITCH_EVENT_ALL];
-	switch_xml_t params, param, connections, connection;
+	switch_xml_t params, param, connections, connection, projections, rate_limits, lanes;
 	switch_threadattr_t *thd_attr = NULL;
 	char *subject = NULL;
 	char *jetstream_name = NULL;
+	char *spill_dir = NULL;
+	char *compression_dictionary = NULL;
+	char *conflate_events = NULL;
+	char *priority_events = NULL;
+	char *command_allow = NULL;
+	char *xml_sections = NULL;
+	char *xml_cache_key = NULL;
+	int spill_max_mb = 1024, spill_segment_mb = 16;
 	switch_bool_t jetstream_enabled = SWITCH_FALSE;
-	char *jetstream_subject = NULL;
+	switch_bool_t inserted = SWITCH_FALSE;
 	switch_memory_pool_t *pool;
+	char *tmp_xml;
 
 	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS)
 	{
@@ -153,15 +591,37 @@ switch_status_t mod_nats_publisher_create(char *name, switch_xml_t cfg)
 	profile = switch_core_alloc(pool, sizeof(mod_nats_publisher_profile_t));
 	profile->pool = pool;
 	profile->name = switch_core_strdup(profile->pool, name);
+	switch_thread_rwlock_create(&profile->rwlock, profile->pool);
+	if ((tmp_xml = switch_xml_toxml(cfg, SWITCH_FALSE)))
+	{
+		profile->config_xml = switch_core_strdup(profile->pool, tmp_xml);
+		free(tmp_xml);
+	}
 	profile->running = 1;
-	profile->event_ids[0] = SWITCH_EVENT_ALL;
-	profile->conn_root = NULL;
-	profile->conn_active = NULL;
 	/* Set reasonable defaults which may change if more reasonable defaults are found */
 	/* Handle defaults of non string types */
-	profile->circuit_breaker_ms = 10000;
+	profile->backpressure_high_watermark = 80;
+	profile->backpressure_low_watermark = 50;
+	profile->backpressure_max_drain_ms = 200;
+	profile->backpressure_hold_ms = 1000;
+	profile->backpressure_sample_rate = 10;
 	profile->reconnect_interval_ms = 1000;
 	profile->send_queue_size = 5000;
+	profile->worker_count = 1;
+	profile->link_count = 1;
+	profile->batch_flush_timeout_ms = 1000;
+	profile->jetstream_max_pending = 4096;
+	profile->spill_replay_rate = 1000;
+	profile->compression_threshold = 512;
+	profile->jetstream_max_retries = 3;
+	profile->jetstream_complete_timeout_ms = 5000;
+	profile->conflate_window_ms = 100;
+	profile->command_workers = 2;
+	profile->command_queue_size = 256;
+	profile->xml_timeout_ms = 1000;
+	profile->xml_cache_ttl_ms = 5000;
+	profile->xml_negative_ttl_ms = 1000;
+	profile->xml_cache_size = 10000;
 
 	if ((params = switch_xml_child(cfg, "params")) != NULL)
 	{
@@ -192,367 +652,1261 @@ switch_status_t mod_nats_publisher_create(char *name, switch_xml_t cfg)
 			}
 			else if (!strncmp(var, "circuit_breaker_ms", 18))
 			{
-				int interval = atoi(val);
-				if (interval && interval > 0)
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] circuit_breaker_ms is obsolete, see the backpressure_* params\n", profile->name);
+			}
+			else if (!strncmp(var, "backpressure_high_watermark", 27))
+			{
+				int percent = atoi(val);
+				if (percent > 0 && percent <= 100)
 				{
-					profile->circuit_breaker_ms = interval;
+					profile->backpressure_high_watermark = percent;
 				}
 			}
-			else if (!strncmp(var, "send_queue_size", 15))
+			else if (!strncmp(var, "backpressure_low_watermark", 26))
+			{
+				int percent = atoi(val);
+				if (percent >= 0 && percent < 100)
+				{
+					profile->backpressure_low_watermark = percent;
+				}
+			}
+			else if (!strncmp(var, "backpressure_max_drain_ms", 25))
 			{
 				int interval = atoi(val);
-				if (interval && interval > 0)
+				if (interval >= 0)
 				{
-					profile->send_queue_size = interval;
+					profile->backpressure_max_drain_ms = interval;
 				}
 			}
-			else if (!strncmp(var, "subject", 7))
+			else if (!strncmp(var, "backpressure_hold_ms", 20))
 			{
-				subject = switch_core_strdup(profile->pool, val);
+				int interval = atoi(val);
+				if (interval >= 0)
+				{
+					profile->backpressure_hold_ms = interval;
+				}
 			}
-			else if (!strncmp(var, "jetstream_enabled", 17))
+			else if (!strncmp(var, "backpressure_sample_rate", 24))
 			{
-				jetstream_enabled = switch_true(val);
+				int rate = atoi(val);
+				if (rate && rate > 0)
+				{
+					profile->backpressure_sample_rate = rate;
+				}
 			}
-			else if (!strncmp(var, "jetstream_name", 14))
+			else if (!strncmp(var, "backpressure_priority_events", 28))
 			{
-				jetstream_name = switch_core_strdup(profile->pool, val);
+				priority_events = switch_core_strdup(profile->pool, val);
 			}
-			else if (!strncmp(var, "event_filter", 12))
+			else if (!strncmp(var, "send_queue_size", 15))
 			{
-				char *tmp = switch_core_strdup(profile->pool, val);
-				/* Parse new events */
-				profile->event_subscriptions = switch_separate_string(tmp, ',', argv, (sizeof(argv) / sizeof(argv[0])));
-
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Found %d event subscriptions\n", profile->event_subscriptions);
-
-				for (arg = 0; arg < profile->event_subscriptions; arg++)
+				int interval = atoi(val);
+				if (interval && interval > 0)
 				{
-					if (switch_name_event(argv[arg], &(profile->event_ids[arg])) != SWITCH_STATUS_SUCCESS && !switch_strstr(argv[arg], "SWITCH_EVENT_CUSTOM::"))
-					{
-						switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "The switch event %s was not recognised.\n", argv[arg]);
-					}
+					profile->send_queue_size = interval;
 				}
 			}
-		} /* params for loop */
-	}
-
-	profile->subject = subject ? subject : switch_core_strdup(profile->pool, profile->name);
-	profile->jetstream_name = jetstream_name ? jetstream_name : switch_core_strdup(profile->pool, profile->name);
-	profile->jetstream_enabled = jetstream_enabled;
-	if (jetstream_enabled == SWITCH_TRUE)
-	{
-		jetstream_subject = strdup(profile->subject);
-		if (jetstream_subject != NULL)
-		{
-			size_t size = strlen(jetstream_subject);
-			if (size >= 2 &&
-				jetstream_subject[size - 2] == '.' &&
-				jetstream_subject[size - 1] == '*')
+			else if (!strncmp(var, "publisher_workers", 17))
 			{
-				char jetstream_subject_trimmed[1024];
-				switch_snprintf(jetstream_subject_trimmed, sizeof(jetstream_subject) - 2, "%s", jetstream_subject);
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile [%s] trimmed subject [%s]\n", profile->name, jetstream_subject_trimmed);
-				profile->jetstream_subject = switch_core_strdup(profile->pool, jetstream_subject_trimmed);
+				int workers = atoi(val);
+				if (workers > 0 && workers <= NATS_MAX_WORKERS)
+				{
+					profile->worker_count = workers;
+				}
+				else
+				{
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] publisher_workers must be between 1 and %d\n", profile->name, NATS_MAX_WORKERS);
+				}
 			}
-			else
+			else if (!strncmp(var, "connection_count", 16))
 			{
-				profile->jetstream_subject = switch_core_strdup(profile->pool, jetstream_subject);
-			}
-		}
-		else
-		{
-			profile->jetstream_subject = switch_core_strdup(profile->pool, jetstream_subject);
-		}
-		switch_safe_free(jetstream_subject);
-	}
-
-	if ((connections = switch_xml_child(cfg, "connections")) != NULL)
-	{
-		for (connection = switch_xml_child(connections, "connection"); connection; connection = connection->next)
-		{
-			if (!profile->conn_root)
-			{ /* Handle first root node */
-				if (mod_nats_connection_create(&(profile->conn_root), connection, profile->pool) != SWITCH_STATUS_SUCCESS)
+				int count = atoi(val);
+				if (count > 0 && count <= NATS_MAX_LINKS)
 				{
-					/* Handle connection create failure */
-					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile [%s] failed to create connection\n", profile->name);
-					continue;
+					profile->link_count = count;
+				}
+				else
+				{
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] connection_count must be between 1 and %d\n", profile->name, NATS_MAX_LINKS);
 				}
-				profile->conn_active = profile->conn_root;
 			}
-			else
+			else if (!strncmp(var, "batch_size", 10))
 			{
-				if (mod_nats_connection_create(&(profile->conn_active->next), connection, profile->pool) != SWITCH_STATUS_SUCCESS)
+				int size = atoi(val);
+				if (size >= 0 && size <= NATS_MAX_BATCH)
 				{
-					/* Handle connection create failure */
+					profile->batch_size = size;
+				}
+				else
+				{
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] batch_size must be between 0 and %d\n", profile->name, NATS_MAX_BATCH);
+				}
+			}
+			else if (!strncmp(var, "batch_linger_ms", 15))
+			{
+				int interval = atoi(val);
+				if (interval >= 0)
+				{
+					profile->batch_linger_ms = interval;
+				}
+			}
+			else if (!strncmp(var, "batch_flush_timeout_ms", 22))
+			{
+				int interval = atoi(val);
+				if (interval && interval > 0)
+				{
+					profile->batch_flush_timeout_ms = interval;
+				}
+			}
+			else if (!strncmp(var, "encoding", 8))
+			{
+				if (mod_nats_encoding_parse(val, &profile->encoding) != SWITCH_STATUS_SUCCESS)
+				{
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] unknown encoding [%s], using json\n", profile->name, val);
+				}
+			}
+			else if (!strncmp(var, "compression_threshold", 21))
+			{
+				int size = atoi(val);
+				if (size >= 0)
+				{
+					profile->compression_threshold = size;
+				}
+			}
+			else if (!strncmp(var, "compression_level", 17))
+			{
+				profile->compression_level = atoi(val);
+			}
+			else if (!strncmp(var, "compression_dictionary", 22))
+			{
+				compression_dictionary = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "compression", 11))
+			{
+				if (mod_nats_compression_parse(val, &profile->compression) != SWITCH_STATUS_SUCCESS)
+				{
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] compression [%s] unknown or not built in, payloads are not compressed\n", profile->name, val);
+				}
+			}
+			else if (!strncmp(var, "conflate_events", 15))
+			{
+				conflate_events = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "conflate_window_ms", 18))
+			{
+				int interval = atoi(val);
+				if (interval && interval > 0)
+				{
+					profile->conflate_window_ms = interval;
+				}
+			}
+			else if (!strncmp(var, "command_subject", 15))
+			{
+				profile->command_subject = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "command_queue_group", 19))
+			{
+				profile->command_queue_group = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "command_queue_size", 18))
+			{
+				int size = atoi(val);
+				if (size && size > 0)
+				{
+					profile->command_queue_size = size;
+				}
+			}
+			else if (!strncmp(var, "command_workers", 15))
+			{
+				int workers = atoi(val);
+				if (workers > 0 && workers <= NATS_MAX_COMMAND_WORKERS)
+				{
+					profile->command_workers = workers;
+				}
+				else
+				{
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] command_workers must be between 1 and %d\n", profile->name, NATS_MAX_COMMAND_WORKERS);
+				}
+			}
+			else if (!strncmp(var, "command_allow", 13))
+			{
+				command_allow = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "xml_subject", 11))
+			{
+				profile->xml_subject = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "xml_sections", 12))
+			{
+				xml_sections = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "xml_timeout_ms", 14))
+			{
+				int interval = atoi(val);
+				if (interval && interval > 0)
+				{
+					profile->xml_timeout_ms = interval;
+				}
+			}
+			else if (!strncmp(var, "xml_cache_ttl_ms", 16))
+			{
+				int interval = atoi(val);
+				if (interval >= 0)
+				{
+					profile->xml_cache_ttl_ms = interval;
+				}
+			}
+			else if (!strncmp(var, "xml_negative_ttl_ms", 19))
+			{
+				int interval = atoi(val);
+				if (interval >= 0)
+				{
+					profile->xml_negative_ttl_ms = interval;
+				}
+			}
+			else if (!strncmp(var, "xml_cache_size", 14))
+			{
+				int size = atoi(val);
+				if (size > 0 && size < NATS_XML_SHARDS)
+				{
+					/* Every shard of the cache needs room for an entry */
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] xml_cache_size must be 0 or at least %d, using %d\n", profile->name, NATS_XML_SHARDS, NATS_XML_SHARDS);
+					size = NATS_XML_SHARDS;
+				}
+				if (size >= 0)
+				{
+					profile->xml_cache_size = size;
+				}
+			}
+			else if (!strncmp(var, "xml_cache_key", 13))
+			{
+				xml_cache_key = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "serialize_in_worker", 19))
+			{
+				profile->serialize_in_worker = switch_true(val);
+			}
+			else if (!strncmp(var, "spill_dir", 9))
+			{
+				spill_dir = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "spill_max_mb", 12))
+			{
+				int size = atoi(val);
+				if (size && size > 0)
+				{
+					spill_max_mb = size;
+				}
+			}
+			else if (!strncmp(var, "spill_segment_mb", 16))
+			{
+				int size = atoi(val);
+				if (size && size > 0)
+				{
+					spill_segment_mb = size;
+				}
+			}
+			else if (!strncmp(var, "spill_replay_rate", 17))
+			{
+				int rate = atoi(val);
+				if (rate && rate > 0)
+				{
+					profile->spill_replay_rate = rate;
+				}
+			}
+			else if (!strncmp(var, "subject", 7))
+			{
+				subject = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "jetstream_enabled", 17))
+			{
+				jetstream_enabled = switch_true(val);
+			}
+			else if (!strncmp(var, "jetstream_max_pending", 21))
+			{
+				int pending = atoi(val);
+				if (pending && pending > 0)
+				{
+					profile->jetstream_max_pending = pending;
+				}
+			}
+			else if (!strncmp(var, "jetstream_max_retries", 21))
+			{
+				int retries = atoi(val);
+				if (retries >= 0)
+				{
+					profile->jetstream_max_retries = retries;
+				}
+			}
+			else if (!strncmp(var, "jetstream_complete_timeout_ms", 29))
+			{
+				int interval = atoi(val);
+				if (interval && interval > 0)
+				{
+					profile->jetstream_complete_timeout_ms = interval;
+				}
+			}
+			else if (!strncmp(var, "jetstream_name", 14))
+			{
+				jetstream_name = switch_core_strdup(profile->pool, val);
+			}
+			else if (!strncmp(var, "event_filter", 12))
+			{
+				char *tmp = switch_core_strdup(profile->pool, val);
+				/* Parse new events */
+				int argc = switch_separate_string(tmp, ',', argv, (sizeof(argv) / sizeof(argv[0])));
+
+				for (arg = 0; arg < argc; arg++)
+				{
+					switch_event_types_t type;
+
+					if (switch_strstr(argv[arg], "SWITCH_EVENT_CUSTOM::"))
+					{
+						if (!profile->subclasses)
+						{
+							switch_core_hash_init(&profile->subclasses);
+						}
+						if (!switch_core_hash_find(profile->subclasses, argv[arg] + strlen("SWITCH_EVENT_CUSTOM::")))
+						{
+							switch_core_hash_insert(profile->subclasses, argv[arg] + strlen("SWITCH_EVENT_CUSTOM::"), profile);
+							profile->event_subscriptions++;
+						}
+					}
+					else if (switch_name_event(argv[arg], &type) != SWITCH_STATUS_SUCCESS)
+					{
+						switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "The switch event %s was not recognised.\n", argv[arg]);
+					}
+					else if (type == SWITCH_EVENT_ALL)
+					{
+						/* Every type is bound on its own so the bindings stay shared with other profiles */
+						for (i = 0; i < SWITCH_EVENT_ALL; i++)
+						{
+							if (!profile->subscribed[i])
+							{
+								profile->subscribed[i] = SWITCH_TRUE;
+								profile->event_subscriptions++;
+							}
+						}
+					}
+					else if (!profile->subscribed[type])
+					{
+						profile->subscribed[type] = SWITCH_TRUE;
+						profile->event_subscriptions++;
+					}
+				}
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Found %d event subscriptions\n", profile->event_subscriptions);
+			}
+		} /* params for loop */
+	}
+
+	profile->subject = subject ? subject : switch_core_strdup(profile->pool, profile->name);
+	profile->jetstream_name = jetstream_name ? jetstream_name : switch_core_strdup(profile->pool, profile->name);
+	profile->jetstream_enabled = jetstream_enabled;
+	if (jetstream_enabled == SWITCH_TRUE)
+	{
+		size_t size = strlen(profile->subject);
+
+		profile->jetstream_subject = switch_core_strdup(profile->pool, profile->subject);
+		if (size >= 2 &&
+			profile->jetstream_subject[size - 2] == '.' &&
+			profile->jetstream_subject[size - 1] == '*')
+		{
+			profile->jetstream_subject[size - 2] = '\0';
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile [%s] trimmed subject [%s]\n", profile->name, profile->jetstream_subject);
+		}
+
+		/* Each event type is published on <subject>.<EVENT_NAME>. CUSTOM events all share the
+		 * CUSTOM subject so the table is indexed by event type only.
+		 */
+		for (i = 0; i < SWITCH_EVENT_ALL; i++)
+		{
+			profile->event_subjects[i] = switch_core_sprintf(profile->pool, "%s.%s", profile->jetstream_subject, switch_event_name(i));
+		}
+
+		if (mod_nats_ring_create(&profile->jetstream_retry_queue, profile->jetstream_max_pending, profile->pool) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create JetStream retry queue of size %d!\n", profile->jetstream_max_pending);
+			goto err;
+		}
+		profile->jetstream_ack = switch_core_alloc(profile->pool, sizeof(mod_nats_jetstream_ack_t));
+		switch_mutex_init(&profile->jetstream_ack->mutex, SWITCH_MUTEX_NESTED, profile->pool);
+		profile->jetstream_ack->profile = profile;
+	}
+
+	if (mod_nats_compress_init(profile, compression_dictionary) != SWITCH_STATUS_SUCCESS)
+	{
+		goto err;
+	}
+
+	if (!zstr(conflate_events))
+	{
+		if (mod_nats_conflate_load(profile, conflate_events) != SWITCH_STATUS_SUCCESS)
+		{
+			goto err;
+		}
+		profile->conflate_enabled = SWITCH_TRUE;
+	}
+
+	if ((projections = switch_xml_child(cfg, "projections")) != NULL &&
+		mod_nats_projection_load(profile, projections) != SWITCH_STATUS_SUCCESS)
+	{
+		goto err;
+	}
+
+	if ((lanes = switch_xml_child(cfg, "lanes")) != NULL)
+	{
+		if (mod_nats_lane_load(profile, lanes) != SWITCH_STATUS_SUCCESS)
+		{
+			goto err;
+		}
+	}
+	else
+	{
+		profile->lane_count = 1;
+		profile->lanes[0].name = "default";
+		profile->lanes[0].weight = 1;
+	}
+
+	if (mod_nats_backpressure_init(profile, priority_events) != SWITCH_STATUS_SUCCESS)
+	{
+		goto err;
+	}
+
+	if (detached)
+	{
+		profile->command_subject = NULL;
+		profile->xml_subject = NULL;
+		spill_dir = NULL;
+	}
+
+	if (!zstr(profile->command_subject) && mod_nats_command_init(profile, command_allow) != SWITCH_STATUS_SUCCESS)
+	{
+		goto err;
+	}
+
+	if ((rate_limits = switch_xml_child(cfg, "rate_limits")) != NULL &&
+		mod_nats_ratelimit_load(profile, rate_limits) != SWITCH_STATUS_SUCCESS)
+	{
+		goto err;
+	}
+
+	/* A connection without a worker to publish on it would only carry the command channel */
+	if (profile->link_count > profile->worker_count)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] connection_count lowered to the %d publisher_workers\n", profile->name,
+						  profile->worker_count);
+		profile->link_count = profile->worker_count;
+	}
+	profile->links = switch_core_alloc(profile->pool, sizeof(mod_nats_link_t) * profile->link_count);
+	connections = switch_xml_child(cfg, "connections");
+	for (i = 0; i < profile->link_count; i++)
+	{
+		mod_nats_link_t *link = &profile->links[i];
+
+		link->id = i;
+		for (connection = connections ? switch_xml_child(connections, "connection") : NULL; connection; connection = connection->next)
+		{
+			if (!link->conn_root)
+			{ /* Handle first root node */
+				if (mod_nats_connection_create(&(link->conn_root), connection, profile->pool) != SWITCH_STATUS_SUCCESS)
+				{
+					/* Handle connection create failure */
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile [%s] failed to create connection\n", profile->name);
+					continue;
+				}
+				link->conn_active = link->conn_root;
+			}
+			else
+			{
+				if (mod_nats_connection_create(&(link->conn_active->next), connection, profile->pool) != SWITCH_STATUS_SUCCESS)
+				{
+					/* Handle connection create failure */
 					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] failed to create connection\n", profile->name);
 					continue;
 				}
-				profile->conn_active = profile->conn_active->next;
+				link->conn_active = link->conn_active->next;
+			}
+		}
+		link->conn_active = NULL;
+		/* We are not going to open the publisher queue connection on create, but instead wait for the running thread to open it */
+		switch_thread_rwlock_create(&link->conn_rwlock, profile->pool);
+	}
+
+	/* Create a bounded FIFO queue per worker, send_queue_size is the capacity of the whole profile */
+	profile->workers = switch_core_alloc(profile->pool, sizeof(mod_nats_publisher_worker_t) * profile->worker_count);
+	for (i = 0; i < profile->worker_count; i++)
+	{
+		unsigned int queue_size = (profile->send_queue_size + profile->worker_count - 1) / profile->worker_count;
+
+		profile->workers[i].id = i;
+		profile->workers[i].profile = profile;
+		/* The events of a call stay on one worker, so on one connection too */
+		profile->workers[i].link = &profile->links[i % profile->link_count];
+		profile->workers[i].batch = switch_core_alloc(profile->pool, sizeof(mod_nats_message_t *) * (profile->batch_size ? profile->batch_size : NATS_RING_BATCH));
+		if (mod_nats_lane_worker_init(&profile->workers[i], queue_size, profile->pool) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create send queue of size %d!\n", queue_size);
+			goto err;
+		}
+		/* Recycle at most a queue worth of blocks per size class */
+		if (mod_nats_util_slab_create(&(profile->workers[i].slab), queue_size, profile->pool) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create message slab of worker %d!\n", i);
+			goto err;
+		}
+		if (profile->conflate_enabled && mod_nats_conflate_worker_init(&profile->workers[i], profile->pool) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create conflation table of worker %d!\n", i);
+			goto err;
+		}
+	}
+
+	/* Bound before the handover so the lookups keep being served, the old binding is found first until it goes */
+	if (!zstr(profile->xml_subject) &&
+		(mod_nats_xml_init(profile, xml_sections, xml_cache_key) != SWITCH_STATUS_SUCCESS || mod_nats_xml_bind(profile) != SWITCH_STATUS_SUCCESS))
+	{
+		goto err;
+	}
+
+	if (!zstr(spill_dir))
+	{
+		if (spill_segment_mb > spill_max_mb)
+		{
+			spill_segment_mb = spill_max_mb;
+		}
+		if (replaces && replaces->spill && !strcmp(replaces->spill->dir, spill_dir))
+		{
+			/* Shared until the handover, so new events keep queuing behind the ones on disk */
+			profile->spill = replaces->spill;
+			mod_nats_spill_limit(profile->spill, (size_t)spill_max_mb * 1024 * 1024);
+		}
+		else if (mod_nats_spill_create(&profile->spill, spill_dir, profile->name, (size_t)spill_segment_mb * 1024 * 1024,
+									   (size_t)spill_max_mb * 1024 * 1024) != SWITCH_STATUS_SUCCESS)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] cannot use spill directory [%s]\n", profile->name, spill_dir);
+			goto err;
+		}
+	}
+
+	/* Start the threads, they wait until the profile is ready. The first worker to run will set up the initial connection */
+	switch_mutex_init(&profile->start_mutex, SWITCH_MUTEX_NESTED, profile->pool);
+	switch_mutex_lock(profile->start_mutex);
+	switch_threadattr_create(&thd_attr, profile->pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+	for (i = 0; i < profile->worker_count; i++)
+	{
+		if (switch_thread_create(&profile->workers[i].thread, thd_attr, mod_nats_publisher_thread, &profile->workers[i], profile->pool))
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create 'nats event sender' thread %d!\n", i);
+			goto err;
+		}
+	}
+	if (profile->command_queue && mod_nats_command_start(profile, thd_attr) != SWITCH_STATUS_SUCCESS)
+	{
+		goto err;
+	}
+	if ((profile->spill || (replaces && (replaces->spill || replaces->spill_drain))) && switch_thread_create(&profile->spill_thread, thd_attr, mod_nats_publisher_spill_thread, profile, profile->pool))
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create 'nats spill replay' thread!\n");
+		goto err;
+	}
+
+	if (detached)
+	{
+		switch_mutex_unlock(profile->start_mutex);
+		*detached = profile;
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	/* Swapped in under the lock, the rest of the handover runs without it */
+	switch_thread_rwlock_wrlock(mod_nats_globals.profiles_rwlock);
+	inserted = switch_core_hash_insert(mod_nats_globals.publisher_hash, name, (void *)profile) == SWITCH_STATUS_SUCCESS;
+	switch_thread_rwlock_unlock(mod_nats_globals.profiles_rwlock);
+	if (!inserted)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Failed to insert new profile [%s] into mod_nats profile hash\n", name);
+		goto err;
+	}
+
+	/* Take over from the running profile of the same name, nothing can fail past this point */
+	if (replaces)
+	{
+		if (mod_nats_publisher_handover(replaces, profile) != SWITCH_STATUS_SUCCESS)
+		{
+			goto err;
+		}
+	}
+	else if (mod_nats_dispatch_add(profile) != SWITCH_STATUS_SUCCESS)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] cannot subscribe to its events\n", profile->name);
+		goto err;
+	}
+	switch_mutex_unlock(profile->start_mutex);
+	if (replaces)
+	{
+		mod_nats_publisher_destroy(&replaces);
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Profile[%s] started %d publisher workers on %d connections\n", profile->name, profile->worker_count,
+					  profile->link_count);
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Profile[%s] Successfully started\n", profile->name);
+	return SWITCH_STATUS_SUCCESS;
+
+err:
+	/* Cleanup, the profile being replaced keeps running as it was */
+	if (profile && profile->start_mutex)
+	{
+		profile->running = 0;
+		switch_mutex_unlock(profile->start_mutex);
+	}
+	if (inserted)
+	{
+		switch_thread_rwlock_wrlock(mod_nats_globals.profiles_rwlock);
+		if (replaces)
+		{
+			switch_core_hash_insert(mod_nats_globals.publisher_hash, name, (void *)replaces);
+		}
+		else
+		{
+			switch_core_hash_delete(mod_nats_globals.publisher_hash, name);
+		}
+		switch_thread_rwlock_unlock(mod_nats_globals.profiles_rwlock);
+	}
+	if (profile && replaces && profile->spill == replaces->spill)
+	{
+		profile->spill = NULL;
+	}
+	mod_nats_publisher_destroy(&profile);
+	return SWITCH_STATUS_GENERR;
+}
+
+/* Invoked by nats.c for every PubAck or publish error. Since an ack handler is set the message
+ * belongs to us; failed ones are handed to the workers to be published again.
+ */
+static void mod_nats_publisher_jetstream_ack(jsCtx *js, natsMsg *msg, jsPubAck *pa, jsPubAckErr *pae, void *closure)
+{
+	mod_nats_jetstream_ack_t *ack = (mod_nats_jetstream_ack_t *)closure;
+	mod_nats_publisher_profile_t *profile;
+	const char *attempt = NULL;
+	int attempts = 1;
+	char buf[12];
+
+	switch_mutex_lock(ack->mutex);
+	if (!(profile = ack->profile))
+	{
+		/* The profile is gone, what it still had pending was handed over or dropped already */
+		switch_mutex_unlock(ack->mutex);
+		natsMsg_Destroy(msg);
+		return;
+	}
+	if (pa)
+	{
+		__atomic_add_fetch(&profile->jetstream_stored, 1, __ATOMIC_RELAXED);
+		switch_mutex_unlock(ack->mutex);
+		natsMsg_Destroy(msg);
+		return;
+	}
+
+	if (natsMsgHeader_Get(msg, "FS-Publish-Attempt", &attempt) == NATS_OK && attempt)
+	{
+		attempts = atoi(attempt);
+	}
+	if (pae && !pae->ErrCode && attempts <= profile->jetstream_max_retries && profile->running)
+	{
+		/* Timeouts and missing responders are worth retrying, JetStream API errors are not */
+		switch_snprintf(buf, sizeof(buf), "%d", attempts + 1);
+		natsMsgHeader_Set(msg, "FS-Publish-Attempt", buf);
+		if (mod_nats_ring_trypush(profile->jetstream_retry_queue, msg) == SWITCH_STATUS_SUCCESS)
+		{
+			switch_mutex_unlock(ack->mutex);
+			return;
+		}
+	}
+
+	__atomic_add_fetch(&profile->jetstream_failed, 1, __ATOMIC_RELAXED);
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "profile [%s] JetStream dropped message on subject [%s] after %d attempts: %s (%d)\n",
+					  profile->name, natsMsg_GetSubject(msg), attempts, pae ? natsStatus_GetText(pae->Err) : "unknown",
+					  pae ? (int)pae->ErrCode : 0);
+	switch_mutex_unlock(ack->mutex);
+	natsMsg_Destroy(msg);
+}
+
+/* Wait a bounded time for the publishes of a link to be acknowledged, then destroy its context.
+ * Those still unacknowledged go to the retry queue of the profile taking over, if there is one,
+ * or fail. Either way nats.c is left with nothing to acknowledge through the profile's closure.
+ */
+static void mod_nats_publisher_jetstream_complete(mod_nats_publisher_profile_t *profile, mod_nats_link_t *link, mod_nats_publisher_profile_t *next)
+{
+	jsPubOptions pubOpts;
+	natsMsgList pending;
+	int i;
+
+	jsPubOptions_Init(&pubOpts);
+	pubOpts.MaxWait = profile->jetstream_complete_timeout_ms;
+	if (js_PublishAsyncComplete(link->js, &pubOpts) != NATS_OK)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile [%s] JetStream publishes of connection %d still pending after %dms\n",
+						  profile->name, link->id, profile->jetstream_complete_timeout_ms);
+		if (js_PublishAsyncGetPendingList(&pending, link->js) == NATS_OK)
+		{
+			for (i = 0; i < pending.Count; i++)
+			{
+				if (next && next->jetstream_retry_queue && mod_nats_ring_trypush(next->jetstream_retry_queue, pending.Msgs[i]) == SWITCH_STATUS_SUCCESS)
+				{
+					pending.Msgs[i] = NULL;
+				}
+				else
+				{
+					__atomic_add_fetch(&profile->jetstream_failed, 1, __ATOMIC_RELAXED);
+				}
+			}
+			natsMsgList_Destroy(&pending);
+		}
+	}
+	jsCtx_Destroy(link->js);
+	link->js = NULL;
+}
+
+/* No ack reaches the profile once this returns */
+static void mod_nats_publisher_jetstream_detach(mod_nats_publisher_profile_t *profile)
+{
+	if (profile->jetstream_ack)
+	{
+		switch_mutex_lock(profile->jetstream_ack->mutex);
+		profile->jetstream_ack->profile = NULL;
+		switch_mutex_unlock(profile->jetstream_ack->mutex);
+	}
+}
+
+/* Publish the messages that failed earlier, on whichever connection gets to them first. This must
+ * be called from a publisher worker thread holding the read lock of the link.
+ */
+static void mod_nats_publisher_jetstream_retry(mod_nats_publisher_profile_t *profile, mod_nats_link_t *link)
+{
+	natsMsg *msg = NULL;
+	natsStatus s;
+
+	while (link->js && mod_nats_ring_trypop(profile->jetstream_retry_queue, (void **)&msg) == SWITCH_STATUS_SUCCESS)
+	{
+		s = js_PublishMsgAsync(link->js, &msg, NULL);
+		if (s != NATS_OK)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "profile [%s] JetStream retry failed on subject [%s] %s\n",
+							  profile->name, natsMsg_GetSubject(msg), natsStatus_GetText(s));
+			__atomic_add_fetch(&profile->jetstream_failed, 1, __ATOMIC_RELAXED);
+			natsMsg_Destroy(msg);
+			continue;
+		}
+		__atomic_add_fetch(&profile->jetstream_retried, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Called with the write lock of the link held, right after its connection has been (re)opened */
+static void mod_nats_publisher_jetstream_init(mod_nats_publisher_profile_t *profile, mod_nats_link_t *link)
+{
+	jsOptions jsOpts;
+	natsStatus s;
+
+	link->jetstream_connected = SWITCH_FALSE;
+	link->jerr = 0;
+	if (link->js)
+	{
+		jsCtx_Destroy(link->js);
+		link->js = NULL;
+	}
+	s = jsOptions_Init(&jsOpts);
+	if (s == NATS_OK)
+	{
+		char subj[1024];
+		jsOpts.PublishAsync.MaxPending = profile->jetstream_max_pending;
+		jsOpts.PublishAsync.AckHandler = mod_nats_publisher_jetstream_ack;
+		jsOpts.PublishAsync.AckHandlerClosure = profile->jetstream_ack;
+		switch_snprintf(subj, sizeof(subj), "%s.*", profile->jetstream_subject);
+		s = natsConnection_JetStream(&link->js, link->conn_active->connection, &jsOpts);
+		if (s == NATS_OK)
+		{
+			jsStreamInfo *si = NULL;
+			s = js_GetStreamInfo(&si, link->js, profile->jetstream_name, NULL, &link->jerr);
+			if (s == NATS_OK)
+			{
+				switch_bool_t subject_exists = SWITCH_FALSE;
+				int i = 0;
+				jsStreamConfig cfg = *si->Config;
+				for (i = 0; i < cfg.SubjectsLen; i++)
+				{
+					if (!strncmp(cfg.Subjects[i], subj, strlen(subj)))
+					{
+						subject_exists = SWITCH_TRUE;
+						switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "subject found [%s]\n",
+										  cfg.Subjects[i]);
+					}
+				}
+				if (subject_exists == SWITCH_FALSE)
+				{
+					cfg.Subjects[i] = subj;
+					cfg.SubjectsLen = i + 1;
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "added subject [%s] to stream [%s]\n",
+									  subj, profile->jetstream_name);
+				}
+				s = js_UpdateStream(&si, link->js, &cfg, NULL, &link->jerr);
+				if (s != NATS_OK)
+				{
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "could not update NATS stream [%s] on profile [%s] %s\n",
+									  profile->jetstream_name, profile->name, natsStatus_GetText(s));
+				}
+				else
+				{
+					link->jetstream_connected = SWITCH_TRUE;
+				}
+			}
+			else if (s == NATS_NOT_FOUND)
+			{
+				jsStreamConfig cfg;
+				jsStreamConfig_Init(&cfg);
+				cfg.Name = profile->jetstream_name;
+				cfg.Subjects = (const char *[1]){subj};
+				cfg.SubjectsLen = 1;
+				cfg.Storage = js_MemoryStorage;
+				cfg.Retention = js_WorkQueuePolicy;
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "profile [%s] NATS stream [%s] not found\n",
+								  profile->name, profile->jetstream_name);
+				s = js_AddStream(&si, link->js, &cfg, NULL, &link->jerr);
+				if (s != NATS_OK)
+				{
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "could not add NATS stream [%s] on profile [%s] with subject [%s] %s\n",
+									  profile->jetstream_name, profile->name, subj, natsStatus_GetText(s));
+				}
+				else
+				{
+					link->jetstream_connected = SWITCH_TRUE;
+				}
+			}
+			else
+			{
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "could not get NATS stream [%s] info in profile [%s] %s\n", profile->jetstream_name, profile->name, natsStatus_GetText(s));
 			}
+			if (si)
+			{
+				jsStreamInfo_Destroy(si);
+			}
+		}
+		if (link->jetstream_connected == SWITCH_TRUE)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "stream [%s] connected on profile [%s]\n", profile->jetstream_name, profile->name);
 		}
 	}
-	profile->conn_active = NULL;
-	/* We are not going to open the publisher queue connection on create, but instead wait for the running thread to open it */
+}
+
+/* Any worker may call this when it finds its link without a connection. Only one of the workers
+ * of the link reconnects, the others wait on the write lock and then reuse the new connection.
+ */
+static switch_status_t mod_nats_publisher_connect(mod_nats_publisher_profile_t *profile, mod_nats_link_t *link)
+{
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	switch_time_t now = switch_time_now();
 
-	/* Create a bounded FIFO queue for sending messages */
-	if (switch_queue_create(&(profile->send_queue), profile->send_queue_size, profile->pool) != SWITCH_STATUS_SUCCESS)
+	switch_thread_rwlock_wrlock(link->conn_rwlock);
+	if (link->conn_active)
 	{
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create send queue of size %d!\n",
-						  profile->send_queue_size);
-		goto err;
+		goto done;
 	}
-
-	/* Start the event send thread. This will set up the initial connection */
-	switch_threadattr_create(&thd_attr, profile->pool);
-	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
-	if (switch_thread_create(&profile->publisher_thread, thd_attr, mod_nats_publisher_thread, profile, profile->pool))
+	if (now < link->reconnect_time)
 	{
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot create 'nats event sender' thread!\n");
-		goto err;
+		/* Another worker failed to connect recently, wait for the reconnect interval */
+		status = SWITCH_STATUS_NOT_INITALIZED;
+		goto done;
 	}
 
-	/* Subscribe events */
-	for (i = 0; i < profile->event_subscriptions; i++)
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "no connection %d - reconnecting...\n", link->id);
+	status = mod_nats_connection_open(link->conn_root, &(link->conn_active), profile->name);
+	if (status == SWITCH_STATUS_SUCCESS)
 	{
-		if (switch_strstr(argv[i], "SWITCH_EVENT_CUSTOM::"))
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "connected to profile [%s] connection %d\n", profile->name, link->id);
+		if (profile->jetstream_enabled == SWITCH_TRUE)
 		{
-			if (switch_event_bind_removable("NATS",
-											SWITCH_EVENT_CUSTOM,
-											argv[i] + strlen("SWITCH_EVENT_CUSTOM::"),
-											mod_nats_publisher_event_handler,
-											profile,
-											&(profile->event_nodes[i])) != SWITCH_STATUS_SUCCESS)
-			{
-
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot bind to event handler %d!\n", (int)profile->event_ids[i]);
-				goto err;
-			}
+			mod_nats_publisher_jetstream_init(profile, link);
 		}
-		else
+		if (!link->id)
 		{
-			if (switch_event_bind_removable("NATS",
-											profile->event_ids[i],
-											SWITCH_EVENT_SUBCLASS_ANY,
-											mod_nats_publisher_event_handler,
-											profile,
-											&(profile->event_nodes[i])) != SWITCH_STATUS_SUCCESS)
-			{
+			mod_nats_command_subscribe(profile);
+		}
+	}
+	else
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile [%s] connection %d failed to connect with code(%d), sleeping for %dms\n",
+						  profile->name, link->id, status, profile->reconnect_interval_ms);
+		link->reconnect_time = now + profile->reconnect_interval_ms * 1000;
+	}
 
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Cannot bind to event handler %d!\n", (int)profile->event_ids[i]);
-				goto err;
-			}
+done:
+	switch_thread_rwlock_unlock(link->conn_rwlock);
+	return status;
+}
+
+/* Close the active connection of the link, unless another worker already replaced it. The other
+ * links keep publishing. Only needed once nats.c gave up on every server of the cluster.
+ */
+static void mod_nats_publisher_disconnect(mod_nats_publisher_profile_t *profile, mod_nats_link_t *link, natsConnection *failed)
+{
+	switch_thread_rwlock_wrlock(link->conn_rwlock);
+	if (link->conn_active && link->conn_active->connection == failed)
+	{
+		NATS_STAT_INC(profile->disconnects);
+		NATS_STAT_INC(link->disconnects);
+		if (!link->id)
+		{
+			mod_nats_command_unsubscribe(profile, SWITCH_FALSE);
 		}
+		mod_nats_connection_close(link->conn_active);
+		link->conn_active = NULL;
 	}
+	switch_thread_rwlock_unlock(link->conn_rwlock);
+}
+
+/* Whether nats.c gave up reconnecting the connection of the link, so the next configured one must be tried */
+static natsConnection *mod_nats_publisher_closed(mod_nats_link_t *link)
+{
+	natsConnection *connection = NULL;
 
-	if (switch_core_hash_insert(mod_nats_globals.publisher_hash, name, (void *)profile) != SWITCH_STATUS_SUCCESS)
+	switch_thread_rwlock_rdlock(link->conn_rwlock);
+	if (link->conn_active && link->conn_active->connection && natsConnection_IsClosed(link->conn_active->connection))
 	{
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Failed to insert new profile [%s] into mod_nats profile hash\n", name);
-		goto err;
+		connection = link->conn_active->connection;
 	}
+	switch_thread_rwlock_unlock(link->conn_rwlock);
+	return connection;
+}
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Profile[%s] Successfully started\n", profile->name);
-	return SWITCH_STATUS_SUCCESS;
+/* In batch mode the connection is flushed once all the messages of a batch are published.
+ * This must be called from a publisher worker thread holding the read lock of its link.
+ */
+static switch_status_t mod_nats_publisher_flush(mod_nats_publisher_profile_t *profile, mod_nats_link_t *link)
+{
+	natsStatus s;
 
-err:
-	/* Cleanup */
-	mod_nats_publisher_destroy(&profile);
-	return SWITCH_STATUS_GENERR;
+	if (!link->conn_active)
+	{
+		return SWITCH_STATUS_NOT_INITALIZED;
+	}
+	s = natsConnection_FlushTimeout(link->conn_active->connection, profile->batch_flush_timeout_ms);
+	if (s != NATS_OK)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] failed to flush connection[%s] %s\n",
+						  profile->name, link->conn_active->name, natsStatus_GetText(s));
+		return SWITCH_STATUS_SOCKERR;
+	}
+	return SWITCH_STATUS_SUCCESS;
 }
 
-/* This should only be called in a single threaded context from the publisher profile send thread */
-switch_status_t mod_nats_publisher_send(mod_nats_publisher_profile_t *profile, mod_nats_message_t *msg)
+/* This must be called from a publisher worker thread holding the read lock of its link */
+switch_status_t mod_nats_publisher_send(mod_nats_publisher_worker_t *worker, mod_nats_message_t *msg)
 {
+	mod_nats_publisher_profile_t *profile = worker->profile;
+	mod_nats_link_t *link = worker->link;
 	natsMsg *message = NULL;
+	switch_bool_t jetstream = link->jetstream_connected;
+	const char *subj;
+	const char *data = msg->payload;
+	size_t data_len = msg->payload_len;
+	switch_bool_t compressed = SWITCH_FALSE;
 	natsStatus s;
 
-	if (!profile->conn_active)
+	if (!link->conn_active)
 	{
 		/* No connection, so we can not send the message. */
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "profile [%s] not active\n", profile->name);
 		return SWITCH_STATUS_NOT_INITALIZED;
 	}
 
-	if (profile->jetstream_connected == SWITCH_TRUE)
+	subj = jetstream ? profile->event_subjects[msg->event_id] : profile->subject;
+	if (jetstream && mod_nats_ring_size(profile->jetstream_retry_queue))
 	{
-		char subj[1024];
-		switch_snprintf(subj, sizeof(subj), "%s.%s", profile->jetstream_subject, msg->evname);
-		s = natsMsg_Create(&message, subj, NULL, msg->pjson, strlen(msg->pjson));
-		if (s != NATS_OK)
+		mod_nats_publisher_jetstream_retry(profile, link);
+	}
+
+	if (profile->compression && msg->payload_len >= profile->compression_threshold &&
+		mod_nats_compress(worker, msg->payload, msg->payload_len, &data, &data_len) == SWITCH_STATUS_SUCCESS)
+	{
+		compressed = SWITCH_TRUE;
+	}
+
+	if (msg->encoding == NATS_ENCODING_JSON && !compressed)
+	{
+		/* No headers are needed, publish the payload as is without building a natsMsg */
+		if (jetstream)
 		{
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "could not create message using subject [%s] in profile [%s] not active\n", profile->jetstream_subject, profile->name);
-			return SWITCH_STATUS_SOCKERR;
+			s = js_PublishAsync(link->js, subj, msg->payload, (int)msg->payload_len, NULL);
+		}
+		else
+		{
+			s = natsConnection_Publish(link->conn_active->connection, subj, msg->payload, (int)msg->payload_len);
 		}
-		s = js_PublishMsgAsync(profile->js, &message, NULL);
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "sending event [%s] in subject [%s]\n", msg->evname, subj);
-		natsMsg_Destroy(message);
 	}
 	else
 	{
-		s = natsMsg_Create(&message, profile->subject, NULL, msg->pjson, strlen(msg->pjson));
-		if (s != NATS_OK)
+		/* Announce the encoding, the key dictionary and the codec of the payload in the message headers */
+		s = natsMsg_Create(&message, subj, NULL, data, (int)data_len);
+		if (s == NATS_OK)
+		{
+			s = natsMsgHeader_Set(message, "FS-Encoding", mod_nats_encoding_name(msg->encoding));
+		}
+		if (s == NATS_OK && msg->encoding != NATS_ENCODING_JSON)
+		{
+			s = natsMsgHeader_Set(message, "FS-Dictionary", NATS_DICTIONARY_VERSION);
+		}
+		if (s == NATS_OK && compressed)
+		{
+			s = natsMsgHeader_Set(message, "FS-Compression", mod_nats_compression_name(profile->compression));
+		}
+		if (s == NATS_OK && compressed && profile->compression_dict_id)
+		{
+			char dict_id[16];
+
+			switch_snprintf(dict_id, sizeof(dict_id), "%u", profile->compression_dict_id);
+			s = natsMsgHeader_Set(message, "FS-Compression-Dictionary", dict_id);
+		}
+		if (s == NATS_OK)
 		{
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "could not create message using subject [%s] in profile [%s] not active\n", profile->subject, profile->name);
-			return SWITCH_STATUS_SOCKERR;
+			s = jetstream ? js_PublishMsgAsync(link->js, &message, NULL) : natsConnection_PublishMsg(link->conn_active->connection, message);
 		}
-		s = natsConnection_PublishMsg(profile->conn_active->connection, message);
 		natsMsg_Destroy(message);
 	}
 
+	if (jetstream)
+	{
+		if (s == NATS_TIMEOUT)
+		{
+			/* Too many publishes are waiting for their PubAck, try again later */
+			return SWITCH_STATUS_TIMEOUT;
+		}
+		if (s == NATS_OK)
+		{
+			__atomic_add_fetch(&profile->jetstream_published, 1, __ATOMIC_RELAXED);
+		}
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "sending event [%s] in subject [%s]\n", switch_event_name(msg->event_id), subj);
+	}
+
 	if (s != NATS_OK)
 	{
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Profile[%s] failed to send event on connection[%s] with subject [%s] payload [%s] %s\n",
-						  profile->name, profile->conn_active->name, profile->subject, msg->pjson, natsStatus_GetText(s));
-		mod_nats_connection_close(profile->conn_active);
-		profile->conn_active = NULL;
+						  profile->name, link->conn_active->name, subj, msg->encoding == NATS_ENCODING_JSON ? msg->payload : "(binary)", natsStatus_GetText(s));
 		return SWITCH_STATUS_SOCKERR;
 	}
 
 	return SWITCH_STATUS_SUCCESS;
 }
 
+/* At module shutdown publish what the worker still has queued, the conflation windows are closed
+ * early. Gives up at the first failure or after batch_flush_timeout_ms, the rest is discarded.
+ */
+static void mod_nats_publisher_drain(mod_nats_publisher_worker_t *worker, unsigned int batch_pos, unsigned int batch_len)
+{
+	mod_nats_publisher_profile_t *profile = worker->profile;
+	mod_nats_link_t *link = worker->link;
+	mod_nats_message_t **batch = worker->batch;
+	unsigned int batch_max = profile->batch_size ? profile->batch_size : NATS_RING_BATCH;
+	switch_time_t deadline = switch_time_now() + profile->batch_flush_timeout_ms * 1000;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	unsigned int published = 0;
+
+	switch_thread_rwlock_rdlock(link->conn_rwlock);
+	while (status == SWITCH_STATUS_SUCCESS && link->conn_active)
+	{
+		if (batch_pos == batch_len)
+		{
+			batch_pos = 0;
+			batch_len = 0;
+			if (switch_time_now() > deadline)
+			{
+				break;
+			}
+			if (worker->handover)
+			{
+				batch_len = mod_nats_ring_pop_batch(worker->handover, (void **)batch, batch_max);
+			}
+			batch_len += profile->conflate_enabled ? mod_nats_conflate_expire(worker, batch + batch_len, batch_max - batch_len, INT64_MAX) : 0;
+			batch_len += mod_nats_lane_pop_batch(worker, batch + batch_len, batch_max - batch_len);
+			if (!batch_len)
+			{
+				break;
+			}
+		}
+		if (batch[batch_pos]->event && mod_nats_util_msg_serialize(&batch[batch_pos]) != SWITCH_STATUS_SUCCESS)
+		{
+			NATS_STAT_INC(worker->stats.serialize_errors);
+		}
+		else if ((status = mod_nats_publisher_send(worker, batch[batch_pos])) == SWITCH_STATUS_SUCCESS)
+		{
+			mod_nats_stats_published(worker, batch[batch_pos], switch_time_now());
+			published++;
+		}
+		mod_nats_util_msg_destroy(&batch[batch_pos]);
+		batch_pos++;
+	}
+	if (published && link->conn_active)
+	{
+		mod_nats_publisher_flush(profile, link);
+	}
+	switch_thread_rwlock_unlock(link->conn_rwlock);
+
+	for (; batch_pos < batch_len; batch_pos++)
+	{
+		mod_nats_util_msg_destroy(&batch[batch_pos]);
+	}
+	if (published)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Profile[%s] event sender thread %d published %u messages on shutdown\n", profile->name, worker->id, published);
+	}
+}
+
 void *SWITCH_THREAD_FUNC mod_nats_publisher_thread(switch_thread_t *thread, void *data)
 {
+	mod_nats_publisher_worker_t *worker = (mod_nats_publisher_worker_t *)data;
+	mod_nats_publisher_profile_t *profile = worker->profile;
+	mod_nats_link_t *link = worker->link;
+	mod_nats_message_t **batch = worker->batch;
+	unsigned int batch_max = profile->batch_size ? profile->batch_size : NATS_RING_BATCH;
+	unsigned int batch_len = 0, batch_pos = 0;
 	mod_nats_message_t *msg = NULL;
 	switch_status_t status = SWITCH_STATUS_SUCCESS;
-	mod_nats_publisher_profile_t *profile = (mod_nats_publisher_profile_t *)data;
+	natsConnection *connection = NULL;
 
-	while (profile->running)
+	mod_nats_publisher_wait_start(profile);
+	while (profile->running && !profile->retiring)
 	{
-		if (!profile->conn_active)
+		if (!link->conn_active)
+		{
+			if (mod_nats_publisher_connect(profile, link) != SWITCH_STATUS_SUCCESS)
+			{
+				switch_sleep(profile->reconnect_interval_ms * 1000);
+			}
+			continue;
+		}
+		/* Drain everything available in one go, sleep only once the queue is empty */
+		if (batch_pos == batch_len)
 		{
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "no connection - reconnecting...\n");
-			status = mod_nats_connection_open(profile->conn_root, &(profile->conn_active), profile->name);
-			if (status == SWITCH_STATUS_SUCCESS)
+			batch_pos = 0;
+			batch_len = 0;
+			if (worker->handover)
+			{
+				/* What the replaced profile left goes first, the events queued since come after it */
+				if (!(batch_len = mod_nats_ring_pop_batch(worker->handover, (void **)batch, batch_max)))
+				{
+					worker->handover = NULL;
+				}
+			}
+			batch_len += profile->conflate_enabled ? mod_nats_conflate_expire(worker, batch + batch_len, batch_max - batch_len, switch_time_now()) : 0;
+			batch_len += mod_nats_lane_pop_batch(worker, batch + batch_len, batch_max - batch_len);
+			if (!batch_len)
 			{
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "connected to profile [%s]\n", profile->name);
-				if (profile->jetstream_enabled == SWITCH_TRUE)
+				switch_interval_time_t timeout = 1000000;
+
+				if ((connection = mod_nats_publisher_closed(link)))
+				{
+					mod_nats_publisher_disconnect(profile, link, connection);
+					continue;
+				}
+				if (profile->conflate_enabled)
 				{
-					profile->jetstream_connected = SWITCH_FALSE;
-					profile->jerr = 0;
-					jsOptions jsOpts;
-					natsStatus s;
-					s = jsOptions_Init(&jsOpts);
-					if (s == NATS_OK)
+					/* Wake up in time for the next conflation window to close */
+					switch_time_t deadline = __atomic_load_n(&worker->conflate_deadline, __ATOMIC_ACQUIRE);
+					switch_time_t now = switch_time_now();
+
+					timeout = profile->conflate_window_ms * 1000;
+					if (deadline)
 					{
-						char subj[1024];
-						switch_snprintf(subj, sizeof(subj), "%s.*", profile->jetstream_subject);
-						s = natsConnection_JetStream(&profile->js, profile->conn_active->connection, &jsOpts);
-						if (s == NATS_OK)
-						{
-							jsStreamInfo *si = NULL;
-							s = js_GetStreamInfo(&si, profile->js, profile->jetstream_name, NULL, &profile->jerr);
-							if (s == NATS_OK)
-							{
-								switch_bool_t subject_exists = SWITCH_FALSE;
-								int i = 0;
-								jsStreamConfig cfg = *si->Config;
-								for (i; i < cfg.SubjectsLen; i++)
-								{
-									if (!strncmp(cfg.Subjects[i], subj, strlen(subj)))
-									{
-										subject_exists = SWITCH_TRUE;
-										switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "subject found [%s]\n",
-														  cfg.Subjects[i]);
-									}
-								}
-								if (subject_exists == SWITCH_FALSE)
-								{
-									cfg.Subjects[i] = subj;
-									cfg.SubjectsLen = i + 1;
-									switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "added subject [%s] to stream [%s]\n",
-													  subj, profile->jetstream_name);
-								}
-								s = js_UpdateStream(&si, profile->js, &cfg, NULL, &profile->jerr);
-								if (s != NATS_OK)
-								{
-									switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "could not update NATS stream [%s] on profile [%s] %s\n",
-													  profile->jetstream_name, profile->name, natsStatus_GetText(s));
-								}
-								else
-								{
-									profile->jetstream_connected = SWITCH_TRUE;
-								}
-							}
-							else if (s == NATS_NOT_FOUND)
-							{
-								jsStreamConfig cfg;
-								jsStreamConfig_Init(&cfg);
-								cfg.Name = profile->jetstream_name;
-								cfg.Subjects = (const char *[1]){subj};
-								cfg.SubjectsLen = 1;
-								cfg.Storage = js_MemoryStorage;
-								cfg.Retention = js_WorkQueuePolicy;
-								switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "profile [%s] NATS stream [%s] not found\n",
-												  profile->name, profile->jetstream_name);
-								s = js_AddStream(&si, profile->js, &cfg, NULL, &profile->jerr);
-								if (s != NATS_OK)
-								{
-									switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "could not add NATS stream [%s] on profile [%s] with subject [%s] %s\n",
-													  profile->jetstream_name, profile->name, subj, natsStatus_GetText(s));
-								}
-								else
-								{
-									profile->jetstream_connected = SWITCH_TRUE;
-								}
-							}
-							else
-							{
-								switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "could not get NATS stream [%s] info in profile [%s] %s\n", profile->jetstream_name, profile->name, natsStatus_GetText(s));
-							}
-							if (si)
-							{
-								jsStreamInfo_Destroy(si);
-							}
-						}
-						if (profile->jetstream_connected == SWITCH_TRUE)
-						{
-							switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "stream [%s] connected on profile [%s]\n", profile->jetstream_name, profile->name);
-						}
+						timeout = deadline > now ? deadline - now : 0;
 					}
 				}
+				if (timeout)
+				{
+					mod_nats_lane_wait(worker, timeout);
+				}
 				continue;
 			}
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile [%s] failed to connect with code(%d), sleeping for %dms\n",
-							  profile->name, status, profile->reconnect_interval_ms);
-			switch_sleep(profile->reconnect_interval_ms * 1000);
-			continue;
+			if (profile->batch_size && profile->batch_linger_ms)
+			{
+				/* Give the batch a chance to fill up before publishing it */
+				switch_time_t deadline = switch_time_now() + profile->batch_linger_ms * 1000;
+				switch_time_t now;
+
+				while (batch_len < batch_max && profile->running && (now = switch_time_now()) < deadline)
+				{
+					mod_nats_lane_wait(worker, deadline - now);
+					batch_len += mod_nats_lane_pop_batch(worker, batch + batch_len, batch_max - batch_len);
+				}
+			}
 		}
-		if (!msg && switch_queue_pop_timeout(profile->send_queue, (void **)&msg, 1000000) != SWITCH_STATUS_SUCCESS)
+		msg = batch[batch_pos];
+
+		if (msg->event)
 		{
-			continue;
+			/* Serializing may reallocate the message */
+			status = mod_nats_util_msg_serialize(&batch[batch_pos]);
+			msg = batch[batch_pos];
+			if (status != SWITCH_STATUS_SUCCESS)
+			{
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] failed to serialize event [%s]\n", profile->name, switch_event_name(msg->event_id));
+				NATS_STAT_INC(worker->stats.serialize_errors);
+				mod_nats_util_msg_destroy(&msg);
+				batch_pos++;
+			}
 		}
 
 		if (msg)
 		{
-			switch (mod_nats_publisher_send(profile, msg))
+			switch_thread_rwlock_rdlock(link->conn_rwlock);
+			connection = link->conn_active ? link->conn_active->connection : NULL;
+			status = mod_nats_publisher_send(worker, msg);
+			if (status == SWITCH_STATUS_SUCCESS && profile->batch_size && batch_pos + 1 == batch_len)
+			{
+				/* A failed flush does not tell which messages got through, they are not retried */
+				if (mod_nats_publisher_flush(profile, link) != SWITCH_STATUS_SUCCESS)
+				{
+					mod_nats_util_msg_destroy(&msg);
+					batch_pos++;
+					status = SWITCH_STATUS_SOCKERR;
+				}
+			}
+			if (status == SWITCH_STATUS_SOCKERR && connection && !natsConnection_IsClosed(connection))
+			{
+				/* Still failing over, nothing to close */
+				connection = NULL;
+			}
+			switch_thread_rwlock_unlock(link->conn_rwlock);
+
+			switch (status)
 			{
 			case SWITCH_STATUS_SUCCESS:
+				mod_nats_stats_published(worker, msg, switch_time_now());
 				mod_nats_util_msg_destroy(&msg);
+				batch_pos++;
 				break;
 
 			case SWITCH_STATUS_NOT_INITALIZED:
 				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Send failed with 'not initialized'\n");
 				break;
 
+			case SWITCH_STATUS_TIMEOUT:
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Send stalled, %d JetStream publishes pending\n", profile->jetstream_max_pending);
+				break;
+
 			case SWITCH_STATUS_SOCKERR:
-			{
-				mod_nats_message_t *msg_dup = NULL;
-				switch_malloc(msg_dup, sizeof(mod_nats_message_t));
-				*msg_dup = *msg;
-				msg = NULL;
+				/* Keep the message and retry it once reconnected, requeueing it at the tail would
+				 * reorder the events of its call. While nats.c fails over to another server of the
+				 * cluster only its reconnect buffer can run out, the connection is kept.
+				 */
 				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Send failed with 'socket error'\n");
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "message %s\n", msg_dup->pjson);
-
-				if (switch_queue_trypush(profile->send_queue, msg_dup) != SWITCH_STATUS_SUCCESS)
+				NATS_STAT_ADD(worker->stats.publish_errors, 1);
+				if (connection)
+				{
+					mod_nats_publisher_disconnect(profile, link, connection);
+				}
+				else
 				{
-					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR,
-									  "error placing the event in the listeners queue\n");
-					mod_nats_util_msg_destroy(&msg_dup);
+					switch_yield(10000);
 				}
 				break;
-			}
 
 			default:
 				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Send failed with a generic error\n");
@@ -561,11 +1915,120 @@ void *SWITCH_THREAD_FUNC mod_nats_publisher_thread(switch_thread_t *thread, void
 		}
 	}
 
-	/* Abort the current message */
-	mod_nats_util_msg_destroy(&msg);
+	if (profile->retiring)
+	{
+		/* Keep the rest of the batch for the profile replacing this one */
+		memmove(batch, batch + batch_pos, sizeof(mod_nats_message_t *) * (batch_len - batch_pos));
+		worker->held = batch_len - batch_pos;
+	}
+	else
+	{
+		mod_nats_publisher_drain(worker, batch_pos, batch_len);
+	}
 
 	// Terminate the thread
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Event sender thread stopped\n");
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Event sender thread %d stopped\n", worker->id);
+	switch_thread_exit(thread, SWITCH_STATUS_SUCCESS);
+	return NULL;
+}
+
+/* Whether every connection of the profile is open */
+switch_bool_t mod_nats_publisher_connected(mod_nats_publisher_profile_t *profile)
+{
+	int i;
+
+	for (i = 0; i < profile->link_count; i++)
+	{
+		if (!profile->links[i].conn_active)
+		{
+			return SWITCH_FALSE;
+		}
+	}
+	return SWITCH_TRUE;
+}
+
+/* Replays the spill log in order, at spill_replay_rate events per second, as long as all the
+ * connections of the profile are open: a message read from the log can not wait for its own,
+ * new events would overtake it. Each message goes to the worker its shard maps to, that of its call.
+ */
+void *SWITCH_THREAD_FUNC mod_nats_publisher_spill_thread(switch_thread_t *thread, void *data)
+{
+	mod_nats_publisher_profile_t *profile = (mod_nats_publisher_profile_t *)data;
+	switch_time_t interval = 1000000 / profile->spill_replay_rate;
+	switch_time_t next = 0, now;
+	mod_nats_message_t *msg = NULL;
+	mod_nats_spill_t *source = NULL;
+
+	mod_nats_publisher_wait_start(profile);
+	while (profile->running && !profile->retiring)
+	{
+		if (!mod_nats_publisher_connected(profile))
+		{
+			switch_yield(100000);
+			continue;
+		}
+		if (!msg && profile->spill_drain)
+		{
+			/* What was spilled before spill_dir changed is older than anything else */
+			if (mod_nats_spill_read(profile->spill_drain, &msg) == SWITCH_STATUS_SUCCESS)
+			{
+				source = profile->spill_drain;
+			}
+			else
+			{
+				mod_nats_spill_t *drain = profile->spill_drain;
+
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "profile [%s] replayed the spill log in [%s]\n", profile->name, drain->dir);
+				__atomic_store_n(&profile->spill_drain, NULL, __ATOMIC_RELEASE);
+				mod_nats_spill_destroy(&drain);
+				continue;
+			}
+		}
+		if (!msg && (!profile->spill || mod_nats_spill_read(profile->spill, &msg) != SWITCH_STATUS_SUCCESS))
+		{
+			switch_yield(100000);
+			continue;
+		}
+		source = source ? source : profile->spill;
+		if (mod_nats_lane_push(&profile->workers[msg->shard % profile->worker_count], msg, SWITCH_FALSE) != SWITCH_STATUS_SUCCESS)
+		{
+			/* The worker is still busy, keep the message and retry it, the spill log stays active meanwhile */
+			switch_yield(10000);
+			continue;
+		}
+		mod_nats_spill_release(source);
+		msg = NULL;
+		source = NULL;
+
+		now = switch_time_now();
+		next = next > now - interval ? next + interval : now;
+		if (next > now + 1000)
+		{
+			switch_yield(next - now);
+		}
+	}
+
+	/* On a reload the workers are stopped, their queues are handed over with the message */
+	if (msg && profile->retiring && mod_nats_lane_push(&profile->workers[msg->shard % profile->worker_count], msg, SWITCH_FALSE) == SWITCH_STATUS_SUCCESS)
+	{
+		mod_nats_spill_release(source);
+		msg = NULL;
+	}
+	if (msg && profile->retiring)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile [%s] discarding replayed [%s] event on reload\n",
+						  profile->name, switch_event_name(msg->event_id));
+		mod_nats_spill_release(source);
+		mod_nats_util_msg_destroy(&msg);
+	}
+	else if (msg)
+	{
+		/* Not released, the next start replays it */
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "profile [%s] replayed [%s] event left for the next start\n",
+						  profile->name, switch_event_name(msg->event_id));
+		mod_nats_util_msg_destroy(&msg);
+	}
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Spill replay thread stopped\n");
 	switch_thread_exit(thread, SWITCH_STATUS_SUCCESS);
 	return NULL;
 }
@@ -0,0 +1,191 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+
+/* Token bucket rate limits per event type, and per subclass of CUSTOM events:
+ *
+ *   <rate_limits>
+ *     <rate_limit event="DTMF,HEARTBEAT" rate="100" burst="200" />
+ *     <rate_limit event="CUSTOM::sofia::register" rate="50" />
+ *   </rate_limits>
+ *
+ * rate is in events per second and burst (default one second worth of events) is the bucket
+ * size. A CUSTOM limit without a subclass covers the subclasses without their own limit. The
+ * bucket is checked by the event handler before anything is serialized or queued.
+ *
+ * Each bucket is kept as the GCRA theoretical arrival time of the next event, so taking a token
+ * is a single compare and swap shared by all the event threads.
+ */
+
+static switch_status_t mod_nats_ratelimit_add(mod_nats_publisher_profile_t *profile, char *name, double rate, int burst)
+{
+	mod_nats_rate_limit_t *limit, **last;
+	char *subclass = NULL;
+	switch_event_types_t type;
+
+	if ((subclass = switch_strstr(name, "CUSTOM::")))
+	{
+		type = SWITCH_EVENT_CUSTOM;
+		subclass += strlen("CUSTOM::");
+	}
+	else if (switch_name_event(name, &type) != SWITCH_STATUS_SUCCESS || type == SWITCH_EVENT_ALL)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] rate limit event [%s] was not recognised\n", profile->name, name);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	limit = switch_core_alloc(profile->pool, sizeof(mod_nats_rate_limit_t));
+	limit->name = switch_core_strdup(profile->pool, name);
+	limit->subclass = zstr(subclass) ? NULL : switch_core_strdup(profile->pool, subclass);
+	limit->interval = (switch_time_t)(1000000.0 / rate);
+	limit->tolerance = limit->interval * (burst - 1);
+
+	/* Subclass limits come first, the catch-all one of a type last */
+	for (last = &profile->rate_limits[type]; *last && (*last)->subclass; last = &(*last)->next)
+		;
+	if (limit->subclass)
+	{
+		limit->next = *last;
+		*last = limit;
+	}
+	else
+	{
+		if (*last)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] rate limit of [%s] replaces a previous one\n", profile->name, name);
+		}
+		*last = limit;
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t mod_nats_ratelimit_load(mod_nats_publisher_profile_t *profile, switch_xml_t cfg)
+{
+	switch_xml_t xlimit;
+	int i;
+
+	for (xlimit = switch_xml_child(cfg, "rate_limit"); xlimit; xlimit = xlimit->next)
+	{
+		char *events = switch_core_strdup(profile->pool, switch_xml_attr_soft(xlimit, "event"));
+		const char *burst_val = switch_xml_attr(xlimit, "burst");
+		double rate = atof(switch_xml_attr_soft(xlimit, "rate"));
+		int burst = burst_val ? atoi(burst_val) : (int)rate;
+		char *argv[SWITCH_EVENT_ALL];
+		int argc;
+
+		if (zstr(events))
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] rate limit missing 'event' attribute\n", profile->name);
+			return SWITCH_STATUS_FALSE;
+		}
+		if (rate <= 0)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] rate limit of [%s] needs a positive 'rate'\n", profile->name, events);
+			return SWITCH_STATUS_FALSE;
+		}
+		if (burst < 1)
+		{
+			burst = 1;
+		}
+		argc = switch_separate_string(events, ',', argv, (sizeof(argv) / sizeof(argv[0])));
+		for (i = 0; i < argc; i++)
+		{
+			if (mod_nats_ratelimit_add(profile, argv[i], rate, burst) != SWITCH_STATUS_SUCCESS)
+			{
+				return SWITCH_STATUS_FALSE;
+			}
+		}
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Called by the event threads for the event types that have a limit */
+switch_bool_t mod_nats_ratelimit_allow(mod_nats_publisher_profile_t *profile, switch_event_t *evt, switch_time_t now)
+{
+	mod_nats_rate_limit_t *limit;
+	switch_time_t tat, base;
+
+	for (limit = profile->rate_limits[evt->event_id]; limit; limit = limit->next)
+	{
+		if (!limit->subclass || (evt->subclass_name && !strcmp(limit->subclass, evt->subclass_name)))
+		{
+			break;
+		}
+	}
+	if (!limit)
+	{
+		return SWITCH_TRUE;
+	}
+
+	tat = __atomic_load_n(&limit->tat, __ATOMIC_RELAXED);
+	do
+	{
+		base = tat > now ? tat : now;
+		if (base - now > limit->tolerance)
+		{
+			NATS_STAT_INC(limit->throttled);
+			return SWITCH_FALSE;
+		}
+	} while (!__atomic_compare_exchange_n(&limit->tat, &tat, base + limit->interval, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return SWITCH_TRUE;
+}
+
+/* Events throttled by all the limits of a profile */
+uint64_t mod_nats_ratelimit_throttled(mod_nats_publisher_profile_t *profile)
+{
+	mod_nats_rate_limit_t *limit;
+	uint64_t throttled = 0;
+	int i;
+
+	for (i = 0; i < SWITCH_EVENT_ALL; i++)
+	{
+		for (limit = profile->rate_limits[i]; limit; limit = limit->next)
+		{
+			throttled += NATS_STAT_GET(limit->throttled);
+		}
+	}
+	return throttled;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
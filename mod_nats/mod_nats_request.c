@@ -0,0 +1,276 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+
+#include "mod_nats.h"
+
+/* Request-reply over the connection of a publisher profile, for lookups from the dialplan:
+ *
+ *   nats_request <profile> <subject> [<timeout_ms>] [<payload>]
+ *
+ * Without a payload the basic channel data is sent as JSON. The calling session waits for the
+ * reply, nats.c multiplexes the requests of every session over the connection and its single
+ * response subscription. The reply is stored in nats_reply and, when it is a JSON object, each
+ * of its fields is set as a channel variable. nats_request_status tells how it went: success,
+ * timeout, no_responders or error.
+ *
+ * The profile and connection read locks are held while waiting, so a reconnect or the shutdown of
+ * the profile waits for the pending requests, at most their timeout. A reload does not.
+ */
+
+/* The caller makes sure the profile outlives the request. It goes out on the first connection of
+ * the profile that is up, a reconnecting one would only buffer it until the timeout.
+ */
+natsStatus mod_nats_request_profile(mod_nats_publisher_profile_t *profile, const char *subject, const char *payload, int timeout_ms, natsMsg **reply)
+{
+	natsStatus s = NATS_CONNECTION_CLOSED;
+	int i;
+
+	for (i = 0; i < profile->link_count && s == NATS_CONNECTION_CLOSED; i++)
+	{
+		mod_nats_link_t *link = &profile->links[i];
+
+		switch_thread_rwlock_rdlock(link->conn_rwlock);
+		if (link->conn_active && link->conn_active->connection && natsConnection_Status(link->conn_active->connection) == NATS_CONN_STATUS_CONNECTED)
+		{
+			s = natsConnection_RequestString(reply, link->conn_active->connection, subject, payload, timeout_ms);
+		}
+		switch_thread_rwlock_unlock(link->conn_rwlock);
+	}
+	return s;
+}
+
+static natsStatus mod_nats_request_send(const char *profile_name, const char *subject, const char *payload, int timeout_ms, natsMsg **reply)
+{
+	mod_nats_publisher_profile_t *profile;
+	natsStatus s = NATS_NOT_FOUND;
+
+	/* Only the lookup is done under the profiles lock, the profile is kept by its own read lock */
+	switch_thread_rwlock_rdlock(mod_nats_globals.profiles_rwlock);
+	if ((profile = switch_core_hash_find(mod_nats_globals.publisher_hash, profile_name)) &&
+		switch_thread_rwlock_tryrdlock(profile->rwlock) != SWITCH_STATUS_SUCCESS)
+	{
+		profile = NULL;
+	}
+	switch_thread_rwlock_unlock(mod_nats_globals.profiles_rwlock);
+
+	if (!profile)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "nats_request: profile [%s] not found\n", profile_name);
+		return s;
+	}
+	s = mod_nats_request_profile(profile, subject, payload, timeout_ms, reply);
+	switch_thread_rwlock_unlock(profile->rwlock);
+	return s;
+}
+
+static const char *mod_nats_request_status_name(natsStatus s)
+{
+	switch (s)
+	{
+	case NATS_OK:
+		return "success";
+	case NATS_TIMEOUT:
+		return "timeout";
+	case NATS_NO_RESPONDERS:
+		return "no_responders";
+	default:
+		return "error";
+	}
+}
+
+/* Set the fields of a JSON object reply as channel variables */
+static void mod_nats_request_set_variables(switch_channel_t *channel, const char *data)
+{
+	cJSON *json = cJSON_Parse(data), *item;
+
+	if (!json || json->type != cJSON_Object)
+	{
+		goto done;
+	}
+	for (item = json->child; item; item = item->next)
+	{
+		if (zstr(item->string))
+		{
+			continue;
+		}
+		if (item->type == cJSON_String)
+		{
+			switch_channel_set_variable(channel, item->string, item->valuestring);
+		}
+		else if (item->type == cJSON_Number)
+		{
+			switch_channel_set_variable_printf(channel, item->string, "%.15g", item->valuedouble);
+		}
+		else if (item->type == cJSON_True || item->type == cJSON_False)
+		{
+			switch_channel_set_variable(channel, item->string, item->type == cJSON_True ? "true" : "false");
+		}
+		else if (item->type == cJSON_NULL)
+		{
+			switch_channel_set_variable(channel, item->string, NULL);
+		}
+		else
+		{
+			char *value = cJSON_PrintUnformatted(item);
+
+			switch_channel_set_variable(channel, item->string, value);
+			switch_safe_free(value);
+		}
+	}
+
+done:
+	if (json)
+	{
+		cJSON_Delete(json);
+	}
+}
+
+/* Split <profile> <subject> [<timeout_ms>] [<payload>] into argv[0] to argv[3]. The timeout is
+ * only taken when the third word is a number, otherwise the payload starts there. The payload is
+ * the rest of the line, spaces included.
+ */
+static int mod_nats_request_parse(char *data, char **argv, int *timeout_ms)
+{
+	int argc = switch_separate_string(data, ' ', argv, 3);
+
+	*timeout_ms = 1000;
+	if (argc > 2 && switch_is_number(argv[2]))
+	{
+		if (atoi(argv[2]) > 0)
+		{
+			*timeout_ms = atoi(argv[2]);
+		}
+		argc = 2 + switch_separate_string(argv[2], ' ', argv + 2, 2);
+	}
+	else if (argc > 2)
+	{
+		argv[3] = argv[2];
+		argv[2] = NULL;
+		argc = 4;
+	}
+	return argc;
+}
+
+void mod_nats_request_app(switch_core_session_t *session, const char *data)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	char *mydata, *argv[4] = {0};
+	char *payload = NULL;
+	natsMsg *reply = NULL;
+	natsStatus s;
+	int argc, timeout_ms;
+
+	if (zstr(data))
+	{
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "-USAGE: nats_request %s\n", NATS_REQUEST_SYNTAX);
+		return;
+	}
+	mydata = switch_core_session_strdup(session, data);
+	if ((argc = mod_nats_request_parse(mydata, argv, &timeout_ms)) < 2)
+	{
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "-USAGE: nats_request %s\n", NATS_REQUEST_SYNTAX);
+		return;
+	}
+
+	if (argc < 4)
+	{
+		switch_event_t *event = NULL;
+
+		if (switch_event_create(&event, SWITCH_EVENT_REQUEST_PARAMS) == SWITCH_STATUS_SUCCESS)
+		{
+			switch_channel_event_set_basic_data(channel, event);
+			switch_event_serialize_json(event, &payload);
+			switch_event_destroy(&event);
+		}
+	}
+
+	s = mod_nats_request_send(argv[0], argv[1], argc < 4 ? (payload ? payload : "") : argv[3], timeout_ms, &reply);
+	switch_channel_set_variable(channel, "nats_request_status", mod_nats_request_status_name(s));
+	if (s == NATS_OK)
+	{
+		const char *reply_data = natsMsg_GetData(reply);
+
+		switch_channel_set_variable(channel, "nats_reply", reply_data);
+		if (!zstr(reply_data))
+		{
+			mod_nats_request_set_variables(channel, reply_data);
+		}
+		natsMsg_Destroy(reply);
+	}
+	else
+	{
+		switch_channel_set_variable(channel, "nats_reply", NULL);
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "nats_request on [%s] failed: %s\n", argv[1], natsStatus_GetText(s));
+	}
+	switch_safe_free(payload);
+}
+
+switch_status_t mod_nats_request_api(const char *cmd, switch_stream_handle_t *stream)
+{
+	char *mycmd = NULL, *argv[4] = {0};
+	natsMsg *reply = NULL;
+	natsStatus s;
+	int argc, timeout_ms;
+
+	if (zstr(cmd) || !(mycmd = strdup(cmd)) || (argc = mod_nats_request_parse(mycmd, argv, &timeout_ms)) < 2)
+	{
+		stream->write_function(stream, "-USAGE: nats_request %s\n", NATS_REQUEST_SYNTAX);
+		switch_safe_free(mycmd);
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	if ((s = mod_nats_request_send(argv[0], argv[1], argc < 4 ? "" : argv[3], timeout_ms, &reply)) == NATS_OK)
+	{
+		stream->write_function(stream, "%s\n", natsMsg_GetData(reply));
+		natsMsg_Destroy(reply);
+	}
+	else
+	{
+		stream->write_function(stream, "-ERR %s: %s\n", mod_nats_request_status_name(s), natsStatus_GetText(s));
+	}
+	switch_safe_free(mycmd);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
@@ -0,0 +1,240 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+
+/* Bounded multi-producer ring (D. Vyukov's sequence based queue). Every slot carries a sequence
+ * number telling producers and consumers whether it is free or filled for the current lap, so
+ * neither side needs a lock. The mutex and condition are only touched to wake up a sleeping
+ * consumer. Rings drained by the same consumer can be linked to share the ones of a leader, so
+ * the consumer sleeps until any of them gets something.
+ */
+
+switch_status_t mod_nats_ring_create(mod_nats_ring_t **ring, unsigned int capacity, switch_memory_pool_t *pool)
+{
+	mod_nats_ring_t *new_ring;
+	size_t size = 1, i;
+	char *mem;
+
+	if (!capacity)
+	{
+		return SWITCH_STATUS_FALSE;
+	}
+	while (size < capacity)
+	{
+		size <<= 1;
+	}
+
+	new_ring = switch_core_alloc(pool, sizeof(mod_nats_ring_t) + NATS_CACHE_LINE);
+	new_ring = (mod_nats_ring_t *)(((uintptr_t)new_ring + NATS_CACHE_LINE - 1) & ~((uintptr_t)NATS_CACHE_LINE - 1));
+	mem = switch_core_alloc(pool, sizeof(mod_nats_ring_slot_t) * size + NATS_CACHE_LINE);
+	new_ring->slots = (mod_nats_ring_slot_t *)(((uintptr_t)mem + NATS_CACHE_LINE - 1) & ~((uintptr_t)NATS_CACHE_LINE - 1));
+	new_ring->mask = size - 1;
+	new_ring->capacity = capacity;
+	for (i = 0; i < size; i++)
+	{
+		new_ring->slots[i].sequence = i;
+		new_ring->slots[i].data = NULL;
+	}
+	switch_mutex_init(&new_ring->mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_thread_cond_create(&new_ring->cond, pool);
+	new_ring->signal = new_ring;
+
+	*ring = new_ring;
+	return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t mod_nats_ring_trypush(mod_nats_ring_t *ring, void *data)
+{
+	mod_nats_ring_slot_t *slot;
+	size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+	for (;;)
+	{
+		intptr_t diff;
+
+		slot = &ring->slots[pos & ring->mask];
+		diff = (intptr_t)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+		if (diff == 0)
+		{
+			/* The slot array is rounded up to a power of two, keep the configured bound */
+			if (pos - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) >= ring->capacity)
+			{
+				return SWITCH_STATUS_FALSE;
+			}
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			return SWITCH_STATUS_FALSE;
+		}
+		else
+		{
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->data = data;
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the store of 'sleeping' in mod_nats_ring_wait_any */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->signal->sleeping, __ATOMIC_RELAXED))
+	{
+		switch_mutex_lock(ring->signal->mutex);
+		switch_thread_cond_signal(ring->signal->cond);
+		switch_mutex_unlock(ring->signal->mutex);
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t mod_nats_ring_trypop(mod_nats_ring_t *ring, void **data)
+{
+	mod_nats_ring_slot_t *slot;
+	size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	for (;;)
+	{
+		intptr_t diff;
+
+		slot = &ring->slots[pos & ring->mask];
+		diff = (intptr_t)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			return SWITCH_STATUS_FALSE;
+		}
+		else
+		{
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	*data = slot->data;
+	slot->data = NULL;
+	__atomic_store_n(&slot->sequence, pos + ring->mask + 1, __ATOMIC_RELEASE);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+unsigned int mod_nats_ring_pop_batch(mod_nats_ring_t *ring, void **data, unsigned int max)
+{
+	unsigned int count = 0;
+
+	while (count < max && mod_nats_ring_trypop(ring, &data[count]) == SWITCH_STATUS_SUCCESS)
+	{
+		count++;
+	}
+	return count;
+}
+
+unsigned int mod_nats_ring_size(mod_nats_ring_t *ring)
+{
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+
+	return head > tail ? (unsigned int)(head - tail) : 0;
+}
+
+/* Wake up the consumer of ring through the one of leader */
+void mod_nats_ring_link(mod_nats_ring_t *ring, mod_nats_ring_t *leader)
+{
+	ring->signal = leader->signal;
+}
+
+static unsigned int mod_nats_ring_size_any(mod_nats_ring_t **rings, int count)
+{
+	unsigned int size = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		size += mod_nats_ring_size(rings[i]);
+	}
+	return size;
+}
+
+/* Block the consumer until a producer pushes to one of the rings, which must all be linked to
+ * the first one, the timeout expires or the rings are woken up.
+ */
+void mod_nats_ring_wait_any(mod_nats_ring_t **rings, int count, switch_interval_time_t timeout)
+{
+	mod_nats_ring_t *signal = rings[0]->signal;
+
+	if (mod_nats_ring_size_any(rings, count))
+	{
+		return;
+	}
+
+	switch_mutex_lock(signal->mutex);
+	__atomic_store_n(&signal->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (!mod_nats_ring_size_any(rings, count))
+	{
+		switch_thread_cond_timedwait(signal->cond, signal->mutex, timeout);
+	}
+	__atomic_store_n(&signal->sleeping, 0, __ATOMIC_RELAXED);
+	switch_mutex_unlock(signal->mutex);
+}
+
+/* Block the consumer until a producer pushes something, the timeout expires or the ring is woken up */
+void mod_nats_ring_wait(mod_nats_ring_t *ring, switch_interval_time_t timeout)
+{
+	mod_nats_ring_wait_any(&ring, 1, timeout);
+}
+
+void mod_nats_ring_wake(mod_nats_ring_t *ring)
+{
+	switch_mutex_lock(ring->signal->mutex);
+	switch_thread_cond_broadcast(ring->signal->cond);
+	switch_mutex_unlock(ring->signal->mutex);
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
@@ -0,0 +1,432 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+/* Append-only spill log. Messages that can not be queued are written to fixed size segment
+ * files <dir>/<profile>.<seq>.spill which are mmap'd, so appending is a memcpy. A zero length
+ * record marks the end of the data of a segment. Segments are removed once replayed and left
+ * on disk at shutdown so they are replayed on the next start. The position after the last
+ * message queued by the replay is kept in the mmap'd <dir>/<profile>.offset, so a segment partly
+ * replayed resumes from there. The message read but not queued yet is replayed again.
+ *
+ * The spill log lives in its own pool, a reload hands it from the replaced profile to the new one.
+ */
+
+typedef struct
+{
+  uint32_t len;
+  uint8_t event_id;
+  uint8_t encoding;
+  uint16_t shard;
+} mod_nats_spill_record_t;
+
+#define NATS_SPILL_ALIGN(len) (((len) + 7) & ~((size_t)7))
+
+static switch_status_t mod_nats_spill_map(mod_nats_spill_t *spill, uint64_t seq, switch_bool_t create, int *fd, char **map, size_t *size)
+{
+	char path[1024];
+	struct stat st;
+
+	switch_snprintf(path, sizeof(path), "%s%s%s.%020llu.spill", spill->dir, SWITCH_PATH_SEPARATOR, spill->name, (unsigned long long)seq);
+	if ((*fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0640)) < 0)
+	{
+		if (create)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "cannot create spill segment [%s] %s\n", path, strerror(errno));
+		}
+		return SWITCH_STATUS_FALSE;
+	}
+	if (create && ftruncate(*fd, spill->segment_size) != 0)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "cannot size spill segment [%s] %s\n", path, strerror(errno));
+		goto err;
+	}
+	if (fstat(*fd, &st) != 0 || st.st_size < (off_t)sizeof(mod_nats_spill_record_t))
+	{
+		goto err;
+	}
+	*size = (size_t)st.st_size;
+	if ((*map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0)) == MAP_FAILED)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "cannot map spill segment [%s] %s\n", path, strerror(errno));
+		goto err;
+	}
+	return SWITCH_STATUS_SUCCESS;
+
+err:
+	close(*fd);
+	*fd = -1;
+	*map = NULL;
+	return SWITCH_STATUS_FALSE;
+}
+
+static void mod_nats_spill_unmap(mod_nats_spill_t *spill, uint64_t seq, int *fd, char **map, size_t size, switch_bool_t remove)
+{
+	char path[1024];
+
+	if (*map)
+	{
+		munmap(*map, size);
+		*map = NULL;
+	}
+	if (*fd >= 0)
+	{
+		close(*fd);
+		*fd = -1;
+	}
+	if (remove)
+	{
+		switch_snprintf(path, sizeof(path), "%s%s%s.%020llu.spill", spill->dir, SWITCH_PATH_SEPARATOR, spill->name, (unsigned long long)seq);
+		unlink(path);
+	}
+}
+
+/* Map the replay position, without it a restart replays the first segment from its start */
+static void mod_nats_spill_offset_map(mod_nats_spill_t *spill)
+{
+	char path[1024];
+	struct stat st;
+	void *map;
+
+	switch_snprintf(path, sizeof(path), "%s%s%s.offset", spill->dir, SWITCH_PATH_SEPARATOR, spill->name);
+	if ((spill->offset_fd = open(path, O_RDWR | O_CREAT, 0640)) < 0 || fstat(spill->offset_fd, &st) != 0 ||
+		(st.st_size < (off_t)(2 * sizeof(uint64_t)) && ftruncate(spill->offset_fd, 2 * sizeof(uint64_t)) != 0) ||
+		(map = mmap(NULL, 2 * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, spill->offset_fd, 0)) == MAP_FAILED)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "cannot map spill offset [%s] %s\n", path, strerror(errno));
+		if (spill->offset_fd >= 0)
+		{
+			close(spill->offset_fd);
+			spill->offset_fd = -1;
+		}
+		return;
+	}
+	spill->offset_map = (uint64_t *)map;
+}
+
+switch_status_t mod_nats_spill_create(mod_nats_spill_t **spill, const char *dir, const char *name, size_t segment_size, size_t max_size)
+{
+	mod_nats_spill_t *new_spill;
+	switch_memory_pool_t *pool = NULL;
+	char prefix[256];
+	struct dirent *entry;
+	switch_bool_t found = SWITCH_FALSE;
+	uint64_t first = 0, last = 0;
+	DIR *d;
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_MEMERR;
+	}
+	new_spill = switch_core_alloc(pool, sizeof(mod_nats_spill_t));
+	new_spill->pool = pool;
+	new_spill->dir = switch_core_strdup(pool, dir);
+	new_spill->name = switch_core_strdup(pool, name);
+	new_spill->segment_size = segment_size;
+	new_spill->max_size = max_size;
+	new_spill->write_fd = -1;
+	new_spill->read_fd = -1;
+	new_spill->offset_fd = -1;
+	switch_mutex_init(&new_spill->mutex, SWITCH_MUTEX_NESTED, pool);
+
+	if (!(d = opendir(dir)))
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "cannot open spill directory [%s] %s\n", dir, strerror(errno));
+		switch_core_destroy_memory_pool(&pool);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	/* Pick up the segments left over by a previous run, they are replayed first */
+	switch_snprintf(prefix, sizeof(prefix), "%s.", name);
+	while ((entry = readdir(d)))
+	{
+		unsigned long long seq;
+		char path[1024];
+		struct stat st;
+
+		if (strncmp(entry->d_name, prefix, strlen(prefix)) || !switch_stristr(".spill", entry->d_name) ||
+			sscanf(entry->d_name + strlen(prefix), "%llu.spill", &seq) != 1)
+		{
+			continue;
+		}
+		switch_snprintf(path, sizeof(path), "%s%s%s", dir, SWITCH_PATH_SEPARATOR, entry->d_name);
+		if (stat(path, &st) == 0)
+		{
+			new_spill->disk_used += (size_t)st.st_size;
+		}
+		if (!found || seq < first)
+		{
+			first = seq;
+		}
+		if (!found || seq > last)
+		{
+			last = seq;
+		}
+		found = SWITCH_TRUE;
+	}
+	closedir(d);
+
+	mod_nats_spill_offset_map(new_spill);
+	if (found)
+	{
+		new_spill->read_seq = first;
+		new_spill->write_seq = last + 1;
+		new_spill->spilling = 1;
+		if (new_spill->offset_map && new_spill->offset_map[0] == first && !(new_spill->offset_map[1] & 7))
+		{
+			new_spill->resume_off = (size_t)new_spill->offset_map[1];
+		}
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "profile [%s] found %llu spill segments to replay in [%s], resuming at offset %lu\n",
+						  name, (unsigned long long)(last - first + 1), dir, (unsigned long)new_spill->resume_off);
+	}
+	else if (new_spill->offset_map)
+	{
+		/* Left by a run whose segments are all gone, the numbering starts over */
+		new_spill->offset_map[0] = 0;
+		new_spill->offset_map[1] = 0;
+	}
+
+	*spill = new_spill;
+	return SWITCH_STATUS_SUCCESS;
+}
+
+void mod_nats_spill_destroy(mod_nats_spill_t **spill)
+{
+	mod_nats_spill_t *s;
+	switch_bool_t drained;
+
+	if (!spill || !*spill)
+	{
+		return;
+	}
+	s = *spill;
+	switch_mutex_lock(s->mutex);
+	/* A fully replayed segment is removed, anything else is kept for the next start */
+	drained = s->read_seq == s->write_seq && s->read_map && s->read_off >= s->write_off && !s->held;
+	if (s->offset_map)
+	{
+		munmap(s->offset_map, 2 * sizeof(uint64_t));
+		s->offset_map = NULL;
+	}
+	if (s->offset_fd >= 0)
+	{
+		char path[1024];
+
+		close(s->offset_fd);
+		s->offset_fd = -1;
+		if (drained)
+		{
+			switch_snprintf(path, sizeof(path), "%s%s%s.offset", s->dir, SWITCH_PATH_SEPARATOR, s->name);
+			unlink(path);
+		}
+	}
+	mod_nats_spill_unmap(s, s->read_seq, &s->read_fd, &s->read_map, s->read_size, SWITCH_FALSE);
+	if (s->write_map)
+	{
+		msync(s->write_map, s->segment_size, MS_SYNC);
+	}
+	mod_nats_spill_unmap(s, s->write_seq, &s->write_fd, &s->write_map, s->segment_size, drained);
+	switch_mutex_unlock(s->mutex);
+	switch_core_destroy_memory_pool(&s->pool);
+	*spill = NULL;
+}
+
+/* A reload may change the disk budget of a spill log it hands over */
+void mod_nats_spill_limit(mod_nats_spill_t *spill, size_t max_size)
+{
+	switch_mutex_lock(spill->mutex);
+	spill->max_size = max_size;
+	switch_mutex_unlock(spill->mutex);
+}
+
+switch_status_t mod_nats_spill_append(mod_nats_spill_t *spill, mod_nats_message_t *msg)
+{
+	mod_nats_spill_record_t *record;
+	size_t need = NATS_SPILL_ALIGN(sizeof(mod_nats_spill_record_t) + msg->payload_len);
+	switch_status_t status = SWITCH_STATUS_FALSE;
+
+	/* Leave room for the end marker */
+	if (need + sizeof(mod_nats_spill_record_t) > spill->segment_size)
+	{
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_mutex_lock(spill->mutex);
+	if (!spill->write_map || spill->write_off + need + sizeof(mod_nats_spill_record_t) > spill->segment_size)
+	{
+		if (spill->write_map)
+		{
+			mod_nats_spill_unmap(spill, spill->write_seq, &spill->write_fd, &spill->write_map, spill->segment_size, SWITCH_FALSE);
+			spill->write_seq++;
+		}
+		if (spill->disk_used + spill->segment_size > spill->max_size)
+		{
+			spill->dropped++;
+			goto done;
+		}
+		if (mod_nats_spill_map(spill, spill->write_seq, SWITCH_TRUE, &spill->write_fd, &spill->write_map, &spill->write_size) != SWITCH_STATUS_SUCCESS)
+		{
+			spill->dropped++;
+			goto done;
+		}
+		spill->disk_used += spill->segment_size;
+		spill->write_off = 0;
+	}
+
+	/* The length goes in last, a record is only visible to the reader once complete */
+	record = (mod_nats_spill_record_t *)(spill->write_map + spill->write_off);
+	memcpy(spill->write_map + spill->write_off + sizeof(mod_nats_spill_record_t), msg->payload, msg->payload_len);
+	record->event_id = (uint8_t)msg->event_id;
+	record->encoding = (uint8_t)msg->encoding;
+	record->shard = msg->shard;
+	record->len = (uint32_t)msg->payload_len;
+	spill->write_off += need;
+	spill->spilled++;
+	__atomic_store_n(&spill->spilling, 1, __ATOMIC_RELEASE);
+	status = SWITCH_STATUS_SUCCESS;
+
+done:
+	switch_mutex_unlock(spill->mutex);
+	return status;
+}
+
+/* Read the oldest spilled message, SWITCH_STATUS_FALSE means the spill log is empty. The spill
+ * log stays active until the message is released, so new events keep queuing behind it.
+ */
+switch_status_t mod_nats_spill_read(mod_nats_spill_t *spill, mod_nats_message_t **msg)
+{
+	mod_nats_spill_record_t *record;
+	switch_status_t status = SWITCH_STATUS_FALSE;
+
+	switch_mutex_lock(spill->mutex);
+	for (;;)
+	{
+		size_t limit;
+
+		if (!spill->read_map)
+		{
+			if (spill->read_seq == spill->write_seq && !spill->write_map)
+			{
+				break;
+			}
+			if (mod_nats_spill_map(spill, spill->read_seq, SWITCH_FALSE, &spill->read_fd, &spill->read_map, &spill->read_size) != SWITCH_STATUS_SUCCESS)
+			{
+				if (spill->read_seq < spill->write_seq)
+				{
+					spill->read_seq++;
+					spill->resume_off = 0;
+					continue;
+				}
+				break;
+			}
+			/* Resume a segment partly replayed before a restart */
+			spill->read_off = spill->resume_off < spill->read_size ? spill->resume_off : 0;
+			spill->resume_off = 0;
+		}
+
+		limit = spill->read_seq == spill->write_seq ? spill->write_off : spill->read_size;
+		if (spill->read_off + sizeof(mod_nats_spill_record_t) <= limit)
+		{
+			record = (mod_nats_spill_record_t *)(spill->read_map + spill->read_off);
+			if (record->len && spill->read_off + sizeof(mod_nats_spill_record_t) + record->len <= limit)
+			{
+				*msg = mod_nats_util_msg_create(NULL, record->len);
+				memcpy((*msg)->payload, spill->read_map + spill->read_off + sizeof(mod_nats_spill_record_t), record->len);
+				(*msg)->payload[record->len] = '\0';
+				(*msg)->payload_len = record->len;
+				(*msg)->event_id = (switch_event_types_t)record->event_id;
+				(*msg)->encoding = (mod_nats_encoding_t)record->encoding;
+				(*msg)->shard = record->shard;
+				spill->read_off += NATS_SPILL_ALIGN(sizeof(mod_nats_spill_record_t) + record->len);
+				spill->replayed++;
+				spill->held = SWITCH_TRUE;
+				status = SWITCH_STATUS_SUCCESS;
+				break;
+			}
+		}
+
+		if (spill->read_seq == spill->write_seq)
+		{
+			/* Caught up with the writer */
+			break;
+		}
+
+		/* This segment is fully replayed */
+		mod_nats_spill_unmap(spill, spill->read_seq, &spill->read_fd, &spill->read_map, spill->read_size, SWITCH_TRUE);
+		spill->disk_used -= spill->read_size > spill->disk_used ? spill->disk_used : spill->read_size;
+		spill->read_seq++;
+	}
+
+	if (status != SWITCH_STATUS_SUCCESS && !spill->held)
+	{
+		__atomic_store_n(&spill->spilling, 0, __ATOMIC_RELEASE);
+	}
+	switch_mutex_unlock(spill->mutex);
+	return status;
+}
+
+/* The message returned by mod_nats_spill_read is queued, a restart resumes after it */
+void mod_nats_spill_release(mod_nats_spill_t *spill)
+{
+	switch_mutex_lock(spill->mutex);
+	spill->held = SWITCH_FALSE;
+	if (spill->offset_map)
+	{
+		spill->offset_map[0] = spill->read_seq;
+		spill->offset_map[1] = spill->read_off;
+	}
+	switch_mutex_unlock(spill->mutex);
+}
+
+switch_bool_t mod_nats_spill_active(mod_nats_spill_t *spill)
+{
+	return __atomic_load_n(&spill->spilling, __ATOMIC_ACQUIRE) ? SWITCH_TRUE : SWITCH_FALSE;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
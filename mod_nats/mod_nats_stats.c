@@ -0,0 +1,560 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+#include "mod_nats.h"
+
+/* Counters are plain 64-bit integers. The ones shared by the event threads are incremented with
+ * relaxed atomics (NATS_STAT_INC), the ones owned by a worker thread are stored without a locked
+ * instruction (NATS_STAT_ADD). The nats status API loads them relaxed, so a report is not a
+ * consistent snapshot.
+ */
+
+static inline unsigned int mod_nats_histogram_index(uint64_t value)
+{
+	unsigned int msb;
+
+	if (value >> (NATS_HISTOGRAM_SUB_BITS + 1) == 0)
+	{
+		return (unsigned int)value;
+	}
+	if (value >= (uint64_t)1 << NATS_HISTOGRAM_MAX_BITS)
+	{
+		value = ((uint64_t)1 << NATS_HISTOGRAM_MAX_BITS) - 1;
+	}
+	msb = 63 - __builtin_clzll(value);
+	return ((msb - NATS_HISTOGRAM_SUB_BITS) << NATS_HISTOGRAM_SUB_BITS) + (unsigned int)(value >> (msb - NATS_HISTOGRAM_SUB_BITS));
+}
+
+/* Highest value counted in a bucket */
+static inline uint64_t mod_nats_histogram_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < (2 << NATS_HISTOGRAM_SUB_BITS))
+	{
+		return index;
+	}
+	shift = (index >> NATS_HISTOGRAM_SUB_BITS) - 1;
+	return ((((uint64_t)(index & ((1 << NATS_HISTOGRAM_SUB_BITS) - 1)) | (1 << NATS_HISTOGRAM_SUB_BITS)) + 1) << shift) - 1;
+}
+
+/* Single writer, only called by the thread owning the histogram */
+void mod_nats_histogram_record(mod_nats_histogram_t *histogram, uint64_t value)
+{
+	NATS_STAT_ADD(histogram->counts[mod_nats_histogram_index(value)], 1);
+	NATS_STAT_ADD(histogram->sum, value);
+	if (value > histogram->max)
+	{
+		__atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+	}
+}
+
+uint64_t mod_nats_histogram_percentile(const uint64_t *counts, uint64_t total, double percentile)
+{
+	uint64_t rank = (uint64_t)(total * percentile / 100.0 + 0.5);
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (!total)
+	{
+		return 0;
+	}
+	if (!rank)
+	{
+		rank = 1;
+	}
+	for (i = 0; i < NATS_HISTOGRAM_BUCKETS; i++)
+	{
+		seen += counts[i];
+		if (seen >= rank)
+		{
+			return mod_nats_histogram_value(i);
+		}
+	}
+	return mod_nats_histogram_value(NATS_HISTOGRAM_BUCKETS - 1);
+}
+
+/* Called by a worker once a message is handed to NATS */
+void mod_nats_stats_published(mod_nats_publisher_worker_t *worker, mod_nats_message_t *msg, switch_time_t now)
+{
+	NATS_STAT_ADD(worker->stats.published, 1);
+	NATS_STAT_ADD(worker->stats.bytes, msg->payload_len);
+	if (msg->enqueued && now > msg->enqueued)
+	{
+		mod_nats_histogram_record(&worker->stats.latency, (uint64_t)(now - msg->enqueued));
+	}
+}
+
+typedef struct
+{
+  uint64_t enqueued;
+  uint64_t spilled;
+  uint64_t conflated;
+  uint64_t published;
+  uint64_t publish_errors;
+  uint64_t serialize_errors;
+  uint64_t bytes;
+  uint64_t latency_count;
+  uint64_t latency_sum;
+  uint64_t latency_max;
+  uint64_t latency[NATS_HISTOGRAM_BUCKETS];
+  unsigned int depth;
+} mod_nats_stats_snapshot_t;
+
+static void mod_nats_stats_collect(mod_nats_publisher_worker_t *worker, mod_nats_stats_snapshot_t *total, mod_nats_stats_snapshot_t *snap)
+{
+	mod_nats_worker_stats_t *stats = &worker->stats;
+	unsigned int i;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->enqueued = NATS_STAT_GET(stats->enqueued);
+	snap->spilled = NATS_STAT_GET(stats->spilled);
+	snap->conflated = NATS_STAT_GET(stats->conflated);
+	snap->published = NATS_STAT_GET(stats->published);
+	snap->publish_errors = NATS_STAT_GET(stats->publish_errors);
+	snap->serialize_errors = NATS_STAT_GET(stats->serialize_errors);
+	snap->bytes = NATS_STAT_GET(stats->bytes);
+	snap->latency_sum = NATS_STAT_GET(stats->latency.sum);
+	snap->latency_max = NATS_STAT_GET(stats->latency.max);
+	snap->depth = mod_nats_lane_size(worker);
+	for (i = 0; i < NATS_HISTOGRAM_BUCKETS; i++)
+	{
+		snap->latency[i] = NATS_STAT_GET(stats->latency.counts[i]);
+		snap->latency_count += snap->latency[i];
+		total->latency[i] += snap->latency[i];
+	}
+
+	total->enqueued += snap->enqueued;
+	total->spilled += snap->spilled;
+	total->conflated += snap->conflated;
+	total->published += snap->published;
+	total->publish_errors += snap->publish_errors;
+	total->serialize_errors += snap->serialize_errors;
+	total->bytes += snap->bytes;
+	total->latency_count += snap->latency_count;
+	total->latency_sum += snap->latency_sum;
+	total->latency_max = snap->latency_max > total->latency_max ? snap->latency_max : total->latency_max;
+	total->depth += snap->depth;
+}
+
+static cJSON *mod_nats_stats_json(mod_nats_stats_snapshot_t *snap)
+{
+	cJSON *obj = cJSON_CreateObject();
+	cJSON *latency = cJSON_CreateObject();
+
+	cJSON_AddItemToObject(obj, "queue_depth", cJSON_CreateNumber(snap->depth));
+	cJSON_AddItemToObject(obj, "enqueued", cJSON_CreateNumber((double)snap->enqueued));
+	cJSON_AddItemToObject(obj, "spilled", cJSON_CreateNumber((double)snap->spilled));
+	cJSON_AddItemToObject(obj, "conflated", cJSON_CreateNumber((double)snap->conflated));
+	cJSON_AddItemToObject(obj, "published", cJSON_CreateNumber((double)snap->published));
+	cJSON_AddItemToObject(obj, "publish_errors", cJSON_CreateNumber((double)snap->publish_errors));
+	cJSON_AddItemToObject(obj, "serialize_errors", cJSON_CreateNumber((double)snap->serialize_errors));
+	cJSON_AddItemToObject(obj, "bytes", cJSON_CreateNumber((double)snap->bytes));
+	cJSON_AddItemToObject(latency, "count", cJSON_CreateNumber((double)snap->latency_count));
+	cJSON_AddItemToObject(latency, "mean", cJSON_CreateNumber(snap->latency_count ? (double)snap->latency_sum / snap->latency_count : 0));
+	cJSON_AddItemToObject(latency, "p50", cJSON_CreateNumber((double)mod_nats_histogram_percentile(snap->latency, snap->latency_count, 50)));
+	cJSON_AddItemToObject(latency, "p90", cJSON_CreateNumber((double)mod_nats_histogram_percentile(snap->latency, snap->latency_count, 90)));
+	cJSON_AddItemToObject(latency, "p99", cJSON_CreateNumber((double)mod_nats_histogram_percentile(snap->latency, snap->latency_count, 99)));
+	cJSON_AddItemToObject(latency, "p999", cJSON_CreateNumber((double)mod_nats_histogram_percentile(snap->latency, snap->latency_count, 99.9)));
+	cJSON_AddItemToObject(latency, "max", cJSON_CreateNumber((double)snap->latency_max));
+	cJSON_AddItemToObject(obj, "latency_us", latency);
+	return obj;
+}
+
+static void mod_nats_stats_text(switch_stream_handle_t *stream, const char *label, mod_nats_stats_snapshot_t *snap)
+{
+	stream->write_function(stream, "  %-10s depth %u enqueued %lu spilled %lu conflated %lu published %lu publish_errors %lu serialize_errors %lu bytes %lu\n",
+						   label, snap->depth, (unsigned long)snap->enqueued, (unsigned long)snap->spilled, (unsigned long)snap->conflated, (unsigned long)snap->published,
+						   (unsigned long)snap->publish_errors, (unsigned long)snap->serialize_errors, (unsigned long)snap->bytes);
+	stream->write_function(stream, "  %-10s latency_us count %lu mean %lu p50 %lu p90 %lu p99 %lu p999 %lu max %lu\n", "",
+						   (unsigned long)snap->latency_count, (unsigned long)(snap->latency_count ? snap->latency_sum / snap->latency_count : 0),
+						   (unsigned long)mod_nats_histogram_percentile(snap->latency, snap->latency_count, 50),
+						   (unsigned long)mod_nats_histogram_percentile(snap->latency, snap->latency_count, 90),
+						   (unsigned long)mod_nats_histogram_percentile(snap->latency, snap->latency_count, 99),
+						   (unsigned long)mod_nats_histogram_percentile(snap->latency, snap->latency_count, 99.9),
+						   (unsigned long)snap->latency_max);
+}
+
+static void mod_nats_stats_profile(mod_nats_publisher_profile_t *profile, cJSON *json, switch_stream_handle_t *stream)
+{
+	mod_nats_stats_snapshot_t *total, *snap;
+	mod_nats_connection_t *conn;
+	cJSON *jprofile = NULL, *jworkers = NULL, *jconns = NULL, *jlinks = NULL, *jlimits = NULL;
+	char label[16];
+	int i;
+
+	switch_zmalloc(total, sizeof(*total));
+	switch_zmalloc(snap, sizeof(*snap));
+
+	if (json)
+	{
+		jprofile = cJSON_CreateObject();
+		jworkers = cJSON_CreateArray();
+		jconns = cJSON_CreateArray();
+		jlinks = cJSON_CreateArray();
+		cJSON_AddItemToObject(jprofile, "name", cJSON_CreateString(profile->name));
+		cJSON_AddItemToObject(jprofile, "connection_count", cJSON_CreateNumber(profile->link_count));
+		cJSON_AddItemToObject(jprofile, "encoding", cJSON_CreateString(mod_nats_encoding_name(profile->encoding)));
+		cJSON_AddItemToObject(jprofile, "compression", cJSON_CreateString(mod_nats_compression_name(profile->compression)));
+		cJSON_AddItemToObject(jprofile, "queue_capacity", cJSON_CreateNumber(profile->send_queue_size));
+		cJSON_AddItemToObject(jprofile, "dropped", cJSON_CreateNumber((double)NATS_STAT_GET(profile->dropped)));
+		cJSON_AddItemToObject(jprofile, "backpressure", cJSON_CreateString(mod_nats_backpressure_name(NATS_STAT_GET(profile->backpressure_level))));
+		cJSON_AddItemToObject(jprofile, "backpressure_escalations", cJSON_CreateNumber((double)NATS_STAT_GET(profile->backpressure_escalations)));
+		cJSON_AddItemToObject(jprofile, "shed", cJSON_CreateNumber((double)NATS_STAT_GET(profile->backpressure_shed)));
+		cJSON_AddItemToObject(jprofile, "disconnects", cJSON_CreateNumber((double)NATS_STAT_GET(profile->disconnects)));
+	}
+	else
+	{
+		stream->write_function(stream, "profile [%s] connections %d encoding %s compression %s queue_capacity %u\n", profile->name, profile->link_count,
+							   mod_nats_encoding_name(profile->encoding), mod_nats_compression_name(profile->compression), profile->send_queue_size);
+		stream->write_function(stream, "  dropped %lu backpressure %s escalations %lu shed %lu disconnects %lu\n", (unsigned long)NATS_STAT_GET(profile->dropped),
+							   mod_nats_backpressure_name(NATS_STAT_GET(profile->backpressure_level)), (unsigned long)NATS_STAT_GET(profile->backpressure_escalations),
+							   (unsigned long)NATS_STAT_GET(profile->backpressure_shed), (unsigned long)NATS_STAT_GET(profile->disconnects));
+	}
+
+	for (i = 0; i < profile->worker_count; i++)
+	{
+		mod_nats_stats_collect(&profile->workers[i], total, snap);
+		if (json)
+		{
+			cJSON_AddItemToArray(jworkers, mod_nats_stats_json(snap));
+		}
+		else
+		{
+			switch_snprintf(label, sizeof(label), "worker %d", i);
+			mod_nats_stats_text(stream, label, snap);
+		}
+	}
+	if (json)
+	{
+		cJSON_AddItemToObject(jprofile, "total", mod_nats_stats_json(total));
+		cJSON_AddItemToObject(jprofile, "workers", jworkers);
+	}
+	else
+	{
+		mod_nats_stats_text(stream, "total", total);
+	}
+
+	if (profile->jetstream_enabled)
+	{
+		if (json)
+		{
+			cJSON *js = cJSON_CreateObject();
+
+			cJSON_AddItemToObject(js, "published", cJSON_CreateNumber((double)NATS_STAT_GET(profile->jetstream_published)));
+			cJSON_AddItemToObject(js, "stored", cJSON_CreateNumber((double)NATS_STAT_GET(profile->jetstream_stored)));
+			cJSON_AddItemToObject(js, "failed", cJSON_CreateNumber((double)NATS_STAT_GET(profile->jetstream_failed)));
+			cJSON_AddItemToObject(js, "retried", cJSON_CreateNumber((double)NATS_STAT_GET(profile->jetstream_retried)));
+			cJSON_AddItemToObject(jprofile, "jetstream_acks", js);
+		}
+		else
+		{
+			stream->write_function(stream, "  jetstream published %lu stored %lu failed %lu retried %lu\n",
+								   (unsigned long)NATS_STAT_GET(profile->jetstream_published), (unsigned long)NATS_STAT_GET(profile->jetstream_stored),
+								   (unsigned long)NATS_STAT_GET(profile->jetstream_failed), (unsigned long)NATS_STAT_GET(profile->jetstream_retried));
+		}
+	}
+
+	if (profile->command_queue)
+	{
+		if (json)
+		{
+			cJSON *commands = cJSON_CreateObject();
+
+			cJSON_AddItemToObject(commands, "subject", cJSON_CreateString(profile->command_subject));
+			cJSON_AddItemToObject(commands, "subscribed", cJSON_CreateBool(profile->command_sub != NULL));
+			cJSON_AddItemToObject(commands, "queued", cJSON_CreateNumber(switch_queue_size(profile->command_queue)));
+			cJSON_AddItemToObject(commands, "executed", cJSON_CreateNumber((double)NATS_STAT_GET(profile->commands_executed)));
+			cJSON_AddItemToObject(commands, "rejected", cJSON_CreateNumber((double)NATS_STAT_GET(profile->commands_rejected)));
+			cJSON_AddItemToObject(jprofile, "commands", commands);
+		}
+		else
+		{
+			stream->write_function(stream, "  commands [%s] %s queued %u executed %lu rejected %lu\n", profile->command_subject,
+								   profile->command_sub ? "subscribed" : "unsubscribed", switch_queue_size(profile->command_queue),
+								   (unsigned long)NATS_STAT_GET(profile->commands_executed), (unsigned long)NATS_STAT_GET(profile->commands_rejected));
+		}
+	}
+
+	if (profile->xml_binding)
+	{
+		if (json)
+		{
+			cJSON *xml = cJSON_CreateObject();
+
+			cJSON_AddItemToObject(xml, "subject", cJSON_CreateString(profile->xml_subject));
+			cJSON_AddItemToObject(xml, "hits", cJSON_CreateNumber((double)NATS_STAT_GET(profile->xml_hits)));
+			cJSON_AddItemToObject(xml, "misses", cJSON_CreateNumber((double)NATS_STAT_GET(profile->xml_misses)));
+			cJSON_AddItemToObject(xml, "coalesced", cJSON_CreateNumber((double)NATS_STAT_GET(profile->xml_coalesced)));
+			cJSON_AddItemToObject(xml, "errors", cJSON_CreateNumber((double)NATS_STAT_GET(profile->xml_errors)));
+			cJSON_AddItemToObject(jprofile, "xml", xml);
+		}
+		else
+		{
+			stream->write_function(stream, "  xml [%s] hits %lu misses %lu coalesced %lu errors %lu\n", profile->xml_subject,
+								   (unsigned long)NATS_STAT_GET(profile->xml_hits), (unsigned long)NATS_STAT_GET(profile->xml_misses),
+								   (unsigned long)NATS_STAT_GET(profile->xml_coalesced), (unsigned long)NATS_STAT_GET(profile->xml_errors));
+		}
+	}
+
+	if (profile->spill)
+	{
+		if (json)
+		{
+			cJSON *spill = cJSON_CreateObject();
+
+			cJSON_AddItemToObject(spill, "spilled", cJSON_CreateNumber((double)NATS_STAT_GET(profile->spill->spilled)));
+			cJSON_AddItemToObject(spill, "replayed", cJSON_CreateNumber((double)NATS_STAT_GET(profile->spill->replayed)));
+			cJSON_AddItemToObject(spill, "dropped", cJSON_CreateNumber((double)NATS_STAT_GET(profile->spill->dropped)));
+			cJSON_AddItemToObject(spill, "disk_used", cJSON_CreateNumber((double)NATS_STAT_GET(profile->spill->disk_used)));
+			cJSON_AddItemToObject(jprofile, "spill", spill);
+		}
+		else
+		{
+			stream->write_function(stream, "  spill spilled %lu replayed %lu dropped %lu disk_used %lu\n",
+								   (unsigned long)NATS_STAT_GET(profile->spill->spilled), (unsigned long)NATS_STAT_GET(profile->spill->replayed),
+								   (unsigned long)NATS_STAT_GET(profile->spill->dropped), (unsigned long)NATS_STAT_GET(profile->spill->disk_used));
+		}
+	}
+
+	if (profile->lane_count > 1)
+	{
+		cJSON *jlanes = json ? cJSON_CreateArray() : NULL;
+		int l;
+
+		for (l = 0; l < profile->lane_count; l++)
+		{
+			unsigned int depth = 0;
+
+			for (i = 0; i < profile->worker_count; i++)
+			{
+				depth += mod_nats_ring_size(profile->workers[i].send_queues[l]);
+			}
+			if (json)
+			{
+				cJSON *jlane = cJSON_CreateObject();
+
+				cJSON_AddItemToObject(jlane, "name", cJSON_CreateString(profile->lanes[l].name));
+				cJSON_AddItemToObject(jlane, "weight", cJSON_CreateNumber(profile->lanes[l].weight));
+				cJSON_AddItemToObject(jlane, "depth", cJSON_CreateNumber(depth));
+				cJSON_AddItemToObject(jlane, "evicted", cJSON_CreateNumber((double)NATS_STAT_GET(profile->lanes[l].evicted)));
+				cJSON_AddItemToArray(jlanes, jlane);
+			}
+			else
+			{
+				stream->write_function(stream, "  lane [%s] weight %d depth %u evicted %lu\n", profile->lanes[l].name, profile->lanes[l].weight, depth,
+									   (unsigned long)NATS_STAT_GET(profile->lanes[l].evicted));
+			}
+		}
+		if (json)
+		{
+			cJSON_AddItemToObject(jprofile, "scheduling", cJSON_CreateString(profile->lane_strict ? "strict" : "weighted"));
+			cJSON_AddItemToObject(jprofile, "lanes", jlanes);
+		}
+	}
+
+	if (json)
+	{
+		jlimits = cJSON_CreateObject();
+	}
+	for (i = 0; i < SWITCH_EVENT_ALL; i++)
+	{
+		mod_nats_rate_limit_t *limit;
+
+		for (limit = profile->rate_limits[i]; limit; limit = limit->next)
+		{
+			if (json)
+			{
+				cJSON_AddItemToObject(jlimits, limit->name, cJSON_CreateNumber((double)NATS_STAT_GET(limit->throttled)));
+			}
+			else
+			{
+				stream->write_function(stream, "  rate_limit [%s] throttled %lu\n", limit->name, (unsigned long)NATS_STAT_GET(limit->throttled));
+			}
+		}
+	}
+	if (json)
+	{
+		cJSON_AddItemToObject(jprofile, "throttled", jlimits);
+	}
+
+	/* Each link reconnects on its own, report them one by one */
+	for (i = 0; i < profile->link_count; i++)
+	{
+		mod_nats_link_t *link = &profile->links[i];
+
+		switch_thread_rwlock_rdlock(link->conn_rwlock);
+		if (json)
+		{
+			cJSON *jlink = cJSON_CreateObject();
+
+			cJSON_AddItemToObject(jlink, "id", cJSON_CreateNumber(i));
+			cJSON_AddItemToObject(jlink, "connection", link->conn_active ? cJSON_CreateString(link->conn_active->name) : cJSON_CreateNull());
+			cJSON_AddItemToObject(jlink, "jetstream", cJSON_CreateBool(link->jetstream_connected));
+			cJSON_AddItemToObject(jlink, "disconnects", cJSON_CreateNumber((double)NATS_STAT_GET(link->disconnects)));
+			cJSON_AddItemToArray(jlinks, jlink);
+		}
+		else
+		{
+			stream->write_function(stream, "  link %d connection [%s] jetstream %s disconnects %lu\n", i, link->conn_active ? link->conn_active->name : "none",
+								   link->jetstream_connected ? "on" : "off", (unsigned long)NATS_STAT_GET(link->disconnects));
+		}
+		for (conn = link->conn_root; conn; conn = conn->next)
+		{
+			const char *state = "closed";
+			mod_nats_connection_health_t *health = conn->health;
+			char url[256] = "";
+
+			if (conn->connection && !natsConnection_IsClosed(conn->connection))
+			{
+				state = natsConnection_Status(conn->connection) == NATS_CONN_STATUS_CONNECTED ? "connected" : "reconnecting";
+				natsConnection_GetConnectedUrl(conn->connection, url, sizeof(url));
+			}
+
+			if (json)
+			{
+				cJSON *jconn = cJSON_CreateObject();
+
+				cJSON_AddItemToObject(jconn, "link", cJSON_CreateNumber(i));
+				cJSON_AddItemToObject(jconn, "name", cJSON_CreateString(conn->name));
+				cJSON_AddItemToObject(jconn, "state", cJSON_CreateString(state));
+				cJSON_AddItemToObject(jconn, "server", cJSON_CreateString(url));
+				cJSON_AddItemToObject(jconn, "servers", cJSON_CreateNumber(conn->server_count));
+				cJSON_AddItemToObject(jconn, "discovered", cJSON_CreateNumber(health ? NATS_STAT_GET(health->discovered) : 0));
+				cJSON_AddItemToObject(jconn, "connects", cJSON_CreateNumber((double)NATS_STAT_GET(conn->connects)));
+				cJSON_AddItemToObject(jconn, "connect_failures", cJSON_CreateNumber((double)NATS_STAT_GET(conn->connect_failures)));
+				cJSON_AddItemToObject(jconn, "failovers", cJSON_CreateNumber(health ? (double)NATS_STAT_GET(health->reconnects) : 0));
+				cJSON_AddItemToObject(jconn, "last_failover_ms", cJSON_CreateNumber(health ? NATS_STAT_GET(health->failover_us) / 1000.0 : 0));
+				cJSON_AddItemToArray(jconns, jconn);
+			}
+			else
+			{
+				stream->write_function(stream, "  connection [%s] link %d %s [%s] servers %d discovered %d connects %lu connect_failures %lu failovers %lu last_failover_ms %.1f\n",
+									   conn->name, i, state, url, conn->server_count, health ? NATS_STAT_GET(health->discovered) : 0,
+									   (unsigned long)NATS_STAT_GET(conn->connects), (unsigned long)NATS_STAT_GET(conn->connect_failures),
+									   (unsigned long)(health ? NATS_STAT_GET(health->reconnects) : 0), health ? NATS_STAT_GET(health->failover_us) / 1000.0 : 0.0);
+			}
+		}
+		switch_thread_rwlock_unlock(link->conn_rwlock);
+	}
+
+	if (json)
+	{
+		cJSON_AddItemToObject(jprofile, "links", jlinks);
+		cJSON_AddItemToObject(jprofile, "connections", jconns);
+		cJSON_AddItemToArray(json, jprofile);
+	}
+	switch_safe_free(total);
+	switch_safe_free(snap);
+}
+
+/* Sum of the latency histograms of the workers, returns the number of published messages */
+uint64_t mod_nats_stats_latency(mod_nats_publisher_profile_t *profile, uint64_t *counts, uint64_t *max)
+{
+	uint64_t published = 0;
+	unsigned int i;
+	int w;
+
+	memset(counts, 0, sizeof(uint64_t) * NATS_HISTOGRAM_BUCKETS);
+	*max = 0;
+	for (w = 0; w < profile->worker_count; w++)
+	{
+		mod_nats_worker_stats_t *stats = &profile->workers[w].stats;
+		uint64_t worker_max = NATS_STAT_GET(stats->latency.max);
+
+		published += NATS_STAT_GET(stats->published);
+		for (i = 0; i < NATS_HISTOGRAM_BUCKETS; i++)
+		{
+			counts[i] += NATS_STAT_GET(stats->latency.counts[i]);
+		}
+		*max = worker_max > *max ? worker_max : *max;
+	}
+	return published;
+}
+
+/* nats status [<profile>] [json] */
+switch_status_t mod_nats_stats_status(const char *profile_name, switch_bool_t json, switch_stream_handle_t *stream)
+{
+	mod_nats_publisher_profile_t *profile;
+	switch_hash_index_t *hi;
+	cJSON *jprofiles = json ? cJSON_CreateArray() : NULL;
+	int found = 0;
+
+	if (profile_name)
+	{
+		if ((profile = switch_core_hash_find(mod_nats_globals.publisher_hash, profile_name)))
+		{
+			mod_nats_stats_profile(profile, jprofiles, stream);
+			found++;
+		}
+	}
+	else
+	{
+		for (hi = switch_core_hash_first(mod_nats_globals.publisher_hash); hi; hi = switch_core_hash_next(&hi))
+		{
+			switch_core_hash_this(hi, NULL, NULL, (void **)&profile);
+			mod_nats_stats_profile(profile, jprofiles, stream);
+			found++;
+		}
+	}
+
+	if (json)
+	{
+		char *out = cJSON_Print(jprofiles);
+
+		stream->write_function(stream, "%s\n", out);
+		switch_safe_free(out);
+		cJSON_Delete(jprofiles);
+	}
+	if (profile_name && !found)
+	{
+		if (!json)
+		{
+			stream->write_function(stream, "-ERR profile [%s] not found\n", profile_name);
+		}
+		return SWITCH_STATUS_FALSE;
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
@@ -39,9 +39,18 @@
 
 #include "mod_nats.h"
 
+/* On a reload, profiles whose configuration did not change are left running untouched, changed
+ * ones are replaced without losing what they have queued (see mod_nats_publisher_create), new ones
+ * are started and the ones no longer configured are shut down.
+ */
 switch_status_t mod_nats_do_config(switch_bool_t reload)
 {
 	switch_xml_t cfg = NULL, xml = NULL, profiles = NULL, profile = NULL;
+	switch_hash_t *configured = NULL;
+	switch_hash_index_t *hi;
+	mod_nats_publisher_profile_t *removed[NATS_MAX_PROFILES];
+	int removed_count = 0, failed = 0, count = 0, i;
+
 	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, reload ? "reloading Config\n" : "loading Config\n");
 
 	if (!(xml = switch_xml_open_cfg("nats.conf", &cfg, NULL)))
@@ -50,6 +59,22 @@ switch_status_t mod_nats_do_config(switch_bool_t reload)
 		return SWITCH_STATUS_FALSE;
 	}
 
+	/* The profiles are dispatched from fixed arrays, a configuration with more is refused as a whole */
+	for (profile = (profiles = switch_xml_child(cfg, "publishers")) ? switch_xml_child(profiles, "profile") : NULL; profile; profile = profile->next)
+	{
+		count += zstr(switch_xml_attr_soft(profile, "name")) ? 0 : 1;
+	}
+	if (count > NATS_MAX_PROFILES)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "nats.conf.xml has %d profiles, at most %d are supported\n", count, NATS_MAX_PROFILES);
+		switch_xml_free(xml);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	/* Only a reload changes publisher_hash, so it can be read without the rwlock here */
+	switch_mutex_lock(mod_nats_globals.reload_mutex);
+	switch_core_hash_init(&configured);
+
 	if ((profiles = switch_xml_child(cfg, "publishers")))
 	{
 		if ((profile = switch_xml_child(profiles, "profile")))
@@ -57,16 +82,32 @@ switch_status_t mod_nats_do_config(switch_bool_t reload)
 			for (; profile; profile = profile->next)
 			{
 				char *name = (char *)switch_xml_attr_soft(profile, "name");
+				mod_nats_publisher_profile_t *running = NULL;
 
 				if (zstr(name))
 				{
 					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Failed to load mod_nats profile. Check configs missing name attr\n");
 					continue;
 				}
+				switch_core_hash_insert(configured, name, profile);
 
-				if (mod_nats_publisher_create(name, profile) != SWITCH_STATUS_SUCCESS)
+				if (reload && (running = switch_core_hash_find(mod_nats_globals.publisher_hash, name)))
+				{
+					char *config_xml = switch_xml_toxml(profile, SWITCH_FALSE);
+					switch_bool_t unchanged = config_xml && running->config_xml && !strcmp(config_xml, running->config_xml);
+
+					switch_safe_free(config_xml);
+					if (unchanged)
+					{
+						switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "mod_nats profile [%s] unchanged\n", name);
+						continue;
+					}
+				}
+
+				if (mod_nats_publisher_create(name, profile, running, NULL) != SWITCH_STATUS_SUCCESS)
 				{
 					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Failed to load mod_nats profile [%s]. Check configs\n", name);
+					failed++;
 				}
 				else
 				{
@@ -84,16 +125,289 @@ switch_status_t mod_nats_do_config(switch_bool_t reload)
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unable to locate publishers section for mod_nats\n");
 	}
 
+	if (reload)
+	{
+		for (hi = switch_core_hash_first(mod_nats_globals.publisher_hash); hi && removed_count < NATS_MAX_PROFILES; hi = switch_core_hash_next(&hi))
+		{
+			const void *key;
+			void *val;
+
+			switch_core_hash_this(hi, &key, NULL, &val);
+			if (!switch_core_hash_find(configured, (const char *)key))
+			{
+				removed[removed_count++] = (mod_nats_publisher_profile_t *)val;
+			}
+		}
+		switch_safe_free(hi);
+		switch_thread_rwlock_wrlock(mod_nats_globals.profiles_rwlock);
+		for (i = 0; i < removed_count; i++)
+		{
+			switch_core_hash_delete(mod_nats_globals.publisher_hash, removed[i]->name);
+		}
+		switch_thread_rwlock_unlock(mod_nats_globals.profiles_rwlock);
+		for (i = 0; i < removed_count; i++)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "mod_nats profile [%s] no longer configured\n", removed[i]->name);
+			mod_nats_publisher_destroy(&removed[i]);
+		}
+	}
+
+	switch_core_hash_destroy(&configured);
+	switch_mutex_unlock(mod_nats_globals.reload_mutex);
+	switch_xml_free(xml);
+	/* A profile that failed to reload keeps running with its previous configuration */
+	return reload && failed ? SWITCH_STATUS_FALSE : SWITCH_STATUS_SUCCESS;
+}
+
+/* Queued messages come from per-worker slabs: a free list of recycled blocks for each payload size
+ * class, from 256 bytes to 16KB. A message records the slab and class it came from so whichever
+ * thread destroys it returns the block. Bigger payloads, messages created without a slab and
+ * blocks that do not fit in a full free list use the heap.
+ */
+static inline int mod_nats_util_slab_class(size_t payload_size)
+{
+	int size_class = 0;
+
+	while (((size_t)1 << (size_class + NATS_SLAB_MIN_SHIFT)) < payload_size)
+	{
+		if (++size_class == NATS_SLAB_CLASSES)
+		{
+			return -1;
+		}
+	}
+	return size_class;
+}
+
+switch_status_t mod_nats_util_slab_create(mod_nats_slab_t **slab, unsigned int max_blocks, switch_memory_pool_t *pool)
+{
+	mod_nats_slab_t *new_slab = switch_core_alloc(pool, sizeof(mod_nats_slab_t));
+	int i;
+
+	for (i = 0; i < NATS_SLAB_CLASSES; i++)
+	{
+		unsigned int capacity = NATS_SLAB_CLASS_BYTES >> (i + NATS_SLAB_MIN_SHIFT);
+
+		if (capacity > max_blocks)
+		{
+			capacity = max_blocks;
+		}
+		if (mod_nats_ring_create(&new_slab->free[i], capacity ? capacity : 1, pool) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+	}
+	*slab = new_slab;
 	return SWITCH_STATUS_SUCCESS;
 }
 
+/* Only once no message of the slab can be destroyed anymore */
+void mod_nats_util_slab_destroy(mod_nats_slab_t *slab)
+{
+	void *block;
+	int i;
+
+	for (i = 0; slab && i < NATS_SLAB_CLASSES; i++)
+	{
+		while (slab->free[i] && mod_nats_ring_trypop(slab->free[i], &block) == SWITCH_STATUS_SUCCESS)
+		{
+			free(block);
+		}
+	}
+}
+
+mod_nats_message_t *mod_nats_util_msg_create(mod_nats_slab_t *slab, size_t payload_size)
+{
+	mod_nats_message_t *msg = NULL;
+	int size_class = slab ? mod_nats_util_slab_class(payload_size) : -1;
+
+	if (size_class >= 0)
+	{
+		payload_size = (size_t)1 << (size_class + NATS_SLAB_MIN_SHIFT);
+		if (mod_nats_ring_trypop(slab->free[size_class], (void **)&msg) != SWITCH_STATUS_SUCCESS)
+		{
+			msg = NULL;
+		}
+	}
+	if (!msg)
+	{
+		switch_malloc(msg, sizeof(mod_nats_message_t) + payload_size + 1);
+		if (mod_nats_globals.bench_running)
+		{
+			NATS_STAT_INC(mod_nats_globals.msg_allocs);
+		}
+	}
+	memset(msg, 0, sizeof(mod_nats_message_t));
+	msg->refs = 1;
+	msg->slab = size_class >= 0 ? slab : NULL;
+	msg->size_class = size_class;
+	msg->payload_size = payload_size;
+	msg->payload[0] = '\0';
+	return msg;
+}
+
+/* Give the block of a message back to its slab, or to the heap */
+static void mod_nats_util_msg_release(mod_nats_message_t *msg)
+{
+	if (msg->slab && mod_nats_ring_trypush(msg->slab->free[msg->size_class], msg) == SWITCH_STATUS_SUCCESS)
+	{
+		return;
+	}
+	free(msg);
+}
+
+/* Make room for len more payload bytes (plus the terminator), this may move the message */
+switch_status_t mod_nats_util_msg_reserve(mod_nats_message_t **msg, size_t len)
+{
+	mod_nats_message_t *grown;
+	size_t size = (*msg)->payload_size;
+
+	if ((*msg)->payload_len + len <= size)
+	{
+		return SWITCH_STATUS_SUCCESS;
+	}
+	while (size < (*msg)->payload_len + len)
+	{
+		size = size ? size * 2 : 1024;
+	}
+
+	if ((*msg)->slab)
+	{
+		/* Move to a block of a bigger class, or to the heap past the biggest one */
+		mod_nats_slab_t *slab = (*msg)->slab;
+		int size_class;
+
+		grown = mod_nats_util_msg_create(slab, size);
+		size = grown->payload_size;
+		size_class = grown->size_class;
+		memcpy(grown, *msg, sizeof(mod_nats_message_t) + (*msg)->payload_len);
+		grown->slab = size_class >= 0 ? slab : NULL;
+		grown->size_class = size_class;
+		mod_nats_util_msg_release(*msg);
+	}
+	else
+	{
+		if (!(grown = realloc(*msg, sizeof(mod_nats_message_t) + size + 1)))
+		{
+			return SWITCH_STATUS_MEMERR;
+		}
+		if (mod_nats_globals.bench_running)
+		{
+			NATS_STAT_INC(mod_nats_globals.msg_reallocs);
+		}
+	}
+	grown->payload_size = size;
+	*msg = grown;
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Drop a reference, the message is released with the last one. An unshared message is only
+ * seen by its owner so it skips the atomic decrement.
+ */
 void mod_nats_util_msg_destroy(mod_nats_message_t **msg)
 {
 	if (!msg || !*msg)
 		return;
-	switch_safe_free((*msg)->evname);
-	switch_safe_free((*msg)->pjson);
-	switch_safe_free(*msg);
+	if (__atomic_load_n(&(*msg)->refs, __ATOMIC_ACQUIRE) != 1 && __atomic_sub_fetch(&(*msg)->refs, 1, __ATOMIC_ACQ_REL))
+	{
+		*msg = NULL;
+		return;
+	}
+	if ((*msg)->event)
+	{
+		switch_event_destroy(&(*msg)->event);
+	}
+	mod_nats_util_msg_release(*msg);
+	*msg = NULL;
+}
+
+/* Serialize a message queued with a duplicate of its event, the duplicate is released afterwards */
+switch_status_t mod_nats_util_msg_serialize(mod_nats_message_t **msg)
+{
+	switch_event_t *event = (*msg)->event;
+	switch_status_t status;
+
+	if (!event)
+	{
+		return SWITCH_STATUS_SUCCESS;
+	}
+	(*msg)->event = NULL;
+	if ((status = mod_nats_util_msg_reserve(msg, mod_nats_encode_size(event, (*msg)->encoding, NULL))) == SWITCH_STATUS_SUCCESS)
+	{
+		status = mod_nats_encode(msg, event, NULL);
+	}
+	switch_event_destroy(&event);
+	return status;
+}
+
+/* Duplicate an event for the publisher workers, copying only the headers the projection lets
+ * through so the queued duplicate is as small as the message it becomes.
+ */
+switch_status_t mod_nats_util_event_dup(switch_event_t **event, switch_event_t *todup, const mod_nats_projection_t *projection)
+{
+	switch_event_header_t *hp;
+	int i;
+
+	if (!projection)
+	{
+		return switch_event_dup(event, todup);
+	}
+	/* A clone, as switch_event_dup makes: no fresh core headers or sequence number, and the
+	 * Event-Subclass header only when the projection keeps it
+	 */
+	if (switch_event_create_subclass(event, SWITCH_EVENT_CLONE, NULL) != SWITCH_STATUS_SUCCESS)
+	{
+		return SWITCH_STATUS_GENERR;
+	}
+	(*event)->event_id = todup->event_id;
+	(*event)->event_user_data = todup->event_user_data;
+	(*event)->bind_user_data = todup->bind_user_data;
+	(*event)->flags = todup->flags;
+	if (todup->subclass_name)
+	{
+		(*event)->subclass_name = strdup(todup->subclass_name);
+	}
+	for (hp = todup->headers; hp; hp = hp->next)
+	{
+		if (!mod_nats_projection_match(projection, hp->name))
+		{
+			continue;
+		}
+		if (hp->idx)
+		{
+			for (i = 0; i < hp->idx; i++)
+			{
+				switch_event_add_header_string(*event, SWITCH_STACK_PUSH, hp->name, hp->array[i]);
+			}
+		}
+		else
+		{
+			switch_event_add_header_string(*event, SWITCH_STACK_BOTTOM, hp->name, hp->value);
+		}
+	}
+	if (todup->body && mod_nats_projection_match(projection, "_body"))
+	{
+		(*event)->body = strdup(todup->body);
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* FNV-1a, used to shard events across the publisher workers */
+uint32_t mod_nats_util_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	while (str && *str)
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Shard of the events of a call, see mod_nats_message_t */
+uint16_t mod_nats_util_shard(const char *uuid)
+{
+	return uuid ? (uint16_t)(mod_nats_util_hash(uuid) & 0xffff) : 0;
 }
 
 /* For Emacs:
@@ -0,0 +1,351 @@
+/*
+* FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+* Copyright (C) 2005-2012, Anthony Minessale II <anthm@freeswitch.org>
+*
+* Version: MPL 1.1
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is FreeSWITCH Modular Media Switching Software Library / Soft-Switch Application
+*
+* The Initial Developer of the Original Code is
+* Anthony Minessale II <anthm@freeswitch.org>
+* Portions created by the Initial Developer are Copyright (C)
+* the Initial Developer. All Rights Reserved.
+*
+* Based on mod_skel by
+* Anthony Minessale II <anthm@freeswitch.org>
+*
+* Contributor(s):
+*
+* Emmanuel Schmidbauer <eschmidbauer@gmail.com>
+*
+* mod_nats -- Sends FreeSWITCH events to NATS queues
+*
+*/
+
+
+#include "mod_nats.h"
+
+/* XML lookups (directory, dialplan, configuration...) served over NATS request-reply, in place of
+ * mod_xml_curl. A lookup is sent on xml_subject as JSON: the params of the lookup plus section,
+ * tag_name, key_name and key_value. The reply is the XML document. An empty reply, or the usual
+ * <result status="not found"/> document, means the backend has nothing for the lookup.
+ *
+ * Replies are cached for xml_cache_ttl_ms, and the lack of one for xml_negative_ttl_ms, under a
+ * key made of the section, tag, key and the xml_cache_key params of the lookup. The cache is
+ * split in NATS_XML_SHARDS shards by hash of the key, each with its own lock and at most
+ * xml_cache_size / NATS_XML_SHARDS entries. Lookups whose key does not fit in NATS_XML_KEY_SIZE
+ * are not cached. While a lookup is in flight the identical ones wait for its reply instead of
+ * sending their own. Failed lookups are not cached, the ones that were waiting for them fail too.
+ */
+
+switch_status_t mod_nats_xml_init(mod_nats_publisher_profile_t *profile, const char *sections, const char *cache_key)
+{
+	char *tmp;
+	int i;
+
+	profile->xml_sections = switch_xml_parse_section_string(zstr(sections) ? "directory" : sections);
+	if (profile->xml_sections == SWITCH_XML_SECTION_RESULT)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] no valid xml_sections in [%s]\n", profile->name, sections);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	tmp = switch_core_strdup(profile->pool, zstr(cache_key) ? "user,domain,action,purpose,profile,Caller-Context,Caller-Destination-Number,Caller-Caller-ID-Number" : cache_key);
+	profile->xml_cache_key = switch_core_alloc(profile->pool, sizeof(char *) * 64);
+	profile->xml_cache_key_count = switch_separate_string(tmp, ',', profile->xml_cache_key, 64);
+
+	profile->xml_shards = switch_core_alloc(profile->pool, sizeof(mod_nats_xml_shard_t) * NATS_XML_SHARDS);
+	for (i = 0; i < NATS_XML_SHARDS; i++)
+	{
+		if (switch_mutex_init(&profile->xml_shards[i].mutex, SWITCH_MUTEX_NESTED, profile->pool) != SWITCH_STATUS_SUCCESS ||
+			switch_thread_cond_create(&profile->xml_shards[i].cond, profile->pool) != SWITCH_STATUS_SUCCESS)
+		{
+			return SWITCH_STATUS_GENERR;
+		}
+		switch_core_hash_init(&profile->xml_shards[i].entries);
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static void mod_nats_xml_entry_free(mod_nats_xml_entry_t *entry)
+{
+	switch_safe_free(entry->text);
+	switch_safe_free(entry->key);
+	free(entry);
+}
+
+/* Called with the shard locked when it is full, frees some expired entries nobody is using */
+static void mod_nats_xml_sweep(mod_nats_xml_shard_t *shard, switch_time_t now)
+{
+	mod_nats_xml_entry_t *expired[64];
+	switch_hash_index_t *hi;
+	void *val;
+	int count = 0, i;
+
+	for (hi = switch_core_hash_first(shard->entries); hi && count < 64; hi = switch_core_hash_next(&hi))
+	{
+		mod_nats_xml_entry_t *entry;
+
+		switch_core_hash_this(hi, NULL, NULL, &val);
+		entry = (mod_nats_xml_entry_t *)val;
+		if (!entry->pending && !entry->waiters && entry->expires <= now)
+		{
+			expired[count++] = entry;
+		}
+	}
+	switch_safe_free(hi);
+
+	for (i = 0; i < count; i++)
+	{
+		switch_core_hash_delete(shard->entries, expired[i]->key);
+		mod_nats_xml_entry_free(expired[i]);
+		shard->count--;
+	}
+}
+
+static switch_bool_t mod_nats_xml_not_found(switch_xml_t xml)
+{
+	switch_xml_t section, result;
+
+	return (section = switch_xml_find_child(xml, "section", "name", "result")) && (result = switch_xml_child(section, "result")) &&
+		   !strcasecmp(switch_xml_attr_soft(result, "status"), "not found");
+}
+
+/* Ask the backend, returns the XML text of the reply, NULL with *failed unset when it has nothing */
+static char *mod_nats_xml_request(mod_nats_publisher_profile_t *profile, const char *section, const char *tag_name, const char *key_name,
+								  const char *key_value, switch_event_t *params, switch_bool_t *failed)
+{
+	switch_event_t *request = NULL;
+	char *payload = NULL, *text = NULL;
+	natsMsg *reply = NULL;
+	natsStatus s;
+
+	if (params)
+	{
+		switch_event_dup(&request, params);
+	}
+	else
+	{
+		switch_event_create(&request, SWITCH_EVENT_REQUEST_PARAMS);
+	}
+	if (!request)
+	{
+		*failed = SWITCH_TRUE;
+		return NULL;
+	}
+	switch_event_add_header_string(request, SWITCH_STACK_BOTTOM, "section", switch_str_nil(section));
+	switch_event_add_header_string(request, SWITCH_STACK_BOTTOM, "tag_name", switch_str_nil(tag_name));
+	switch_event_add_header_string(request, SWITCH_STACK_BOTTOM, "key_name", switch_str_nil(key_name));
+	switch_event_add_header_string(request, SWITCH_STACK_BOTTOM, "key_value", switch_str_nil(key_value));
+	switch_event_serialize_json(request, &payload);
+	switch_event_destroy(&request);
+
+	s = mod_nats_request_profile(profile, profile->xml_subject, payload ? payload : "{}", profile->xml_timeout_ms, &reply);
+	switch_safe_free(payload);
+	if (s != NATS_OK)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] xml lookup [%s/%s] on [%s] failed: %s\n", profile->name, switch_str_nil(section),
+						  switch_str_nil(key_value), profile->xml_subject, natsStatus_GetText(s));
+		*failed = SWITCH_TRUE;
+		return NULL;
+	}
+
+	*failed = SWITCH_FALSE;
+	if (natsMsg_GetDataLength(reply) > 0)
+	{
+		switch_xml_t xml = switch_xml_parse_str_dup(natsMsg_GetData(reply));
+
+		if (!xml)
+		{
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile[%s] xml lookup [%s/%s] returned invalid XML\n", profile->name,
+							  switch_str_nil(section), switch_str_nil(key_value));
+		}
+		else if (!mod_nats_xml_not_found(xml))
+		{
+			text = strdup(natsMsg_GetData(reply));
+		}
+		if (xml)
+		{
+			switch_xml_free(xml);
+		}
+	}
+	natsMsg_Destroy(reply);
+	return text;
+}
+
+static switch_xml_t mod_nats_xml_fetch(const char *section, const char *tag_name, const char *key_name, const char *key_value, switch_event_t *params,
+									   void *user_data)
+{
+	mod_nats_publisher_profile_t *profile = (mod_nats_publisher_profile_t *)user_data;
+	mod_nats_xml_shard_t *shard;
+	mod_nats_xml_entry_t *entry;
+	switch_xml_t xml = NULL;
+	switch_time_t now = switch_time_now(), deadline;
+	switch_bool_t failed = SWITCH_FALSE;
+	char key[NATS_XML_KEY_SIZE];
+	char *text;
+	size_t len;
+	int i;
+
+	len = switch_snprintf(key, sizeof(key), "%s|%s|%s|%s", switch_str_nil(section), switch_str_nil(tag_name), switch_str_nil(key_name), switch_str_nil(key_value));
+	for (i = 0; params && i < profile->xml_cache_key_count && len < sizeof(key) - 1; i++)
+	{
+		const char *value = switch_event_get_header(params, profile->xml_cache_key[i]);
+
+		len += switch_snprintf(key + len, sizeof(key) - len, "|%s", switch_str_nil(value));
+	}
+	if (len >= sizeof(key) - 1)
+	{
+		/* A truncated key could match another lookup, this one is not cached */
+		NATS_STAT_INC(profile->xml_misses);
+		if ((text = mod_nats_xml_request(profile, section, tag_name, key_name, key_value, params, &failed)))
+		{
+			xml = switch_xml_parse_str_dup(text);
+			free(text);
+		}
+		if (failed)
+		{
+			NATS_STAT_INC(profile->xml_errors);
+		}
+		return xml;
+	}
+	shard = &profile->xml_shards[mod_nats_util_hash(key) % NATS_XML_SHARDS];
+
+	switch_mutex_lock(shard->mutex);
+	if ((entry = switch_core_hash_find(shard->entries, key)) && entry->pending)
+	{
+		/* Wait for the identical lookup in flight */
+		NATS_STAT_INC(profile->xml_coalesced);
+		deadline = now + (profile->xml_timeout_ms + 100) * 1000;
+		entry->waiters++;
+		while (entry->pending && (now = switch_time_now()) < deadline)
+		{
+			switch_thread_cond_timedwait(shard->cond, shard->mutex, deadline - now);
+		}
+		entry->waiters--;
+		if (!entry->pending && !entry->failed && entry->text)
+		{
+			xml = switch_xml_parse_str_dup(entry->text);
+		}
+		switch_mutex_unlock(shard->mutex);
+		return xml;
+	}
+	if (entry && entry->expires > now && !entry->failed)
+	{
+		NATS_STAT_INC(profile->xml_hits);
+		if (entry->text)
+		{
+			xml = switch_xml_parse_str_dup(entry->text);
+		}
+		switch_mutex_unlock(shard->mutex);
+		return xml;
+	}
+	if (!entry)
+	{
+		if (shard->count >= profile->xml_cache_size / NATS_XML_SHARDS)
+		{
+			mod_nats_xml_sweep(shard, now);
+		}
+		if (shard->count < profile->xml_cache_size / NATS_XML_SHARDS)
+		{
+			switch_zmalloc(entry, sizeof(mod_nats_xml_entry_t));
+			entry->key = strdup(key);
+			switch_core_hash_insert(shard->entries, entry->key, entry);
+			shard->count++;
+		}
+	}
+	if (entry)
+	{
+		entry->pending = SWITCH_TRUE;
+	}
+	switch_mutex_unlock(shard->mutex);
+
+	NATS_STAT_INC(profile->xml_misses);
+	text = mod_nats_xml_request(profile, section, tag_name, key_name, key_value, params, &failed);
+	if (failed)
+	{
+		NATS_STAT_INC(profile->xml_errors);
+	}
+	if (text)
+	{
+		xml = switch_xml_parse_str_dup(text);
+	}
+
+	if (entry)
+	{
+		switch_mutex_lock(shard->mutex);
+		switch_safe_free(entry->text);
+		entry->text = text;
+		entry->failed = failed;
+		entry->expires = failed ? 0 : switch_time_now() + (text ? profile->xml_cache_ttl_ms : profile->xml_negative_ttl_ms) * 1000;
+		entry->pending = SWITCH_FALSE;
+		switch_thread_cond_broadcast(shard->cond);
+		switch_mutex_unlock(shard->mutex);
+	}
+	else
+	{
+		switch_safe_free(text);
+	}
+	return xml;
+}
+
+switch_status_t mod_nats_xml_bind(mod_nats_publisher_profile_t *profile)
+{
+	if (switch_xml_bind_search_function_ret(mod_nats_xml_fetch, profile->xml_sections, profile, &profile->xml_binding) != SWITCH_STATUS_SUCCESS)
+	{
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Profile[%s] cannot bind xml lookups\n", profile->name);
+		return SWITCH_STATUS_GENERR;
+	}
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Profile[%s] serving xml lookups from [%s]\n", profile->name, profile->xml_subject);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Unbinding waits for the lookups in progress, then the cache can go */
+void mod_nats_xml_destroy(mod_nats_publisher_profile_t *profile)
+{
+	switch_hash_index_t *hi = NULL;
+	void *val;
+	int i;
+
+	if (profile->xml_binding)
+	{
+		switch_xml_unbind_search_function(&profile->xml_binding);
+	}
+	for (i = 0; profile->xml_shards && i < NATS_XML_SHARDS; i++)
+	{
+		if (!profile->xml_shards[i].entries)
+		{
+			continue;
+		}
+		while ((hi = switch_core_hash_first_iter(profile->xml_shards[i].entries, hi)))
+		{
+			const void *key;
+
+			switch_core_hash_this(hi, &key, NULL, &val);
+			switch_core_hash_delete(profile->xml_shards[i].entries, (const char *)key);
+			mod_nats_xml_entry_free((mod_nats_xml_entry_t *)val);
+		}
+		switch_core_hash_destroy(&profile->xml_shards[i].entries);
+	}
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4
+ */
@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# Fault injection for the failover of a publisher profile. Starts a three node nats-server cluster
+# on 127.0.0.1, waits for the profile to connect, kills the node it is connected to and checks
+# that it fails over to another node within the given time, from `nats status <profile> json`.
+# The first connection of the profile must list the three nodes, e.g.
+#
+#   <param name="url" value="nats://127.0.0.1:4222,nats://127.0.0.1:4223,nats://127.0.0.1:4224" />
+#
+# then, with FreeSWITCH running mod_nats:
+#
+#   failover_test.sh default 2000
+#
+# Needs nats-server, fs_cli and jq. BASE_PORT (4222) and CLUSTER_PORT (6222) move the cluster.
+#
+
+PROFILE=${1:-default}
+MAX_FAILOVER_MS=${2:-2000}
+TIMEOUT=${3:-30}
+BASE_PORT=${BASE_PORT:-4222}
+CLUSTER_PORT=${CLUSTER_PORT:-6222}
+WORK=$(mktemp -d)
+declare -A PIDS
+
+cleanup() {
+  for pid in "${PIDS[@]}" ; do
+    kill "$pid" 2>/dev/null
+  done
+  wait 2>/dev/null
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# First connection of the profile: state server failovers last_failover_ms
+status() {
+  fs_cli -x "nats status $PROFILE json" | jq -r '.[0].connections[0] | "\(.state) \(.server) \(.failovers) \(.last_failover_ms)"'
+}
+
+ROUTES=""
+for i in 0 1 2 ; do
+  ROUTES="$ROUTES${ROUTES:+,}nats://127.0.0.1:$((CLUSTER_PORT + i))"
+done
+for i in 0 1 2 ; do
+  port=$((BASE_PORT + i))
+  nats-server -a 127.0.0.1 -p "$port" -n "node$i" -js -sd "$WORK/node$i" \
+    --cluster_name mod_nats_failover --cluster "nats://127.0.0.1:$((CLUSTER_PORT + i))" --routes "$ROUTES" \
+    > "$WORK/node$i.log" 2>&1 &
+  PIDS[$port]=$!
+done
+
+echo "waiting for profile [$PROFILE] to connect"
+for ((t = 0; t < TIMEOUT * 10; t++)) ; do
+  read -r state server failovers last <<< "$(status)"
+  [ "$state" = "connected" ] && break
+  sleep 0.1
+done
+if [ "$state" != "connected" ] ; then
+  echo "FAIL profile [$PROFILE] did not connect to the cluster"
+  exit 1
+fi
+
+port=${server##*:}
+port=${port%%/*}
+if [ -z "${PIDS[$port]}" ] ; then
+  echo "FAIL profile [$PROFILE] is on [$server], not a node of the test cluster"
+  exit 1
+fi
+echo "profile [$PROFILE] on [$server], failovers $failovers, killing node on port $port"
+kill -9 "${PIDS[$port]}"
+unset "PIDS[$port]"
+
+for ((t = 0; t < TIMEOUT * 10; t++)) ; do
+  read -r new_state new_server new_failovers last <<< "$(status)"
+  [ "$new_state" = "connected" ] && [ "$new_failovers" -gt "$failovers" ] 2>/dev/null && break
+  sleep 0.1
+done
+if [ "$new_state" != "connected" ] || [ "$new_failovers" -le "$failovers" ] 2>/dev/null ; then
+  echo "FAIL profile [$PROFILE] did not fail over within ${TIMEOUT}s (state $new_state)"
+  exit 1
+fi
+
+echo "profile [$PROFILE] failed over to [$new_server] in ${last}ms"
+if awk -v last="$last" -v max="$MAX_FAILOVER_MS" 'BEGIN { exit !(last > max) }' ; then
+  echo "FAIL last_failover_ms $last is above $MAX_FAILOVER_MS"
+  exit 1
+fi
+echo "OK"
@@ -0,0 +1,18 @@
+#!/bin/bash
+#
+# Train a zstd dictionary for the compression_dictionary param from live JSON events.
+# Capture while the profile publishes uncompressed events, e.g.:
+#
+#   train_zstd_dictionary.sh 'mystream.all.>' 20000 /etc/freeswitch/nats/events.zdict
+#
+
+SUBJECT=${1:?usage: $0 <subject> [count] [output]}
+COUNT=${2:-10000}
+OUTPUT=${3:-events.zdict}
+SAMPLES=$(mktemp -d)
+
+trap 'rm -rf "$SAMPLES"' EXIT
+
+# One JSON event per line, one sample file per event
+nats sub "$SUBJECT" --count "$COUNT" --raw | split -l 1 -a 6 - "$SAMPLES/event."
+zstd --train "$SAMPLES"/event.* --maxdict=65536 -o "$OUTPUT"